@@ -0,0 +1,412 @@
+#include "common.h"
+
+#ifdef JIT_ENABLED
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "assembler.h"
+#include "memory.h"
+
+void initAssembler(VM *vm, Assembler *as)
+{
+    as->vm = vm;
+    as->code = NULL;
+    as->count = 0;
+    as->capacity = 0;
+}
+
+void freeAssembler(Assembler *as)
+{
+    FREE_ARRAY(as->vm, uint8_t, as->code, as->capacity);
+    initAssembler(as->vm, as);
+}
+
+void initPatchList(VM *vm, PatchList *list)
+{
+    list->vm = vm;
+    list->patches = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+void writePatchList(PatchList *list, int at, int target)
+{
+    if (list->capacity < list->count + 1)
+    {
+        int oldCapacity = list->capacity;
+        list->capacity = GROW_CAPACITY(oldCapacity);
+        list->patches = GROW_ARRAY(list->vm, Patch, list->patches, oldCapacity, list->capacity);
+    }
+    list->patches[list->count].at = at;
+    list->patches[list->count].target = target;
+    list->count++;
+}
+
+void freePatchList(PatchList *list)
+{
+    FREE_ARRAY(list->vm, Patch, list->patches, list->capacity);
+    initPatchList(list->vm, list);
+}
+
+void asmByte(Assembler *as, uint8_t byte)
+{
+    if (as->capacity < as->count + 1)
+    {
+        int oldCapacity = as->capacity;
+        as->capacity = GROW_CAPACITY(oldCapacity);
+        as->code = GROW_ARRAY(as->vm, uint8_t, as->code, oldCapacity, as->capacity);
+    }
+    as->code[as->count++] = byte;
+}
+
+void asm32(Assembler *as, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        asmByte(as, (value >> (i * 8)) & 0xff);
+    }
+}
+
+void asm64(Assembler *as, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        asmByte(as, (value >> (i * 8)) & 0xff);
+    }
+}
+
+// REX prefix: w selects 64-bit operands, reg and base get their high bit from it when they're r8-r15 (or xmm8-15).
+static void rex(Assembler *as, bool w, int reg, int base)
+{
+    uint8_t prefix = 0x40 | (w ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((base & 8) ? 0x01 : 0);
+    if (prefix != 0x40)
+        asmByte(as, prefix);
+}
+
+// ModRM for [base + disp32], bases in the rsp column need a SIB byte.
+static void memoryOperand(Assembler *as, int reg, int base, int32_t disp)
+{
+    asmByte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP)
+        asmByte(as, 0x24);
+    asm32(as, (uint32_t)disp);
+}
+
+// ModRM for two registers.
+static void registerOperand(Assembler *as, int reg, int rm)
+{
+    asmByte(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+void asmPush(Assembler *as, int reg)
+{
+    rex(as, false, 0, reg);
+    asmByte(as, 0x50 + (reg & 7));
+}
+
+void asmPop(Assembler *as, int reg)
+{
+    rex(as, false, 0, reg);
+    asmByte(as, 0x58 + (reg & 7));
+}
+
+void asmLoad(Assembler *as, int reg, int base, int32_t disp)
+{
+    rex(as, true, reg, base);
+    asmByte(as, 0x8b);
+    memoryOperand(as, reg, base, disp);
+}
+
+void asmStore(Assembler *as, int base, int32_t disp, int reg)
+{
+    rex(as, true, reg, base);
+    asmByte(as, 0x89);
+    memoryOperand(as, reg, base, disp);
+}
+
+void asmMoveImmediate(Assembler *as, int reg, uint64_t value)
+{
+    rex(as, true, 0, reg);
+    asmByte(as, 0xb8 + (reg & 7));
+    asm64(as, value);
+}
+
+void asmRegisterOp(Assembler *as, uint8_t opcode, int dst, int src)
+{
+    rex(as, true, src, dst);
+    asmByte(as, opcode);
+    registerOperand(as, src, dst);
+}
+
+void asmAddImmediate(Assembler *as, int reg, int32_t value)
+{
+    rex(as, true, 0, reg);
+    asmByte(as, 0x81);
+    registerOperand(as, value < 0 ? 5 : 0, reg);
+    asm32(as, (uint32_t)(value < 0 ? -value : value));
+}
+
+void asmStoreDword(Assembler *as, int base, int32_t disp, uint32_t value)
+{
+    rex(as, false, 0, base);
+    asmByte(as, 0xc7);
+    memoryOperand(as, 0, base, disp);
+    asm32(as, value);
+}
+
+void asmCompareDword(Assembler *as, int base, int32_t disp, uint32_t value)
+{
+    rex(as, false, 0, base);
+    asmByte(as, 0x81);
+    memoryOperand(as, 7, base, disp);
+    asm32(as, value);
+}
+
+void asmCompareByte(Assembler *as, int base, int32_t disp, uint8_t value)
+{
+    rex(as, false, 0, base);
+    asmByte(as, 0x80);
+    memoryOperand(as, 7, base, disp);
+    asmByte(as, value);
+}
+
+void asmStoreByteImmediate(Assembler *as, int base, int32_t disp, uint8_t value)
+{
+    rex(as, false, 0, base);
+    asmByte(as, 0xc6);
+    memoryOperand(as, 0, base, disp);
+    asmByte(as, value);
+}
+
+void asmStoreAl(Assembler *as, int base, int32_t disp)
+{
+    rex(as, false, RAX, base);
+    asmByte(as, 0x88);
+    memoryOperand(as, RAX, base, disp);
+}
+
+void asmDecrementWord(Assembler *as, int base, int32_t disp)
+{
+    asmByte(as, 0x66);
+    rex(as, false, 0, base);
+    asmByte(as, 0x83);
+    memoryOperand(as, 5, base, disp);
+    asmByte(as, 1);
+}
+
+// The mandatory prefix goes before REX.
+void asmLoadDouble(Assembler *as, int xmm, int base, int32_t disp)
+{
+    asmByte(as, 0xf2);
+    rex(as, false, xmm, base);
+    asmByte(as, 0x0f);
+    asmByte(as, 0x10);
+    memoryOperand(as, xmm, base, disp);
+}
+
+void asmStoreDouble(Assembler *as, int base, int32_t disp, int xmm)
+{
+    asmByte(as, 0xf2);
+    rex(as, false, xmm, base);
+    asmByte(as, 0x0f);
+    asmByte(as, 0x11);
+    memoryOperand(as, xmm, base, disp);
+}
+
+void asmMoveToDouble(Assembler *as, int xmm, int reg)
+{
+    asmByte(as, 0x66);
+    rex(as, true, xmm, reg);
+    asmByte(as, 0x0f);
+    asmByte(as, 0x6e);
+    registerOperand(as, xmm, reg);
+}
+
+void asmMoveDouble(Assembler *as, int dst, int src)
+{
+    asmSseOp(as, 0x66, 0x28, dst, src);
+}
+
+void asmSseOp(Assembler *as, uint8_t prefix, uint8_t opcode, int dst, int src)
+{
+    asmByte(as, prefix);
+    rex(as, false, dst, src);
+    asmByte(as, 0x0f);
+    asmByte(as, opcode);
+    registerOperand(as, dst, src);
+}
+
+void asmCompareDoubles(Assembler *as, int a, int b)
+{
+    asmSseOp(as, 0x66, 0x2e, a, b);
+}
+
+void asmSetCondition(Assembler *as, int condition, int reg)
+{
+    asmByte(as, 0x0f);
+    asmByte(as, 0x90 | condition);
+    registerOperand(as, 0, reg);
+}
+
+int asmJumpIf(Assembler *as, int condition)
+{
+    asmByte(as, 0x0f);
+    asmByte(as, 0x80 | condition);
+    asm32(as, 0);
+    return as->count - 4;
+}
+
+int asmJump(Assembler *as)
+{
+    asmByte(as, 0xe9);
+    asm32(as, 0);
+    return as->count - 4;
+}
+
+void asmPatchRel32(Assembler *as, int at, int target)
+{
+    int32_t rel = (int32_t)(target - (at + 4));
+    memcpy(as->code + at, &rel, sizeof(rel));
+}
+
+void asmLand(Assembler *as, int at)
+{
+    asmPatchRel32(as, at, as->count);
+}
+
+int asmJumpIfNotNumber(Assembler *as, int base, int32_t disp)
+{
+#ifdef NAN_BOXING
+    asmLoad(as, RAX, base, disp);
+    asmMoveImmediate(as, RCX, QNAN);
+    asmRegisterOp(as, ASM_AND, RAX, RCX);
+    asmRegisterOp(as, ASM_CMP, RAX, RCX);
+    return asmJumpIf(as, CC_E);
+#else
+    asmCompareDword(as, base, disp + TYPE_OFFSET, VAL_NUMBER);
+    return asmJumpIf(as, CC_NE);
+#endif
+}
+
+void asmJumpIfFalsey(Assembler *as, int base, int32_t disp, int jumps[2])
+{
+#ifdef NAN_BOXING
+    asmLoad(as, RAX, base, disp);
+    asmMoveImmediate(as, RCX, NIL_VAL);
+    asmRegisterOp(as, ASM_CMP, RAX, RCX);
+    jumps[0] = asmJumpIf(as, CC_E);
+    asmMoveImmediate(as, RCX, FALSE_VAL);
+    asmRegisterOp(as, ASM_CMP, RAX, RCX);
+    jumps[1] = asmJumpIf(as, CC_E);
+#else
+    asmCompareDword(as, base, disp + TYPE_OFFSET, VAL_NIL);
+    jumps[0] = asmJumpIf(as, CC_E);
+    asmCompareDword(as, base, disp + TYPE_OFFSET, VAL_BOOL);
+    int truthy = asmJumpIf(as, CC_NE);
+    asmCompareByte(as, base, disp + BOOLEAN_OFFSET, 0);
+    jumps[1] = asmJumpIf(as, CC_E);
+    asmLand(as, truthy);
+#endif
+}
+
+void asmJumpIfNotValue(Assembler *as, int base, int32_t disp, Value value, int jumps[2])
+{
+    jumps[1] = -1;
+#ifdef NAN_BOXING
+    asmLoad(as, RAX, base, disp);
+    asmMoveImmediate(as, RCX, value);
+    asmRegisterOp(as, ASM_CMP, RAX, RCX);
+    jumps[0] = asmJumpIf(as, CC_NE);
+#else
+    asmCompareDword(as, base, disp + TYPE_OFFSET, value.type);
+    jumps[0] = asmJumpIf(as, CC_NE);
+    // Only the union member of the type is meaningful, the rest of it is whatever was there before.
+    switch (value.type)
+    {
+    case VAL_BOOL:
+        asmCompareByte(as, base, disp + BOOLEAN_OFFSET, AS_BOOL(value));
+        jumps[1] = asmJumpIf(as, CC_NE);
+        break;
+    case VAL_NUMBER:
+    case VAL_OBJ:
+    {
+        uint64_t payload;
+        memcpy(&payload, &value.as, sizeof(payload));
+        asmLoad(as, RAX, base, disp + NUMBER_OFFSET);
+        asmMoveImmediate(as, RCX, payload);
+        asmRegisterOp(as, ASM_CMP, RAX, RCX);
+        jumps[1] = asmJumpIf(as, CC_NE);
+        break;
+    }
+    case VAL_NIL:
+        break;
+    }
+#endif
+}
+
+void asmStoreNumber(Assembler *as, int base, int32_t disp, int xmm)
+{
+#ifndef NAN_BOXING
+    asmStoreDword(as, base, disp + TYPE_OFFSET, VAL_NUMBER);
+#endif
+    asmStoreDouble(as, base, disp + NUMBER_OFFSET, xmm);
+}
+
+void asmStoreBool(Assembler *as, int base, int32_t disp)
+{
+#ifdef NAN_BOXING
+    asmByte(as, 0x0f); // movzx eax, al
+    asmByte(as, 0xb6);
+    asmByte(as, 0xc0);
+    asmMoveImmediate(as, RCX, FALSE_VAL);
+    asmRegisterOp(as, ASM_ADD, RAX, RCX);
+    asmStore(as, base, disp, RAX);
+#else
+    asmStoreDword(as, base, disp + TYPE_OFFSET, VAL_BOOL);
+    asmStoreAl(as, base, disp + BOOLEAN_OFFSET);
+#endif
+}
+
+void asmStoreValue(Assembler *as, int base, int32_t disp, Value value)
+{
+    uint64_t words[sizeof(Value) / 8];
+    memset(words, 0, sizeof(words));
+    memcpy(words, &value, sizeof(Value));
+    for (int i = 0; i < VALUE_SIZE / 8; i++)
+    {
+        asmMoveImmediate(as, RAX, words[i]);
+        asmStore(as, base, disp + i * 8, RAX);
+    }
+}
+
+void asmCopyValue(Assembler *as, int dstBase, int32_t dstDisp, int srcBase, int32_t srcDisp)
+{
+    for (int i = 0; i < VALUE_SIZE; i += 8)
+    {
+        asmLoad(as, RAX, srcBase, srcDisp + i);
+        asmStore(as, dstBase, dstDisp + i, RAX);
+    }
+}
+
+// Written while writable, then flipped to executable, never both at once.
+uint8_t *asmFinish(Assembler *as)
+{
+    uint8_t *memory = mmap(NULL, as->count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return NULL;
+    memcpy(memory, as->code, as->count);
+    if (mprotect(memory, as->count, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(memory, as->count);
+        return NULL;
+    }
+    return memory;
+}
+
+void asmRelease(uint8_t *code, size_t size)
+{
+    munmap(code, size);
+}
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef clox_assembler_h
+#define clox_assembler_h
+
+#include "common.h"
+#include "value.h"
+
+/*
+A small x86-64 (System V) encoder shared by the JIT tiers.
+Only the instruction forms they need are here: 64-bit moves and ALU ops between registers and [base + disp32]
+operands, scalar SSE2 on xmm0-xmm15 and rel32 jumps.
+*/
+
+enum
+{
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSP = 4,
+    RBP = 5,
+    RSI = 6,
+    RDI = 7,
+    R12 = 12,
+    R13 = 13,
+    R14 = 14,
+    R15 = 15
+};
+
+// Condition codes, the low nibble of jcc and setcc.
+enum
+{
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+    CC_P = 0xa,
+    CC_NP = 0xb
+};
+
+// Two register 64-bit ALU opcodes for asmRegisterOp().
+#define ASM_ADD 0x01
+#define ASM_AND 0x21
+#define ASM_XOR 0x31
+#define ASM_CMP 0x39
+#define ASM_MOV 0x89
+
+// Scalar double opcodes for asmSseOp() with the 0xf2 prefix.
+#define ASM_ADDSD 0x58
+#define ASM_MULSD 0x59
+#define ASM_SUBSD 0x5c
+#define ASM_DIVSD 0x5e
+
+typedef struct
+{
+    VM *vm; // Owner of the buffer's memory.
+    uint8_t *code;
+    int count;
+    int capacity;
+} Assembler;
+
+// A rel32 operand waiting for the position of whatever `target` names, a bytecode offset, an exit...
+typedef struct
+{
+    int at;
+    int target;
+} Patch;
+
+typedef struct
+{
+    VM *vm;
+    Patch *patches;
+    int count;
+    int capacity;
+} PatchList;
+
+void initAssembler(VM *vm, Assembler *as);
+void freeAssembler(Assembler *as);
+void initPatchList(VM *vm, PatchList *list);
+void writePatchList(PatchList *list, int at, int target);
+void freePatchList(PatchList *list);
+
+void asmByte(Assembler *as, uint8_t byte);
+void asm32(Assembler *as, uint32_t value);
+void asm64(Assembler *as, uint64_t value);
+
+void asmPush(Assembler *as, int reg);
+void asmPop(Assembler *as, int reg);
+// mov reg, [base + disp]
+void asmLoad(Assembler *as, int reg, int base, int32_t disp);
+// mov [base + disp], reg
+void asmStore(Assembler *as, int base, int32_t disp, int reg);
+// mov reg, imm64
+void asmMoveImmediate(Assembler *as, int reg, uint64_t value);
+// op dst, src
+void asmRegisterOp(Assembler *as, uint8_t opcode, int dst, int src);
+// add reg, imm32 (a sub for negative values)
+void asmAddImmediate(Assembler *as, int reg, int32_t value);
+// mov dword [base + disp], imm32
+void asmStoreDword(Assembler *as, int base, int32_t disp, uint32_t value);
+// cmp dword [base + disp], imm32
+void asmCompareDword(Assembler *as, int base, int32_t disp, uint32_t value);
+// cmp byte [base + disp], imm8
+void asmCompareByte(Assembler *as, int base, int32_t disp, uint8_t value);
+// mov byte [base + disp], imm8
+void asmStoreByteImmediate(Assembler *as, int base, int32_t disp, uint8_t value);
+// mov byte [base + disp], al
+void asmStoreAl(Assembler *as, int base, int32_t disp);
+// sub word [base + disp], 1
+void asmDecrementWord(Assembler *as, int base, int32_t disp);
+
+// movsd xmm, [base + disp]
+void asmLoadDouble(Assembler *as, int xmm, int base, int32_t disp);
+// movsd [base + disp], xmm
+void asmStoreDouble(Assembler *as, int base, int32_t disp, int xmm);
+// movq xmm, reg
+void asmMoveToDouble(Assembler *as, int xmm, int reg);
+// movapd dst, src
+void asmMoveDouble(Assembler *as, int dst, int src);
+// prefix 0f op dst, src
+void asmSseOp(Assembler *as, uint8_t prefix, uint8_t opcode, int dst, int src);
+// ucomisd a, b: flags as if comparing a to b, unordered sets ZF, PF and CF.
+void asmCompareDoubles(Assembler *as, int a, int b);
+// setcc on al or cl.
+void asmSetCondition(Assembler *as, int condition, int reg);
+
+// jcc and jmp with an empty rel32, they return its position for asmLand() or asmPatchRel32().
+int asmJumpIf(Assembler *as, int condition);
+int asmJump(Assembler *as);
+void asmPatchRel32(Assembler *as, int at, int target);
+// Points a jump at the current position.
+void asmLand(Assembler *as, int at);
+
+/*
+Value layout, the same for both Value representations.
+The asmJumpIf...() forms return the position of their jump like asmJumpIf().
+*/
+#define VALUE_SIZE ((int)sizeof(Value))
+#ifdef NAN_BOXING
+#define NUMBER_OFFSET 0
+#else
+#define TYPE_OFFSET ((int)offsetof(Value, type))
+#define NUMBER_OFFSET ((int)offsetof(Value, as.number))
+#define BOOLEAN_OFFSET ((int)offsetof(Value, as.boolean))
+#endif
+
+// Clobbers rax and rcx.
+int asmJumpIfNotNumber(Assembler *as, int base, int32_t disp);
+// Jumps when the value is nil or false, one jump each. Clobbers rax and rcx.
+void asmJumpIfFalsey(Assembler *as, int base, int32_t disp, int jumps[2]);
+// Jumps unless the value is exactly `value`, jumps[1] is -1 when one jump does. Clobbers rax and rcx.
+void asmJumpIfNotValue(Assembler *as, int base, int32_t disp, Value value, int jumps[2]);
+// Stores xmm as a number.
+void asmStoreNumber(Assembler *as, int base, int32_t disp, int xmm);
+// Stores al, 0 or 1, as a bool. Clobbers rax and rcx.
+void asmStoreBool(Assembler *as, int base, int32_t disp);
+// Stores a Value known at compile time. Clobbers rax.
+void asmStoreValue(Assembler *as, int base, int32_t disp, Value value);
+// Clobbers rax.
+void asmCopyValue(Assembler *as, int dstBase, int32_t dstDisp, int srcBase, int32_t srcDisp);
+
+// Copies the code to a new executable mapping, NULL when the system refuses one.
+uint8_t *asmFinish(Assembler *as);
+void asmRelease(uint8_t *code, size_t size);
+
+#endif
@@ -0,0 +1,199 @@
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "channel.h"
+#include "object.h"
+#include "vm.h"
+
+static void *allocateShared(size_t size)
+{
+    void *memory = malloc(size);
+    if (memory == NULL)
+        exit(1);
+    return memory;
+}
+
+ChannelSet *newChannelSet()
+{
+    ChannelSet *set = allocateShared(sizeof(ChannelSet));
+    pthread_mutex_init(&set->lock, NULL);
+    set->channels = NULL;
+    return set;
+}
+
+void freeChannelSet(ChannelSet *set)
+{
+    Channel *channel = set->channels;
+    while (channel != NULL)
+    {
+        Channel *next = channel->next;
+        Message message;
+        while (channelTryReceive(channel, &message))
+        {
+            dropMessage(&message);
+        }
+        free(channel->cells);
+        free(channel->name);
+        free(channel);
+        channel = next;
+    }
+    pthread_mutex_destroy(&set->lock);
+    free(set);
+}
+
+Channel *openChannel(ChannelSet *set, const char *name, int length, int capacity)
+{
+    pthread_mutex_lock(&set->lock);
+    Channel *channel = set->channels;
+    while (channel != NULL &&
+           (channel->nameLength != length || memcmp(channel->name, name, length) != 0))
+    {
+        channel = channel->next;
+    }
+
+    if (channel == NULL)
+    {
+        size_t size = 2;
+        while (size < (size_t)capacity)
+            size *= 2;
+
+        // Aligned so the two positions really sit on their own cache lines.
+        channel = aligned_alloc(_Alignof(Channel), sizeof(Channel));
+        if (channel == NULL)
+            exit(1);
+        channel->name = allocateShared(length);
+        memcpy(channel->name, name, length);
+        channel->nameLength = length;
+        channel->mask = size - 1;
+        channel->cells = allocateShared(sizeof(ChannelCell) * size);
+        for (size_t i = 0; i < size; i++)
+        {
+            atomic_init(&channel->cells[i].sequence, i);
+        }
+        atomic_init(&channel->sendPosition, 0);
+        atomic_init(&channel->receivePosition, 0);
+        channel->next = set->channels;
+        set->channels = channel;
+    }
+    pthread_mutex_unlock(&set->lock);
+    return channel;
+}
+
+bool makeMessage(VM *vm, Value value, Message *message)
+{
+    message->value = value;
+    message->chars = NULL;
+    message->length = 0;
+    if (!IS_OBJ(value))
+        return true;
+    if (!IS_STRING(value))
+        return false;
+
+    // Outside a collection only frozen objects are marked, those belong to the owner and every isolate shares them.
+    if (vm->owner != NULL && AS_OBJ(value)->isMarked)
+        return true;
+
+    ObjString *string = AS_STRING(value);
+    message->value = NIL_VAL;
+    message->chars = allocateShared(string->length + 1);
+    memcpy(message->chars, string->chars, string->length);
+    message->length = string->length;
+    return true;
+}
+
+Value openMessage(VM *vm, Message *message)
+{
+    if (message->chars == NULL)
+        return message->value;
+
+    ObjString *string = newString(vm, message->length);
+    memcpy(string->chars, message->chars, message->length);
+    Value value = OBJ_VAL(string);
+    dropMessage(message);
+    return value;
+}
+
+void dropMessage(Message *message)
+{
+    free(message->chars);
+    message->chars = NULL;
+}
+
+/*
+Bounded multi-producer multi-consumer queue (Dmitry Vyukov's). Each cell's sequence says whose turn it is, so a
+sender or receiver only has to win the position it claims, the cell itself is then its own until it publishes it.
+*/
+bool channelTrySend(Channel *channel, Message *message)
+{
+    size_t position = atomic_load_explicit(&channel->sendPosition, memory_order_relaxed);
+    for (;;)
+    {
+        ChannelCell *cell = &channel->cells[position & channel->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&channel->sendPosition, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                cell->message = *message;
+                atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+                return true;
+            }
+        }
+        else if (difference < 0)
+        {
+            return false; // Full, the cell still holds a message from a lap ago.
+        }
+        else
+        {
+            position = atomic_load_explicit(&channel->sendPosition, memory_order_relaxed);
+        }
+    }
+}
+
+bool channelTryReceive(Channel *channel, Message *message)
+{
+    size_t position = atomic_load_explicit(&channel->receivePosition, memory_order_relaxed);
+    for (;;)
+    {
+        ChannelCell *cell = &channel->cells[position & channel->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if (difference == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&channel->receivePosition, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                *message = cell->message;
+                atomic_store_explicit(&cell->sequence, position + channel->mask + 1, memory_order_release);
+                return true;
+            }
+        }
+        else if (difference < 0)
+        {
+            return false; // Empty.
+        }
+        else
+        {
+            position = atomic_load_explicit(&channel->receivePosition, memory_order_relaxed);
+        }
+    }
+}
+
+void channelSend(Channel *channel, Message *message)
+{
+    while (!channelTrySend(channel, message))
+    {
+        sched_yield();
+    }
+}
+
+void channelReceive(Channel *channel, Message *message)
+{
+    while (!channelTryReceive(channel, message))
+    {
+        sched_yield();
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef clox_channel_h
+#define clox_channel_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "common.h"
+#include "value.h"
+
+/*
+Channels carry values between isolates, see pool.h. Every VM that opens a channel by the same name gets the same
+buffer, a bounded ring many threads can send to and receive from without locks. Buffers live outside every heap,
+in the ChannelSet of the VM that owns the code, until that VM is freed.
+A worker thread runs its isolates one after the other, isolates that wait on each other need a thread each.
+*/
+
+// Capacity of a channel opened without one.
+#define CHANNEL_CAPACITY 64
+#define CHANNEL_MAX_CAPACITY (1 << 20)
+
+/*
+A value on its way between VMs. Numbers, booleans, nil and frozen strings, which every isolate already shares, go in
+`value`. Other strings can't leave their heap, their characters are copied into `chars` and into a new string by
+the receiver.
+*/
+typedef struct
+{
+    Value value;
+    char *chars; // Malloc'd copy, NULL when `value` is the message.
+    int length;
+} Message;
+
+typedef struct
+{
+    atomic_size_t sequence; // Position the cell is ready for: a send when it equals it, a receive one past it.
+    Message message;
+} ChannelCell;
+
+typedef struct Channel
+{
+    struct Channel *next;
+    char *name;
+    int nameLength;
+    size_t mask; // Capacity - 1, the capacity is a power of two.
+    ChannelCell *cells;
+    // Kept on separate cache lines so senders and receivers don't invalidate each other's.
+    _Alignas(64) atomic_size_t sendPosition;
+    _Alignas(64) atomic_size_t receivePosition;
+} Channel;
+
+// Channels opened so far, the list is only locked to open one.
+typedef struct ChannelSet
+{
+    pthread_mutex_t lock;
+    Channel *channels;
+} ChannelSet;
+
+ChannelSet *newChannelSet();
+// Frees every channel with the messages still in it.
+void freeChannelSet(ChannelSet *set);
+
+// Returns the channel with that name, making one with room for at least `capacity` messages the first time.
+Channel *openChannel(ChannelSet *set, const char *name, int length, int capacity);
+
+// Returns false when the value can't be sent.
+bool makeMessage(VM *vm, Value value, Message *message);
+// Returns the message's value in vm and frees what the message held.
+Value openMessage(VM *vm, Message *message);
+void dropMessage(Message *message);
+
+// The try forms return false right away when the channel is full or empty, the others wait until it isn't.
+bool channelTrySend(Channel *channel, Message *message);
+bool channelTryReceive(Channel *channel, Message *message);
+void channelSend(Channel *channel, Message *message);
+void channelReceive(Channel *channel, Message *message);
+
+#endif
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include "chunk.h"
+#include "vm.h"
 
 void initChunk(Chunk *chunk)
 {
@@ -10,22 +11,26 @@ void initChunk(Chunk *chunk)
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->caches = NULL;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
 }
 
-void writeChunk(Chunk *chunk, uint8_t byte, int line)
+void writeChunk(VM *vm, Chunk *chunk, uint8_t byte, int line)
 {
     if (chunk->capacity < chunk->count + 1)
     {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
+        chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, oldCapacity, chunk->capacity);
         // chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
     }
     chunk->code[chunk->count] = byte;
 
     // If the next byte it's in the same line of the previous, it increases the count of the previous one
     // If not, it adds a new line counter to the lines array.
-    if (chunk->count != 0 && chunk->lines[chunk->lineCount - 1].line == line)
+    if (chunk->count != 0 && chunk->lines[chunk->lineCount - 1].line == line &&
+        chunk->lines[chunk->lineCount - 1].count < UINT8_MAX)
     {
         chunk->lines[chunk->lineCount - 1].count++;
     }
@@ -35,7 +40,7 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line)
         {
             int oldCapacity = chunk->lineCapacity;
             chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
-            chunk->lines = GROW_ARRAY(LineInfo, chunk->lines, oldCapacity, chunk->lineCapacity);
+            chunk->lines = GROW_ARRAY(vm, LineInfo, chunk->lines, oldCapacity, chunk->lineCapacity);
         }
 
         LineInfo l = {line, 1};
@@ -45,28 +50,67 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line)
     chunk->count++;
 }
 
-void writeConstant(Chunk *chunk, Value value, int line)
+void truncateChunk(Chunk *chunk, int count)
 {
-    int constIndex = addConstant(chunk, value);
+    int removed = chunk->count - count;
+    while (removed > 0)
+    {
+        LineInfo *last = &chunk->lines[chunk->lineCount - 1];
+        if (last->count > removed)
+        {
+            last->count -= removed;
+            break;
+        }
+        removed -= last->count;
+        chunk->lineCount--;
+    }
+    chunk->count = count;
+}
+
+void writeConstant(VM *vm, Chunk *chunk, Value value, int line)
+{
+    int constIndex = addConstant(vm, chunk, value);
     if (constIndex < 256)
     {
-        writeChunk(chunk, OP_CONSTANT, line);
-        writeChunk(chunk, constIndex, line);
+        writeChunk(vm, chunk, OP_CONSTANT, line);
+        writeChunk(vm, chunk, constIndex, line);
     }
     else
     {
-        writeChunk(chunk, OP_CONSTANT_LONG, line);
-        writeChunk(chunk, (constIndex >> 16) & 0XFF, line);
-        writeChunk(chunk, (constIndex >> 8) & 0XFF, line);
-        writeChunk(chunk, constIndex & 0XFF, line);
+        writeChunk(vm, chunk, OP_CONSTANT_LONG, line);
+        writeChunk(vm, chunk, (constIndex >> 16) & 0XFF, line);
+        writeChunk(vm, chunk, (constIndex >> 8) & 0XFF, line);
+        writeChunk(vm, chunk, constIndex & 0XFF, line);
     }
 }
 
-int addConstant(Chunk *chunk, Value value)
+int addConstant(VM *vm, Chunk *chunk, Value value)
 {
-    writeValueArray(&chunk->constants, value);
+    // Keeps the value reachable while the constant pool grows.
+    push(vm, value);
+    writeValueArray(vm, &chunk->constants, value);
+    pop(vm);
     return chunk->constants.count - 1;
 }
+int addInlineCache(VM *vm, Chunk *chunk)
+{
+    if (chunk->cacheCapacity < chunk->cacheCount + 1)
+    {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(vm, InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+    InlineCache *cache = &chunk->caches[chunk->cacheCount];
+    for (int i = 0; i < INLINE_CACHE_SIZE; i++)
+    {
+        cache->entries[i].shape = NULL;
+        cache->entries[i].target = NULL;
+        cache->entries[i].slot = -1;
+        cache->entries[i].method = NULL;
+    }
+    return chunk->cacheCount++;
+}
+
 int getLine(Chunk *chunk, int index)
 {
     if (index < 0 || index >= chunk->count)
@@ -84,10 +128,11 @@ int getLine(Chunk *chunk, int index)
     return -1; 
 }
 
-void freeChunk(Chunk *chunk)
+void freeChunk(VM *vm, Chunk *chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    freeValueArray(&chunk->constants);
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, LineInfo, chunk->lines, chunk->lineCapacity);
+    freeValueArray(vm, &chunk->constants);
+    FREE_ARRAY(vm, InlineCache, chunk->caches, chunk->cacheCapacity);
     initChunk(chunk);
 }
@@ -35,7 +35,42 @@ typedef enum
     OP_NEGATE,
     OP_NOT,
     OP_PRINT,
-    OP_RETURN
+    OP_RETURN,
+    OP_GENERATOR,        // First instruction of a generator function, the call returns a generator instead.
+    OP_YIELD,
+    OP_GENERATOR_RETURN, // OP_RETURN of a generator function, it finishes the generator.
+    OP_BUILD_LIST,       // Replaces the operand's number of values with a list of them.
+    OP_INDEX_GET,
+    OP_INDEX_SET,
+    OP_BUILD_MAP, // Replaces the operand's number of key/value pairs with a map of them.
+    // Indexing with a constant key: the constant, then the key's hash as 4 bytes so maps don't compute it.
+    OP_GET_KEY,
+    OP_SET_KEY,
+    OP_CLASS,
+    OP_METHOD,
+    OP_INHERIT,
+    // Property access: the name constant, then the index of the site's InlineCache as 2 bytes.
+    OP_GET_PROPERTY,
+    OP_SET_PROPERTY,
+    OP_INVOKE, // The argument count goes between the name and the cache.
+    OP_GET_SUPER,
+    OP_SUPER_INVOKE,
+    // Superinstructions, only emitted by the peephole optimizer.
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
+    OP_NOT_EQUAL,
+    OP_POP_JUMP_IF_FALSE,
+    OP_LESS_JUMP_IF_FALSE,
+    OP_GREATER_JUMP_IF_FALSE,
+    OP_EQUAL_JUMP_IF_FALSE,
+    OP_GET_LOCAL_GET_LOCAL_ADD,
+    OP_TAIL_CALL,
+    // Quickened forms, run() rewrites a generic instruction into one of these after seeing its operand types.
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_EQUAL_NUM,
+    // An OP_LOOP whose loop has a compiled trace, it enters the trace after jumping back.
+    OP_LOOP_TRACE
 } OpCode;
 
 typedef struct
@@ -43,6 +78,28 @@ typedef struct
     int line;
     uint8_t count;
 } LineInfo;
+
+// Shapes a property access remembers, a site that has seen more is megamorphic and always looks properties up.
+#define INLINE_CACHE_SIZE 4
+
+struct ObjShape;
+struct ObjClosure;
+
+// What a property access found for instances of one shape.
+typedef struct
+{
+    struct ObjShape *shape;    // NULL while the entry is unused.
+    struct ObjShape *target;   // For a store that added the field, the shape the instance moves to.
+    int slot;                  // Field slot, -1 when the name is a method.
+    struct ObjClosure *method;
+} CacheEntry;
+
+// One per property access site, monomorphic while a single entry is used and polymorphic up to all of them.
+typedef struct
+{
+    CacheEntry entries[INLINE_CACHE_SIZE];
+} InlineCache;
+
 typedef struct
 {
     int count;
@@ -52,21 +109,30 @@ typedef struct
     int lineCapacity;
     LineInfo *lines;
     ValueArray constants;
+    InlineCache *caches; // Filled in by the VM as the code runs, code shared by isolates leaves them empty.
+    int cacheCount;
+    int cacheCapacity;
 } Chunk;
 
 void initChunk(Chunk *chunk);
-void freeChunk(Chunk *chunk);
+void freeChunk(VM *vm, Chunk *chunk);
 
 // Writes a byte into the chunk.
-void writeChunk(Chunk *chunk, uint8_t byte, int line);
+void writeChunk(VM *vm, Chunk *chunk, uint8_t byte, int line);
+
+// Drops every byte from count onwards, with its line information.
+void truncateChunk(Chunk *chunk, int count);
 
 // Writes a constant to the constant pool of the chunk.
-void writeConstant(Chunk *chunk, Value value, int line);
+void writeConstant(VM *vm, Chunk *chunk, Value value, int line);
+
+// Adds an empty inline cache for a property access site and returns its index.
+int addInlineCache(VM *vm, Chunk *chunk);
 
 // Gets the line of the given index.
 int getLine(Chunk *chunk, int index);
 
 // Adds the given value to the end of the chunk's constant table and return its index.
-int addConstant(Chunk *chunk, Value value);
+int addConstant(VM *vm, Chunk *chunk, Value value);
 
 #endif
\ No newline at end of file
@@ -7,6 +7,31 @@
 
 #define DEBUG_TRACE_EXECUTION
 #define DEBUG_PRINT_CODE
+// #define DEBUG_STRESS_GC // Collects on every allocation to shake out missing roots.
+// #define DEBUG_LOG_GC    // Prints every allocation, mark and free.
+// #define DEBUG_CHECK_STACK // Checks every push and pop in run() against the frame's computed stack depth.
+
+// Packs every Value into one 64-bit word: doubles as themselves, nil, bools and Obj pointers inside quiet NaNs.
+// Halves the size of the stack, constant pools and table entries. Undefined, Value is a tagged struct.
+// #define NAN_BOXING
+
+// run() threads its dispatch through a table of label addresses (a GCC/Clang extension).
+// Build with -DSWITCH_DISPATCH to fall back to the portable switch loop and compare both.
+#if defined(__GNUC__) && !defined(SWITCH_DISPATCH)
+#define COMPUTED_GOTO
+#endif
+
+// Hot functions get translated to x86-64 machine code (jit.c), the interpreter stays the reference tier.
+// Build with -DNO_JIT to leave the translator out, or run with --no-jit to keep it from kicking in.
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__)) && !defined(NO_JIT)
+#define JIT_ENABLED
+#endif
+
+// The float array natives run SSE2 or AVX2 loops, picked for the CPU at runtime (simd.c).
+// Build with -DNO_SIMD to keep only the scalar loops.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NO_SIMD)
+#define SIMD_ENABLED
+#endif
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
@@ -3,20 +3,13 @@
 #include "common.h"
 #include "compiler.h"
 #include "scanner.h"
+#include "optimizer.h"
 #include <string.h>
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
-typedef struct
-{
-    Token current;
-    Token previous;
-    bool hadError;  // Flag to alert an error.
-    bool panicMode; // Flag to enter in panic mode and re-sync the parser with the code.
-} Parser;
-
 // Lowest to highest precedence.
 typedef enum
 {
@@ -30,11 +23,11 @@ typedef enum
     PREC_TERM,       // + -
     PREC_FACTOR,     // * /
     PREC_UNARY,      // ! -
-    PREC_CALL,       // . ()
+    PREC_CALL,       // . () []
     PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser *parser, bool canAssign);
 
 typedef struct
 {
@@ -52,6 +45,8 @@ typedef struct
 
 typedef enum {
     TYPE_FUNCTION,
+    TYPE_METHOD,
+    TYPE_INITIALIZER,
     TYPE_SCRIPT
 } FunctionType;
 
@@ -62,6 +57,15 @@ typedef struct
 } Upvalue;
 
 
+// The last value load the compiler emitted, folding replaces it in place.
+typedef struct
+{
+    int start;   // Offset of the load instruction.
+    int end;     // Offset right after it, -1 if nothing was loaded yet.
+    int pool;    // Size of the constant pool before the load.
+    Value value;
+} Constant;
+
 typedef struct Compiler Compiler;
 struct Compiler {
     struct Compiler* enclosing;
@@ -71,16 +75,40 @@ struct Compiler {
     int localCount;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+    Constant lastConstant;
+    int lastJumpTarget; // Highest offset a forward jump was patched to land on.
+    int lastCall;       // Offset of the last OP_CALL, -1 if there's none.
+    bool isGenerator;   // The body yields, calling the function makes a generator.
 };
 
-Parser parser;
-Compiler *current = NULL;
-Chunk *compilingChunk;
+// The class whose body is being compiled, innermost first.
+typedef struct ClassCompiler
+{
+    struct ClassCompiler *enclosing;
+    bool hasSuperclass; // Its methods have a `super` to call.
+} ClassCompiler;
+
+// One compilation. Everything the compiler functions share lives here, so VMs can compile at the same time.
+struct Parser
+{
+    VM *vm;
+    Scanner scanner;
+    Token current;
+    Token previous;
+    bool hadError;  // Flag to alert an error.
+    bool panicMode; // Flag to enter in panic mode and re-sync the parser with the code.
+    Compiler *compiler; // The function being compiled, innermost first.
+    ClassCompiler *currentClass; // NULL outside class bodies.
+    // Global name -> how many times the source declares or assigns it, counted before compiling.
+    Table globalWrites;
+    // Global name -> value for the globals that are only ever written by a constant declaration.
+    Table constantGlobals;
+};
 
 // Returns the current compiling chunk.
-static Chunk *currentChunk()
+static Chunk *currentChunk(Parser *parser)
 {
-    return &current->function->chunk;
+    return &parser->compiler->function->chunk;
 }
 
 /*
@@ -89,12 +117,12 @@ static Chunk *currentChunk()
 3. Then prints the error message.
 4. Sets the hadError flag.
 */
-static void errorAt(Token *token, const char *message)
+static void errorAt(Parser *parser, Token *token, const char *message)
 {
-    if (parser.panicMode)
+    if (parser->panicMode)
         return; // Suppress errors if we already had one.
 
-    parser.panicMode = true;
+    parser->panicMode = true;
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF)
@@ -111,24 +139,24 @@ static void errorAt(Token *token, const char *message)
     }
 
     fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    parser->hadError = true;
 }
 
 /*
 Extracts the location of the current token to tell the uses where happened the error and then calls
 to errorAt.
 */
-static void error(const char *message)
+static void error(Parser *parser, const char *message)
 {
-    errorAt(&parser.previous, message);
+    errorAt(parser, &parser->previous, message);
 }
 
 /*
 It tells the user what happened
 */
-static void errorAtCurrent(const char *message)
+static void errorAtCurrent(Parser *parser, const char *message)
 {
-    errorAt(&parser.current, message);
+    errorAt(parser, &parser->current, message);
 }
 
 /*
@@ -136,34 +164,34 @@ It steps forward through the toke nstream.
 It takes the old current token and stores it in a previous field (to get the lexeme after math a token)
 Ask the scanner for next token and stores it for later use.
 */
-static void advance()
+static void advance(Parser *parser)
 {
-    parser.previous = parser.current;
+    parser->previous = parser->current;
     for (;;)
     {
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR)
+        parser->current = scanToken(&parser->scanner);
+        if (parser->current.type != TOKEN_ERROR)
             break;
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
 // ! https://craftinginterpreters.com/calls-and-functions.html#a-stack-of-compilers
 // Reads the next token and validates that token has expected type. If not, it reports an error.
-static void consume(TokenType type, const char *message)
+static void consume(Parser *parser, TokenType type, const char *message)
 {
-    if (parser.current.type == type)
+    if (parser->current.type == type)
     {
-        advance();
+        advance(parser);
         return;
     }
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
 // The check() function returns true if the current token has the given type.
-static bool check(TokenType type)
+static bool check(Parser *parser, TokenType type)
 {
-    return parser.current.type == type;
+    return parser->current.type == type;
 }
 
 /*
@@ -171,162 +199,253 @@ You may recognize it from jlox.
 If the current token has the given type, we consume the token and return true.
 Otherwise we leave the token alone and return false.
 */
-static bool match(TokenType type)
+static bool match(Parser *parser, TokenType type)
 {
-    if (!check(type))
+    if (!check(parser, type))
         return false;
-    advance();
+    advance(parser);
     return true;
 }
 
 // Adds a byte to the chunk
-static void emitByte(uint8_t byte)
+static void emitByte(Parser *parser, uint8_t byte)
 {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+    writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);
 }
 
-static int emitJump(uint8_t instruction)
+static int emitJump(Parser *parser, uint8_t instruction)
 {
-    emitByte(instruction);
-    emitByte(0xff);
-    emitByte(0xff);
-    return currentChunk()->count - 2;
+    emitByte(parser, instruction);
+    emitByte(parser, 0xff);
+    emitByte(parser, 0xff);
+    return currentChunk(parser)->count - 2;
 }
 
 // Convenience function to emit opcode followed by a one-byte operand.
-static void emitBytes(uint8_t byte1, uint8_t byte2)
+static void emitBytes(Parser *parser, uint8_t byte1, uint8_t byte2)
+{
+    emitByte(parser, byte1);
+    emitByte(parser, byte2);
+}
+
+// Emits a global variable instruction followed by its two-byte slot index.
+static void emitGlobal(Parser *parser, uint8_t instruction, uint16_t slot)
 {
-    emitByte(byte1);
-    emitByte(byte2);
+    emitByte(parser, instruction);
+    emitByte(parser, (slot >> 8) & 0xff);
+    emitByte(parser, slot & 0xff);
 }
 
 // Unconditionally jumps over a start point. Like a emitJump() and patchJump() combined.
 // The + 2 is to take into account the size of the OP_LOOP instruction’s own operands which we also need to jump over.
-static void emitLoop(int loopStart)
+static void emitLoop(Parser *parser, int loopStart)
 {
-    emitByte(OP_LOOP);
+    emitByte(parser, OP_LOOP);
 
-    int offset = currentChunk()->count - loopStart + 2;
+    int offset = currentChunk(parser)->count - loopStart + 2;
     if (offset > UINT16_MAX)
-        error("Loop body too large.");
+        error(parser, "Loop body too large.");
 
-    emitByte((offset >> 8) & 0xFF);
-    emitByte(offset & 0xFF);
+    emitByte(parser, (offset >> 8) & 0xFF);
+    emitByte(parser, offset & 0xFF);
+}
+
+static void emitReturn(Parser *parser)
+{
+    // An initializer always returns the instance it initialized.
+    if (parser->compiler->type == TYPE_INITIALIZER)
+        emitBytes(parser, OP_GET_LOCAL, 0);
+    else
+        emitByte(parser, OP_NIL);
+    emitByte(parser, parser->compiler->isGenerator ? OP_GENERATOR_RETURN : OP_RETURN);
 }
 
-static void emitReturn()
+// Numbers are the same constant only if their bits match, 0 and -0 are equal but divide differently.
+static bool sameConstant(Value a, Value b)
 {
-    emitByte(OP_NIL);
-    emitByte(OP_RETURN);
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+    {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        return memcmp(&x, &y, sizeof(double)) == 0;
+    }
+    return valuesEqual(a, b);
 }
 
 // Makes sure that whe don't add more than 256 constant in a chunk.
-static uint8_t makeConstant(Value value)
+static uint8_t makeConstant(Parser *parser, Value value)
 {
     // Linear search to avoid duplicate constants in constant pool.
-    Chunk *chunk = currentChunk();
+    Chunk *chunk = currentChunk(parser);
     for (int i = 0; i < chunk->constants.count; i++)
     {
-        if (valuesEqual(chunk->constants.values[i], value))
+        if (sameConstant(chunk->constants.values[i], value))
         {
             return (uint8_t)i;
         }
     }
 
     // Normal behaviour.
-    int constant = addConstant(currentChunk(), value);
+    int constant = addConstant(parser->vm, currentChunk(parser), value);
     if (constant > UINT8_MAX)
     {
-        error("Too many constants in one chunk.");
+        error(parser, "Too many constants in one chunk.");
         return 0;
     }
     return (uint8_t)constant;
 }
 
-static void patchJump(int offset)
+static void patchJump(Parser *parser, int offset)
 {
     // -2 to adjust for the bytecode for the jump offset itself.
-    int jump = currentChunk()->count - offset - 2;
+    int jump = currentChunk(parser)->count - offset - 2;
 
     if (jump > UINT16_MAX)
     {
-        error("Too much code to jump over.");
+        error(parser, "Too much code to jump over.");
     }
 
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+    currentChunk(parser)->code[offset + 1] = jump & 0xff;
+    parser->compiler->lastJumpTarget = currentChunk(parser)->count;
+}
+
+// Loads a value, remembering it in case the expression around it can be folded.
+static void emitConstant(Parser *parser, Value value)
+{
+    Constant *constant = &parser->compiler->lastConstant;
+    constant->start = currentChunk(parser)->count;
+    constant->pool = currentChunk(parser)->constants.count;
+    constant->value = value;
+
+    if (IS_NIL(value))
+        emitByte(parser, OP_NIL);
+    else if (IS_BOOL(value))
+        emitByte(parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    else
+        emitBytes(parser, OP_CONSTANT, makeConstant(parser, value));
+    constant->end = currentChunk(parser)->count;
+}
+
+/*
+Returns true if the code from start to the end of the chunk is just the last constant load and no jump lands past
+start, so the load can be replaced without changing any path into it.
+*/
+static bool endsWithConstant(Parser *parser, int start, Constant *constant)
+{
+    *constant = parser->compiler->lastConstant;
+    return constant->start == start && constant->end == currentChunk(parser)->count &&
+           parser->compiler->lastJumpTarget <= start;
 }
 
-// Loads a value.
-static void emitConstant(Value value)
+// Drops the loads from `from` onwards, and the constants only they used, and loads value instead.
+static void replaceWithConstant(Parser *parser, Constant *from, Value value)
 {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    // Dropping the pool entries may leave a freshly concatenated string unreachable.
+    push(parser->vm, value);
+    truncateChunk(currentChunk(parser), from->start);
+    currentChunk(parser)->constants.count = from->pool;
+    emitConstant(parser, value);
+    pop(parser->vm);
 }
 
-static void initCompiler(Compiler *compiler, FunctionType type)
+static void initCompiler(Parser *parser, Compiler *compiler, FunctionType type)
 {
     // I know, it looks dumb to null the function field only to immediately assign it a value a few lines later. More garbage collection-related paranoia.
-    compiler->enclosing = current;
+    compiler->enclosing = parser->compiler;
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction();
-    current = compiler;
+    compiler->lastConstant.end = -1;
+    compiler->lastJumpTarget = 0;
+    compiler->lastCall = -1;
+    compiler->isGenerator = false;
+    compiler->function = newFunction(parser->vm);
+    parser->compiler = compiler;
     if (type != TYPE_SCRIPT) {
-        current->function->name = AS_STRING(copyString(parser.previous.start, parser.previous.length));
+        parser->compiler->function->name = AS_STRING(copyString(parser->vm, parser->previous.start, parser->previous.length));
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = &parser->compiler->locals[parser->compiler->localCount++];
     local->depth = 0;
     local->isCaptured = false;
-    local->name.start = "";
-    local->name.length = 0;
+    // A method's receiver sits in slot 0, `this` resolves to it like any local.
+    if (type == TYPE_METHOD || type == TYPE_INITIALIZER)
+    {
+        local->name.start = "this";
+        local->name.length = 4;
+    }
+    else
+    {
+        local->name.start = "";
+        local->name.length = 0;
+    }
 }
 
-static ObjFunction* endCompiler()
+static ObjFunction* endCompiler(Parser *parser)
 {
-    emitReturn();
-    ObjFunction* function = current->function;
+    emitReturn(parser);
+    ObjFunction* function = parser->compiler->function;
+    if (!parser->hadError)
+    {
+        optimizeChunk(parser->vm, currentChunk(parser));
+        function->maxStackDepth = maxStackDepth(parser->vm, currentChunk(parser), function->arity + 1);
+    }
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError)
+    if (!parser->hadError)
     {
-        disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
+        disassembleChunk(parser->vm, currentChunk(parser), function->name != NULL ? function->name->chars : "<script>");
     }
 #endif
-    current = current->enclosing;
+    parser->compiler = parser->compiler->enclosing;
     return function;
 }
-static void beginScope()
+static void beginScope(Parser *parser)
 {
-    current->scopeDepth++;
+    parser->compiler->scopeDepth++;
 }
 
-static void endScope()
+static void endScope(Parser *parser)
 {
-    current->scopeDepth--;
-    while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth)
+    parser->compiler->scopeDepth--;
+    while (parser->compiler->localCount > 0 && parser->compiler->locals[parser->compiler->localCount - 1].depth > parser->compiler->scopeDepth)
     {
-        if (current->locals[current->localCount - 1].isCaptured) {
-            emitByte(OP_CLOSE_UPVALUE);
+        if (parser->compiler->locals[parser->compiler->localCount - 1].isCaptured) {
+            emitByte(parser, OP_CLOSE_UPVALUE);
         } else {
-            emitByte(OP_POP);
+            emitByte(parser, OP_POP);
         }
 
-        current->localCount--;
+        parser->compiler->localCount--;
     }
 }
 
-static void expression();
-static void statement();
-static void declaration();
+static void expression(Parser *parser);
+static void statement(Parser *parser);
+static void declaration(Parser *parser);
 static ParseRule *getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Parser *parser, Precedence precedence);
 
-static uint8_t identifierConstant(Token *name)
+/*
+Globals don't live in the constant pool: every global name gets a stable slot in parser->vm->globalSlots the first time the compiler sees it.
+The slot index is the two-byte operand of the global instructions, so the VM never hashes the name at runtime.
+*/
+static uint16_t identifierGlobal(Parser *parser, Token *name)
 {
-    // return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
-    return makeConstant(copyString(name->start, name->length));
+    int slot = globalSlot(parser->vm, AS_STRING(copyString(parser->vm, name->start, name->length)));
+    if (slot > UINT16_MAX)
+    {
+        error(parser, "Too many global variables.");
+        return 0;
+    }
+    return (uint16_t)slot;
+}
+
+// Property and method names go in the constant pool, unlike global names.
+static uint8_t identifierConstant(Parser *parser, Token *name)
+{
+    return makeConstant(parser, copyString(parser->vm, name->start, name->length));
 }
 
 static bool identifiersEqual(Token *a, Token *b)
@@ -336,7 +455,7 @@ static bool identifiersEqual(Token *a, Token *b)
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolveLocal(Compiler *compiler, Token *name)
+static int resolveLocal(Parser *parser, Compiler *compiler, Token *name)
 {
     for (int i = compiler->localCount - 1; i >= 0; i--)
     {
@@ -345,7 +464,7 @@ static int resolveLocal(Compiler *compiler, Token *name)
         {
             if (local->depth == -1)
             {
-                error("Can't read local variable in its own initializer.");
+                error(parser, "Can't read local variable in its own initializer.");
             }
             return i;
         }
@@ -353,7 +472,7 @@ static int resolveLocal(Compiler *compiler, Token *name)
     return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Parser *parser, Compiler* compiler, uint8_t index, bool isLocal) {
     int upvalueCount = compiler->function->upvalueCount;
 
     for (int i = 0; i < upvalueCount; i++)
@@ -365,7 +484,7 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
     }
 
     if (upvalueCount == UINT8_COUNT) {
-        error("Too many closure variables in function.");
+        error(parser, "Too many closure variables in function.");
         return 0;
     }
     
@@ -375,110 +494,183 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
     return compiler->function->upvalueCount++;
 }
 
-static int resolveUpvalue(Compiler* compiler, Token* name) {
+static int resolveUpvalue(Parser *parser, Compiler* compiler, Token* name) {
     if (compiler->enclosing == NULL) return -1;
-    int local = resolveLocal(compiler->enclosing, name);
+    int local = resolveLocal(parser, compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        return addUpvalue(parser, compiler, (uint8_t)local, true);
     }
 
-    int upvalue = resolveUpvalue(compiler->enclosing, name);
+    int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(parser, compiler, (uint8_t)upvalue, false);
     }
 
     return -1;
 }
 
-static void addLocal(Token name)
+static void addLocal(Parser *parser, Token name)
 {
-    if (current->localCount == UINT8_COUNT)
+    if (parser->compiler->localCount == UINT8_COUNT)
     {
-        error("Too many local variables in function.");
+        error(parser, "Too many local variables in function.");
         return;
     }
-    Local *local = &current->locals[current->localCount++];
+    Local *local = &parser->compiler->locals[parser->compiler->localCount++];
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
 }
 
-static void declareVariable()
+static void declareVariable(Parser *parser)
 {
-    if (current->scopeDepth == 0)
+    if (parser->compiler->scopeDepth == 0)
         return;
 
-    Token *name = &parser.previous;
-    for (int i = current->localCount - 1; i >= 0; i--)
+    Token *name = &parser->previous;
+    for (int i = parser->compiler->localCount - 1; i >= 0; i--)
     {
-        Local *local = &current->locals[i];
-        if (local->depth != 1 && local->depth < current->scopeDepth)
+        Local *local = &parser->compiler->locals[i];
+        if (local->depth != 1 && local->depth < parser->compiler->scopeDepth)
         {
             break;
         }
         if (identifiersEqual(name, &local->name))
         {
-            error("Already a variable with this name in this scope.");
+            error(parser, "Already a variable with this name in this scope.");
         }
     }
 
-    addLocal(*name);
+    addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(const char *errorMessage)
+static uint16_t parseVariable(Parser *parser, const char *errorMessage)
 {
-    consume(TOKEN_IDENTIFIER, errorMessage);
+    consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-    declareVariable();
-    if (current->scopeDepth > 0)
+    declareVariable(parser);
+    if (parser->compiler->scopeDepth > 0)
         return 0;
 
-    return identifierConstant(&parser.previous);
+    return identifierGlobal(parser, &parser->previous);
 }
 
-static void markInitialized()
+static void markInitialized(Parser *parser)
 {
-    if (current->scopeDepth == 0) return;
-    current->locals[current->localCount - 1].depth = current->scopeDepth;
+    if (parser->compiler->scopeDepth == 0) return;
+    parser->compiler->locals[parser->compiler->localCount - 1].depth = parser->compiler->scopeDepth;
 }
 
-static void defineVariable(uint8_t global)
+static void defineVariable(Parser *parser, uint16_t global)
 {
-    if (current->scopeDepth > 0)
+    if (parser->compiler->scopeDepth > 0)
     {
-        markInitialized();
+        markInitialized(parser);
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobal(parser, OP_DEFINE_GLOBAL, global);
 }
 
-static uint8_t argumentList() {
+static uint8_t argumentList(Parser *parser) {
     uint8_t argCount = 0;
-    if (!check(TOKEN_RIGHT_PAREN)) {
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
         do
         {
-            expression();
+            expression(parser);
             argCount++;
             if(argCount == 255) {
-                error("Can't have more than 255 arguments.");
+                error(parser, "Can't have more than 255 arguments.");
             }
-        } while (match(TOKEN_COMMA));
+        } while (match(parser, TOKEN_COMMA));
     }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
     return argCount;
 }
 
+// Concatenates two strings at compile time, the same way OP_ADD does at runtime.
+static Value concatenateConstants(Parser *parser, ObjString *a, ObjString *b)
+{
+    int length = a->length + b->length;
+    char *chars = ALLOCATE(parser->vm, char, length + 1);
+    memcpy(chars, a->chars, a->length);
+    memcpy(chars + a->length, b->chars, b->length);
+    chars[length] = '\0';
+    return OBJ_VAL(takeString(parser->vm, chars, length));
+}
+
+/*
+Computes `a operator b` for two constant operands.
+Returns false when the operation would be a runtime error, that's left to the VM so the error still happens.
+*/
+static bool foldBinary(Parser *parser, TokenType operatorType, Value a, Value b, Value *result)
+{
+    switch (operatorType)
+    {
+    case TOKEN_EQUAL_EQUAL:
+        *result = BOOL_VAL(valuesEqual(a, b));
+        return true;
+    case TOKEN_BANG_EQUAL:
+        *result = BOOL_VAL(!valuesEqual(a, b));
+        return true;
+    case TOKEN_PLUS:
+        if (IS_STRING(a) && IS_STRING(b))
+        {
+            *result = concatenateConstants(parser, AS_STRING(a), AS_STRING(b));
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+        return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operatorType)
+    {
+    case TOKEN_PLUS:
+        *result = NUMBER_VAL(x + y);
+        return true;
+    case TOKEN_MINUS:
+        *result = NUMBER_VAL(x - y);
+        return true;
+    case TOKEN_STAR:
+        *result = NUMBER_VAL(x * y);
+        return true;
+    case TOKEN_SLASH:
+        *result = NUMBER_VAL(x / y);
+        return true;
+    case TOKEN_GREATER:
+        *result = BOOL_VAL(x > y);
+        return true;
+    case TOKEN_LESS:
+        *result = BOOL_VAL(x < y);
+        return true;
+    // Negated like the bytecode the compiler emits for them, so NaN folds to the same answer.
+    case TOKEN_GREATER_EQUAL:
+        *result = BOOL_VAL(!(x < y));
+        return true;
+    case TOKEN_LESS_EQUAL:
+        *result = BOOL_VAL(!(x > y));
+        return true;
+    default:
+        return false;
+    }
+}
+
 // Evaluate the first condition, if false, jumps the right hand expression.
 // Otherwise, discards left expression and evaluates the right-hand expression.
-static void and_(bool canAssign)
+static void and_(Parser *parser, bool canAssign)
 {
-    int endJump = emitJump(OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
 
-    emitByte(OP_POP);
-    parsePrecedence(PREC_AND);
+    emitByte(parser, OP_POP);
+    parsePrecedence(parser, PREC_AND);
 
-    patchJump(endJump);
+    patchJump(parser, endJump);
 }
 
 /*
@@ -494,43 +686,56 @@ for the operator (e.g., OP_ADD for '+', OP_SUBTRACT for '-', etc.).
 This allows multiple binary operators to be handled by a single function using
 dynamic precedence lookup through getRule().
 */
-static void binary(bool canAssign)
+static void binary(Parser *parser, bool canAssign)
 {
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = parser->previous.type;
     ParseRule *rule = getRule(operatorType);
-    parsePrecedence((Precedence)(rule->precedence + 1));
+    Constant left = parser->compiler->lastConstant;
+    bool leftIsConstant = endsWithConstant(parser, left.start, &left);
+    int rightStart = currentChunk(parser)->count;
+    parsePrecedence(parser, (Precedence)(rule->precedence + 1));
+
+    Constant right;
+    Value result;
+    if (leftIsConstant && endsWithConstant(parser, rightStart, &right) && parser->compiler->lastJumpTarget <= left.start &&
+        foldBinary(parser, operatorType, left.value, right.value, &result))
+    {
+        replaceWithConstant(parser, &left, result);
+        return;
+    }
+
     switch (operatorType)
     {
     case TOKEN_PLUS:
-        emitByte(OP_ADD);
+        emitByte(parser, OP_ADD);
         break;
     case TOKEN_MINUS:
-        emitByte(OP_SUBTRACT);
+        emitByte(parser, OP_SUBTRACT);
         break;
     case TOKEN_STAR:
-        emitByte(OP_MULTIPLY);
+        emitByte(parser, OP_MULTIPLY);
         break;
     case TOKEN_SLASH:
-        emitByte(OP_DIVIDE);
+        emitByte(parser, OP_DIVIDE);
         break;
 
     case TOKEN_BANG_EQUAL:
-        emitBytes(OP_EQUAL, OP_NOT);
+        emitBytes(parser, OP_EQUAL, OP_NOT);
         break;
     case TOKEN_EQUAL_EQUAL:
-        emitByte(OP_EQUAL);
+        emitByte(parser, OP_EQUAL);
         break;
     case TOKEN_GREATER:
-        emitByte(OP_GREATER);
+        emitByte(parser, OP_GREATER);
         break;
     case TOKEN_GREATER_EQUAL:
-        emitBytes(OP_LESS, OP_NOT);
+        emitBytes(parser, OP_LESS, OP_NOT);
         break;
     case TOKEN_LESS:
-        emitByte(OP_LESS);
+        emitByte(parser, OP_LESS);
         break;
     case TOKEN_LESS_EQUAL:
-        emitBytes(OP_GREATER, OP_NOT);
+        emitBytes(parser, OP_GREATER, OP_NOT);
         break;
 
     default:
@@ -538,23 +743,151 @@ static void binary(bool canAssign)
     }
 }
 
-static void call(bool canAssing) {
-    uint8_t argCount = argumentList();
-    emitBytes(OP_CALL, argCount);
+static void call(Parser *parser, bool canAssing) {
+    uint8_t argCount = argumentList(parser);
+    parser->compiler->lastCall = currentChunk(parser)->count;
+    emitBytes(parser, OP_CALL, argCount);
+}
+
+// Gives the property instruction just emitted an inline cache of its own.
+static void emitCache(Parser *parser)
+{
+    int cache = addInlineCache(parser->vm, currentChunk(parser));
+    if (cache > UINT16_MAX)
+    {
+        error(parser, "Too many property accesses in one chunk.");
+        cache = 0;
+    }
+    emitBytes(parser, (cache >> 8) & 0xff, cache & 0xff);
+}
+
+// `target.name`, an assignment to it when followed by `=` and a method call when followed by arguments.
+static void dot(Parser *parser, bool canAssign)
+{
+    consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    uint8_t name = identifierConstant(parser, &parser->previous);
+
+    if (canAssign && match(parser, TOKEN_EQUAL))
+    {
+        expression(parser);
+        emitBytes(parser, OP_SET_PROPERTY, name);
+    }
+    else if (match(parser, TOKEN_LEFT_PAREN))
+    {
+        uint8_t argCount = argumentList(parser);
+        emitBytes(parser, OP_INVOKE, name);
+        emitByte(parser, argCount);
+    }
+    else
+    {
+        emitBytes(parser, OP_GET_PROPERTY, name);
+    }
+    emitCache(parser);
+}
+
+// A list literal, its items are left on the stack for OP_BUILD_LIST to gather.
+static void list(Parser *parser, bool canAssign)
+{
+    int itemCount = 0;
+    if (!check(parser, TOKEN_RIGHT_BRACKET))
+    {
+        do
+        {
+            expression(parser);
+            if (itemCount == 255)
+            {
+                error(parser, "Can't have more than 255 items in a list literal.");
+            }
+            itemCount++;
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after list items.");
+    emitBytes(parser, OP_BUILD_LIST, (uint8_t)itemCount);
+}
+
+// A map literal, its keys and values are left on the stack in pairs for OP_BUILD_MAP to gather.
+static void map(Parser *parser, bool canAssign)
+{
+    int pairCount = 0;
+    if (!check(parser, TOKEN_RIGHT_BRACE))
+    {
+        do
+        {
+            expression(parser);
+            consume(parser, TOKEN_COLON, "Expect ':' after map key.");
+            expression(parser);
+            if (pairCount == 255)
+            {
+                error(parser, "Can't have more than 255 entries in a map literal.");
+            }
+            pairCount++;
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+    emitBytes(parser, OP_BUILD_MAP, (uint8_t)pairCount);
+}
+
+// Emits an OP_GET_KEY or OP_SET_KEY for the constant, with the hash a map would compute for it.
+static void emitKey(Parser *parser, OpCode instruction, uint8_t constant, Value key)
+{
+    uint32_t hash = hashValue(key);
+    emitBytes(parser, instruction, constant);
+    emitBytes(parser, (hash >> 24) & 0xff, (hash >> 16) & 0xff);
+    emitBytes(parser, (hash >> 8) & 0xff, hash & 0xff);
+}
+
+/*
+`target[index]`, or an assignment to it when followed by `=`.
+A string or number index is taken out of the code and goes in the instruction instead, hashed ahead of time.
+*/
+static void subscript(Parser *parser, bool canAssign)
+{
+    Chunk *chunk = currentChunk(parser);
+    int indexStart = chunk->count;
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    Constant index;
+    bool constantKey = endsWithConstant(parser, indexStart, &index) && chunk->code[indexStart] == OP_CONSTANT &&
+                       (IS_STRING(index.value) || IS_NUMBER(index.value));
+    uint8_t constant = 0;
+    if (constantKey)
+    {
+        constant = chunk->code[indexStart + 1];
+        truncateChunk(chunk, indexStart); // The pool entry stays, the instruction uses it.
+        parser->compiler->lastConstant.end = -1;
+    }
+
+    if (canAssign && match(parser, TOKEN_EQUAL))
+    {
+        expression(parser);
+        if (constantKey)
+            emitKey(parser, OP_SET_KEY, constant, index.value);
+        else
+            emitByte(parser, OP_INDEX_SET);
+    }
+    else if (constantKey)
+    {
+        emitKey(parser, OP_GET_KEY, constant, index.value);
+    }
+    else
+    {
+        emitByte(parser, OP_INDEX_GET);
+    }
 }
 
-static void literal(bool canAssign)
+static void literal(Parser *parser, bool canAssign)
 {
-    switch (parser.previous.type)
+    switch (parser->previous.type)
     {
     case TOKEN_FALSE:
-        emitByte(OP_FALSE);
+        emitConstant(parser, BOOL_VAL(false));
         break;
     case TOKEN_NIL:
-        emitByte(OP_NIL);
+        emitConstant(parser, NIL_VAL);
         break;
     case TOKEN_TRUE:
-        emitByte(OP_TRUE);
+        emitConstant(parser, BOOL_VAL(true));
         break;
     default:
         return;
@@ -563,91 +896,170 @@ static void literal(bool canAssign)
 
 // Grouping isn't a back-end useful, it's front-end syntactic sugar.
 // Assuming that the initial ( has been consumed, it calls to expression to compile the expression.
-static void grouping(bool canAssign)
+static void grouping(Parser *parser, bool canAssign)
 {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
 // Store a pointer and then emit the constant. Takes the lexeme and conver it to a double value.
-static void number(bool canAssign)
+static void number(Parser *parser, bool canAssign)
 {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    double value = strtod(parser->previous.start, NULL);
+    emitConstant(parser, NUMBER_VAL(value));
 }
 
 /*
 if the left-hand side is truthy, then we skip over the right operand.
 When the left-hand side is falsey, it does a tiny jump over the next statement.
 */
-static void or_(bool canAssign)
+static void or_(Parser *parser, bool canAssign)
 {
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    int endJump = emitJump(OP_JUMP);
+    int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP);
 
-    patchJump(elseJump);
-    emitByte(OP_POP);
+    patchJump(parser, elseJump);
+    emitByte(parser, OP_POP);
 
-    parsePrecedence(PREC_OR);
-    patchJump(endJump);
+    parsePrecedence(parser, PREC_OR);
+    patchJump(parser, endJump);
 }
 // Takes string's characters from lexeme and wraps it in a Value then puts in the constant table.
-static void string(bool canAssign)
+static void string(Parser *parser, bool canAssign)
 {
-    emitConstant(copyString(parser.previous.start + 1, parser.previous.length - 2));
+    emitConstant(parser, copyString(parser->vm, parser->previous.start + 1, parser->previous.length - 2));
 }
 
-static void namedVariable(Token name, bool canAssign)
+static void namedVariable(Parser *parser, Token name, bool canAssign)
 {
     uint8_t getOp, setOp;
-    int arg = resolveLocal(current, &name);
+    int arg = resolveLocal(parser, parser->compiler, &name);
     if (arg != -1)
     {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
-    } else if ((arg = resolveUpvalue(current,&name))!=-1) {
+    } else if ((arg = resolveUpvalue(parser, parser->compiler,&name))!=-1) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     }
     else
     {
-        arg = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+        uint16_t global = identifierGlobal(parser, &name);
+        if (canAssign && match(parser, TOKEN_EQUAL))
+        {
+            expression(parser);
+            emitGlobal(parser, OP_SET_GLOBAL, global);
+        }
+        else
+        {
+            Value value;
+            if (parser->constantGlobals.count > 0 &&
+                tableGet(&parser->constantGlobals, OBJ_VAL(parser->vm->globalSlots[global].name), &value))
+            {
+                emitConstant(parser, value);
+                return;
+            }
+            emitGlobal(parser, OP_GET_GLOBAL, global);
+        }
+        return;
     }
-    if (canAssign && match(TOKEN_EQUAL))
+    if (canAssign && match(parser, TOKEN_EQUAL))
     {
-        expression();
-        emitBytes(setOp, (uint8_t)arg);
+        expression(parser);
+        emitBytes(parser, setOp, (uint8_t)arg);
     }
     else
     {
-        emitBytes(getOp, (uint8_t)arg);
+        emitBytes(parser, getOp, (uint8_t)arg);
+    }
+}
+
+static void variable(Parser *parser, bool canAssign)
+{
+    namedVariable(parser, parser->previous, canAssign);
+}
+
+static Token syntheticToken(const char *text)
+{
+    Token token;
+    token.type = TOKEN_IDENTIFIER;
+    token.start = text;
+    token.length = (int)strlen(text);
+    token.line = 0;
+    return token;
+}
+
+static void this_(Parser *parser, bool canAssign)
+{
+    if (parser->currentClass == NULL)
+    {
+        error(parser, "Can't use 'this' outside of a class.");
+        return;
     }
+    variable(parser, false);
 }
 
-static void variable(bool canAssign)
+// `super.name` binds the superclass's method to `this`, `super.name(...)` calls it right away.
+static void super_(Parser *parser, bool canAssign)
 {
-    namedVariable(parser.previous, canAssign);
+    if (parser->currentClass == NULL)
+        error(parser, "Can't use 'super' outside of a class.");
+    else if (!parser->currentClass->hasSuperclass)
+        error(parser, "Can't use 'super' in a class with no superclass.");
+
+    consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass method name.");
+    uint8_t name = identifierConstant(parser, &parser->previous);
+
+    namedVariable(parser, syntheticToken("this"), false);
+    if (match(parser, TOKEN_LEFT_PAREN))
+    {
+        uint8_t argCount = argumentList(parser);
+        namedVariable(parser, syntheticToken("super"), false);
+        emitBytes(parser, OP_SUPER_INVOKE, name);
+        emitByte(parser, argCount);
+    }
+    else
+    {
+        namedVariable(parser, syntheticToken("super"), false);
+        emitBytes(parser, OP_GET_SUPER, name);
+    }
 }
 
 // Prefix the expression.
-static void unary(bool canAssign)
+static void unary(Parser *parser, bool canAssign)
 {
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = parser->previous.type;
 
     // Compile the operand.
-    parsePrecedence(PREC_UNARY);
+    int operandStart = currentChunk(parser)->count;
+    parsePrecedence(parser, PREC_UNARY);
+
+    Constant operand;
+    if (endsWithConstant(parser, operandStart, &operand))
+    {
+        if (operatorType == TOKEN_BANG)
+        {
+            replaceWithConstant(parser, &operand, BOOL_VAL(IS_NIL(operand.value) ||
+                                                   (IS_BOOL(operand.value) && !AS_BOOL(operand.value))));
+            return;
+        }
+        if (operatorType == TOKEN_MINUS && IS_NUMBER(operand.value))
+        {
+            replaceWithConstant(parser, &operand, NUMBER_VAL(-AS_NUMBER(operand.value)));
+            return;
+        }
+    }
 
     // Emit the operator instruction.
     switch (operatorType)
     {
     case TOKEN_MINUS:
-        emitByte(OP_NEGATE);
+        emitByte(parser, OP_NEGATE);
         break;
 
     case TOKEN_BANG:
-        emitByte(OP_NOT);
+        emitByte(parser, OP_NOT);
         break;
 
     default:
@@ -655,23 +1067,25 @@ static void unary(bool canAssign)
     }
 }
 
-static void ternary()
+static void ternary(Parser *parser)
 {
-    parsePrecedence(PREC_TERNARY); // True body
+    parsePrecedence(parser, PREC_TERNARY); // True body
 
-    consume(TOKEN_COLON, "Expect : ':' after expression.");
+    consume(parser, TOKEN_COLON, "Expect : ':' after expression.");
 
-    parsePrecedence(PREC_TERNARY); // False body
+    parsePrecedence(parser, PREC_TERNARY); // False body
 }
 
 ParseRule rules[] = {
     [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
     //  [TOKEN_INTERROGATION_OPEN] = {NULL, ternary, PREC_TERNARY}
-    [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACE] = {map, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {list, subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
-    [TOKEN_DOT] = {NULL, NULL, PREC_NONE},
+    [TOKEN_DOT] = {NULL, dot, PREC_CALL},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
     [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
     [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
@@ -699,11 +1113,12 @@ ParseRule rules[] = {
     [TOKEN_OR] = {NULL, or_, PREC_NONE},
     [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
     [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_SUPER] = {NULL, NULL, PREC_NONE},
-    [TOKEN_THIS] = {NULL, NULL, PREC_NONE},
+    [TOKEN_SUPER] = {super_, NULL, PREC_NONE},
+    [TOKEN_THIS] = {this_, NULL, PREC_NONE},
     [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
     [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
     [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_YIELD] = {NULL, NULL, PREC_NONE},
     [TOKEN_ERROR] = {NULL, NULL, PREC_NONE},
     [TOKEN_EOF] = {NULL, NULL, PREC_NONE},
 };
@@ -712,28 +1127,28 @@ ParseRule rules[] = {
 Starts at the current token and parses any expression at the given precedence level or higher.
 Reads the next tokend and looks the corresponding ParserRule. If not exists a caller it returns.
 */
-static void parsePrecedence(Precedence precedence)
+static void parsePrecedence(Parser *parser, Precedence precedence)
 {
-    advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+    advance(parser);
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     if (prefixRule == NULL)
     {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
     bool canAssign = precedence <= PREC_ASSIGNMENT;
-    prefixRule(canAssign);
-    while (precedence <= getRule(parser.current.type)->precedence)
+    prefixRule(parser, canAssign);
+    while (precedence <= getRule(parser->current.type)->precedence)
     {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
+        advance(parser);
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
         if (infixRule != NULL)
         {
-            infixRule(canAssign);
+            infixRule(parser, canAssign);
         }
-        if (canAssign && match(TOKEN_EQUAL))
+        if (canAssign && match(parser, TOKEN_EQUAL))
         {
-            error("Invalid assignment target.");
+            error(parser, "Invalid assignment target.");
         }
     }
 }
@@ -746,88 +1161,208 @@ static ParseRule *getRule(TokenType type)
     return &rules[type];
 }
 
-static void expression()
+static void expression(Parser *parser)
 {
-    parsePrecedence(PREC_ASSIGNMENT);
+    parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void block()
+static void block(Parser *parser)
 {
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
     {
-        declaration();
+        declaration(parser);
     }
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
 
+/*
+Looks ahead through the function body about to be compiled for a yield of its own, outside the functions nested in
+it. Runs on a copy of the scanner, the tokens are compiled afterwards as usual.
+*/
+static bool bodyYields(Parser *parser)
+{
+    Scanner scanner = parser->scanner;
+    Token token = parser->current;
+    int depth = 1;         // The body's brace is consumed already.
+    int nested = 0;        // Depth of the nested function body being skipped, 0 when there's none.
+    bool nextIsBody = false;
+    for (;;)
+    {
+        switch (token.type)
+        {
+        case TOKEN_EOF:
+            return false;
+        case TOKEN_FUN:
+        case TOKEN_CLASS: // Methods can't yield, a class body is skipped whole.
+            if (nested == 0)
+                nextIsBody = true;
+            break;
+        case TOKEN_LEFT_BRACE:
+            depth++;
+            if (nextIsBody)
+            {
+                nested = depth;
+                nextIsBody = false;
+            }
+            break;
+        case TOKEN_RIGHT_BRACE:
+            if (depth == nested)
+                nested = 0;
+            if (--depth == 0)
+                return false;
+            break;
+        case TOKEN_YIELD:
+            if (nested == 0)
+                return true;
+            break;
+        default:
+            break;
+        }
+        token = scanToken(&scanner);
+    }
+}
+
 /*
 This beginScope() doesn’t have a corresponding endScope() call. 
 Because we end Compiler completely when we reach the end of the function body, there’s no need to close the lingering outermost scope.
 */
-static void function(FunctionType type) {
+static void function(Parser *parser, FunctionType type) {
     Compiler compiler;
-    initCompiler(&compiler, type);
-    beginScope();
+    initCompiler(parser, &compiler, type);
+    beginScope(parser);
 
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-    if (!check(TOKEN_RIGHT_PAREN)) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
         do {
-            current->function->arity++;
-            if (current->function->arity > 255) {
-                errorAtCurrent("Can't have more than 255 parameter.");
+            parser->compiler->function->arity++;
+            if (parser->compiler->function->arity > 255) {
+                errorAtCurrent(parser, "Can't have more than 255 parameter.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
-            defineVariable(constant);
-        } while (match(TOKEN_COMMA));
+            uint16_t constant = parseVariable(parser, "Expect parameter name.");
+            defineVariable(parser, constant);
+        } while (match(parser, TOKEN_COMMA));
         
    
     }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-    block();
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    if (type == TYPE_FUNCTION && bodyYields(parser))
+    {
+        parser->compiler->isGenerator = true;
+        emitByte(parser, OP_GENERATOR);
+    }
+    block(parser);
 
-    ObjFunction* function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    ObjFunction* function = endCompiler(parser);
+    emitBytes(parser, OP_CLOSURE, makeConstant(parser, OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalueCount; i++)
     {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        emitByte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
+        emitByte(parser, compiler.upvalues[i].index);
     }
     
 }
 
-static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name");
-    markInitialized();
-    function(TYPE_FUNCTION);
-    defineVariable(global);
+static void method(Parser *parser)
+{
+    consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+    uint8_t constant = identifierConstant(parser, &parser->previous);
+    FunctionType type = TYPE_METHOD;
+    if (parser->previous.length == 4 && memcmp(parser->previous.start, "init", 4) == 0)
+        type = TYPE_INITIALIZER;
+    function(parser, type);
+    emitBytes(parser, OP_METHOD, constant);
 }
 
-static void varDeclaration()
+/*
+The class is stored in its variable before the methods are compiled, so they can refer to it. With a superclass, the
+superclass lives on in a `super` local of a scope around the body, which the methods capture.
+*/
+static void classDeclaration(Parser *parser)
 {
-    uint8_t global = parseVariable("Expect variable name.");
-    if (match(TOKEN_EQUAL))
+    uint16_t global = parseVariable(parser, "Expect class name.");
+    Token className = parser->previous;
+    uint8_t nameConstant = identifierConstant(parser, &className);
+    emitBytes(parser, OP_CLASS, nameConstant);
+    defineVariable(parser, global);
+
+    ClassCompiler classCompiler;
+    classCompiler.enclosing = parser->currentClass;
+    classCompiler.hasSuperclass = false;
+    parser->currentClass = &classCompiler;
+
+    if (match(parser, TOKEN_LESS))
     {
-        expression();
+        consume(parser, TOKEN_IDENTIFIER, "Expect superclass name.");
+        variable(parser, false);
+        if (identifiersEqual(&className, &parser->previous))
+            error(parser, "A class can't inherit from itself.");
+
+        beginScope(parser);
+        addLocal(parser, syntheticToken("super"));
+        defineVariable(parser, 0);
+        namedVariable(parser, className, false);
+        emitByte(parser, OP_INHERIT);
+        classCompiler.hasSuperclass = true;
+    }
+
+    namedVariable(parser, className, false);
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
+    {
+        method(parser);
+    }
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    emitByte(parser, OP_POP);
+
+    if (classCompiler.hasSuperclass)
+        endScope(parser);
+    parser->currentClass = parser->currentClass->enclosing;
+}
+
+static void funDeclaration(Parser *parser) {
+    uint16_t global = parseVariable(parser, "Expect function name");
+    markInitialized(parser);
+    function(parser, TYPE_FUNCTION);
+    defineVariable(parser, global);
+}
+
+static void varDeclaration(Parser *parser)
+{
+    uint16_t global = parseVariable(parser, "Expect variable name.");
+    if (match(parser, TOKEN_EQUAL))
+    {
+        int start = currentChunk(parser)->count;
+        expression(parser);
+
+        // A global the whole program writes only here always holds this value once it's defined.
+        Constant initializer;
+        Value writes;
+        if (parser->compiler->scopeDepth == 0 && !parser->vm->replMode && endsWithConstant(parser, start, &initializer))
+        {
+            Value name = OBJ_VAL(parser->vm->globalSlots[global].name);
+            if (tableGet(&parser->globalWrites, name, &writes) && AS_NUMBER(writes) == 1)
+                tableSet(parser->vm, &parser->constantGlobals, name, initializer.value);
+        }
     }
     else
     {
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
     }
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
-    defineVariable(global);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    defineVariable(parser, global);
 }
 
-static void synchronize()
+static void synchronize(Parser *parser)
 {
-    parser.panicMode = false;
-    while (parser.current.type != TOKEN_EOF)
+    parser->panicMode = false;
+    while (parser->current.type != TOKEN_EOF)
     {
-        if (parser.previous.type == TOKEN_SEMICOLON)
+        if (parser->previous.type == TOKEN_SEMICOLON)
             return;
-        switch (parser.current.type)
+        switch (parser->current.type)
         {
         case TOKEN_CLASS:
         case TOKEN_FUN:
@@ -837,67 +1372,72 @@ static void synchronize()
         case TOKEN_WHILE:
         case TOKEN_PRINT:
         case TOKEN_RETURN:
+        case TOKEN_YIELD:
             return;
         default:;
         }
 
-        advance();
+        advance(parser);
     }
 }
 
-static void declaration()
+static void declaration(Parser *parser)
 {
-    if (match(TOKEN_FUN)) {
-        funDeclaration();
+    if (match(parser, TOKEN_CLASS))
+    {
+        classDeclaration(parser);
+    }
+    else if (match(parser, TOKEN_FUN)) {
+        funDeclaration(parser);
     }
-    else if (match(TOKEN_VAR))
+    else if (match(parser, TOKEN_VAR))
     {
-        varDeclaration();
+        varDeclaration(parser);
     }
     else
     {
-        statement();
+        statement(parser);
     }
-    if (parser.panicMode)
-        synchronize();
+    if (parser->panicMode)
+        synchronize(parser);
 }
 
-static void expressionStatement()
+static void expressionStatement(Parser *parser)
 {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP);
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    emitByte(parser, OP_POP);
 }
 
-static void forStatement() {
-    beginScope();
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-    if (match(TOKEN_SEMICOLON)) {
+static void forStatement(Parser *parser) {
+    beginScope(parser);
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match(parser, TOKEN_SEMICOLON)) {
         // No initializer.
-    } else if (match(TOKEN_VAR)) {
-        varDeclaration();
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     } else {
-        expressionStatement();
+        expressionStatement(parser);
     }
 
-    int loopStart = currentChunk()->count;
+    int loopStart = currentChunk(parser)->count;
     int exitJump = -1;
 
-    if (!match(TOKEN_SEMICOLON)) {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+    if (!match(parser, TOKEN_SEMICOLON)) {
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
         // Jump out of the loop if the condition is false.
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);
+        exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+        emitByte(parser, OP_POP);
     }
 
-    if (!match(TOKEN_RIGHT_PAREN)) {
-        int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
-        expression();
-        emitByte(OP_POP);
-        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+    if (!match(parser, TOKEN_RIGHT_PAREN)) {
+        int bodyJump = emitJump(parser, OP_JUMP);
+        int incrementStart = currentChunk(parser)->count;
+        expression(parser);
+        emitByte(parser, OP_POP);
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
         
         /*
         The last part is a little tricky. First, we emit a loop instruction. 
@@ -905,119 +1445,242 @@ static void forStatement() {
         That loop happens right after the increment, since the increment executes at the end of each loop iteration.
         */
        
-        emitLoop(loopStart);
+        emitLoop(parser, loopStart);
         loopStart = incrementStart;
-        patchJump(bodyJump);
+        patchJump(parser, bodyJump);
     }
     
-    statement();
-    emitLoop(loopStart);
+    statement(parser);
+    emitLoop(parser, loopStart);
 
     // Since the jump leaves the value on the stack, we pop it before executing the body. That ensures we discard the value when the condition is true.
     // We do this only when there is a condition clause.
     if (exitJump != -1) {
-        patchJump(exitJump);
-        emitByte(OP_POP);
+        patchJump(parser, exitJump);
+        emitByte(parser, OP_POP);
     }
 
-    endScope();
+    endScope(parser);
 }
 
-static void ifStatement()
+static void ifStatement(Parser *parser)
 {
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
-    int elseJump = emitJump(OP_JUMP);
-    patchJump(thenJump);
-    emitByte(OP_POP);
-    if (match(TOKEN_ELSE))
-        statement();
-    patchJump(elseJump);
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
+    int elseJump = emitJump(parser, OP_JUMP);
+    patchJump(parser, thenJump);
+    emitByte(parser, OP_POP);
+    if (match(parser, TOKEN_ELSE))
+        statement(parser);
+    patchJump(parser, elseJump);
 }
 
-static void printStatement()
+static void printStatement(Parser *parser)
 {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emitByte(OP_PRINT);
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+    emitByte(parser, OP_PRINT);
 }
 
-static void returnStatement() {
-    if (current->type == TYPE_SCRIPT) {
-        error("Can't return from top-level code.");
+static void returnStatement(Parser *parser) {
+    if (parser->compiler->type == TYPE_SCRIPT) {
+        error(parser, "Can't return from top-level code.");
     }
 
-    if (match(TOKEN_SEMICOLON)) {
-        emitReturn();
+    if (match(parser, TOKEN_SEMICOLON)) {
+        emitReturn(parser);
     } else {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-        emitByte(OP_RETURN);
+        if (parser->compiler->type == TYPE_INITIALIZER)
+            error(parser, "Can't return a value from an initializer.");
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+        // A call that's the last thing before the return can reuse this frame.
+        // The OP_RETURN stays: jumps may land on it and native callees fall through to it.
+        // A generator's frame can't be reused, the generator resumes it.
+        Chunk *chunk = currentChunk(parser);
+        if (parser->compiler->isGenerator)
+        {
+            emitByte(parser, OP_GENERATOR_RETURN);
+            return;
+        }
+        if (parser->compiler->lastCall != -1 && parser->compiler->lastCall == chunk->count - 2 &&
+            chunk->code[parser->compiler->lastCall] == OP_CALL)
+        {
+            chunk->code[parser->compiler->lastCall] = OP_TAIL_CALL;
+        }
+        emitByte(parser, OP_RETURN);
     }
 }
 
-static void whileStatement()
+// Hands a value to whoever called the generator, the next call carries on after the yield.
+static void yieldStatement(Parser *parser)
 {
-    int loopStart = currentChunk()->count;
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    if (parser->compiler->type == TYPE_SCRIPT)
+    {
+        error(parser, "Can't yield from top-level code.");
+    }
+    else if (parser->compiler->type != TYPE_FUNCTION)
+    {
+        error(parser, "Methods can't yield.");
+    }
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
-    emitLoop(loopStart);
+    if (match(parser, TOKEN_SEMICOLON))
+    {
+        emitByte(parser, OP_NIL);
+    }
+    else
+    {
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after yield value.");
+    }
+    emitByte(parser, OP_YIELD);
+}
 
-    patchJump(exitJump);
-    emitByte(OP_POP);
+static void whileStatement(Parser *parser)
+{
+    int loopStart = currentChunk(parser)->count;
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
+    emitLoop(parser, loopStart);
+
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP);
 }
 
-static void statement()
+static void statement(Parser *parser)
 {
-    if (match(TOKEN_PRINT))
+    if (match(parser, TOKEN_PRINT))
+    {
+        printStatement(parser);
+    }
+    else if (match(parser, TOKEN_FOR))
+    {
+        forStatement(parser);
+    }
+    else if (match(parser, TOKEN_IF))
+    {
+        ifStatement(parser);
+    } else if (match(parser, TOKEN_RETURN)) {
+        returnStatement(parser);
+    }
+    else if (match(parser, TOKEN_YIELD))
     {
-        printStatement();
+        yieldStatement(parser);
     }
-    else if (match(TOKEN_FOR))
+    else if (match(parser, TOKEN_WHILE))
     {
-        forStatement();
+        whileStatement(parser);
     }
-    else if (match(TOKEN_IF))
+    else if (match(parser, TOKEN_LEFT_BRACE))
     {
-        ifStatement();
-    } else if (match(TOKEN_RETURN)) {
-        returnStatement();
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
     }
-    else if (match(TOKEN_WHILE))
+    else
     {
-        whileStatement();
+        expressionStatement(parser);
     }
-    else if (match(TOKEN_LEFT_BRACE))
+}
+
+// Counts a write to the global named by the token.
+static void countGlobalWrite(Parser *parser, Token *name)
+{
+    Value key = copyString(parser->vm, name->start, name->length);
+    Value writes = NUMBER_VAL(0);
+    tableGet(&parser->globalWrites, key, &writes);
+    push(parser->vm, key);
+    tableSet(parser->vm, &parser->globalWrites, key, NUMBER_VAL(AS_NUMBER(writes) + 1));
+    pop(parser->vm);
+}
+
+/*
+Scans the whole source once before compiling it to count how many times each name gets declared or assigned.
+Locals and parameters with the same name count too, that only makes the check more conservative.
+*/
+static void countGlobalWrites(Parser *parser, const char *source)
+{
+    initScanner(&parser->scanner, source);
+    Token previous = scanToken(&parser->scanner);
+    if (previous.type == TOKEN_EOF)
+        return;
+    for (;;)
     {
-        beginScope();
-        expressionStatement();
-        endScope();
+        Token token = scanToken(&parser->scanner);
+        if (token.type == TOKEN_EOF)
+            break;
+        if (previous.type == TOKEN_IDENTIFIER)
+        {
+            // `var x = ...` is a single write, the declaration already counted it.
+            if (token.type == TOKEN_EQUAL)
+                countGlobalWrite(parser, &previous);
+        }
+        else if ((previous.type == TOKEN_VAR || previous.type == TOKEN_FUN || previous.type == TOKEN_CLASS) &&
+                 token.type == TOKEN_IDENTIFIER)
+        {
+            countGlobalWrite(parser, &token);
+            token = scanToken(&parser->scanner);
+            if (token.type == TOKEN_EOF)
+                break;
+        }
+        previous = token;
     }
 }
 
-ObjFunction* compile(const char *source)
+ObjFunction* compile(VM *vm, const char *source)
 {
-    initScanner(source);
+    Parser state;
+    Parser *parser = &state;
+    parser->vm = vm;
+    parser->compiler = NULL;
+    parser->currentClass = NULL;
+    parser->hadError = false;
+    parser->panicMode = false;
+    initTable(&parser->globalWrites, TABLE_STRINGS);
+    initTable(&parser->constantGlobals, TABLE_STRINGS);
+    vm->parser = parser;
+    // The REPL compiles every line on its own, a later line can still reassign anything.
+    if (!vm->replMode)
+        countGlobalWrites(parser, source);
+
+    initScanner(&parser->scanner, source);
     Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
-    parser.hadError = false;
-    parser.panicMode = false;
-    advance();
-    while (!match(TOKEN_EOF))
+    initCompiler(parser, &compiler, TYPE_SCRIPT);
+    advance(parser);
+    while (!match(parser, TOKEN_EOF))
     {
-        declaration();
+        declaration(parser);
     }
 
-    ObjFunction* function = endCompiler();
-    return parser.hadError ? NULL : function;
-}
\ No newline at end of file
+    ObjFunction* function = endCompiler(parser);
+    freeTable(vm, &parser->constantGlobals);
+    freeTable(vm, &parser->globalWrites);
+    vm->parser = NULL;
+    return parser->hadError ? NULL : function;
+}
+
+void markCompilerRoots(VM *vm)
+{
+    Parser *parser = vm->parser;
+    if (parser == NULL)
+        return;
+    Compiler *compiler = parser->compiler;
+    while (compiler != NULL)
+    {
+        markObject(vm, (Obj *)compiler->function);
+        compiler = compiler->enclosing;
+    }
+    markTable(vm, &parser->globalWrites);
+    markTable(vm, &parser->constantGlobals);
+}
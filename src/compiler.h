@@ -5,6 +5,8 @@
 #include "object.h"
 
 // Given source code, it compiles it by writing bytes into the chunk.
-ObjFunction* compile(const char *source);
+ObjFunction* compile(VM *vm, const char *source);
+// Marks the functions still being compiled, they aren't reachable from the VM yet.
+void markCompilerRoots(VM *vm);
 
 #endif
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include "debug.h"
 #include "value.h"
 #include "object.h"
+#include "vm.h"
 
 // Prints a simple instruction.
 static int simpleInstruction(const char *name, int offset)
@@ -26,6 +27,59 @@ static int jumpInstruction(const char *name, int sign, Chunk *chunk, int offset)
     return offset + 3;
 }
 
+// Prints a fused pair of local reads followed by an add.
+static int localPairInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t a = chunk->code[offset + 1];
+    uint8_t b = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, a, b);
+    return offset + 3;
+}
+
+// Prints a global variable instruction with its slot index and name.
+static int globalInstruction(VM *vm, const char *name, Chunk *chunk, int offset)
+{
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d '%s'\n", name, slot, vm->globalSlots[slot].name->chars);
+    return offset + 3;
+}
+
+// Prints a constant key instruction, the hash after the key is left out.
+static int keyInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t constant = chunk->code[offset + 1];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 6;
+}
+
+// Prints a property instruction with its name and inline cache, OP_INVOKE also has its argument count.
+static int propertyInstruction(const char *name, Chunk *chunk, int offset, bool hasArgs)
+{
+    uint8_t constant = chunk->code[offset + 1];
+    int next = offset + 2;
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    if (hasArgs)
+        printf("' (%d args)", chunk->code[next++]);
+    else
+        printf("'");
+    printf(" cache %d\n", (chunk->code[next] << 8) | chunk->code[next + 1]);
+    return next + 2;
+}
+
+// Prints a super call with its method name and argument count.
+static int superInvokeInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t constant = chunk->code[offset + 1];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' (%d args)\n", chunk->code[offset + 2]);
+    return offset + 3;
+}
+
 // Prints a constant instruction.
 static int constantInstruction(const char *name, Chunk *chunk, int offset)
 {
@@ -51,26 +105,27 @@ static int constantLongInstruction(const char *name, Chunk *chunk, int offset)
     return offset + 4;
 }
 
-void disassembleChunk(Chunk *chunk, const char *name)
+void disassembleChunk(VM *vm, Chunk *chunk, const char *name)
 {
     printf("<-----------{ %s }----------->\n", name);
     for (int offset = 0; offset < chunk->count;)
     {
-        offset = disassembleInstruction(chunk, offset);
+        offset = disassembleInstruction(vm, chunk, offset);
     }
 }
 
-int disassembleInstruction(Chunk *chunk, int offset)
+int disassembleInstruction(VM *vm, Chunk *chunk, int offset)
 {
     printf("%04d ", offset);
 
-    if (offset > 0 && chunk->lines[offset].line == chunk->lines[offset - 1].line)
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1))
     {
         printf("  | ");
     }
     else
     {
-        printf("%4d ", chunk->lines[offset].line);
+        printf("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
@@ -78,6 +133,40 @@ int disassembleInstruction(Chunk *chunk, int offset)
     {
     case OP_RETURN:
         return simpleInstruction("OP_RETURN", offset);
+    case OP_GENERATOR:
+        return simpleInstruction("OP_GENERATOR", offset);
+    case OP_YIELD:
+        return simpleInstruction("OP_YIELD", offset);
+    case OP_GENERATOR_RETURN:
+        return simpleInstruction("OP_GENERATOR_RETURN", offset);
+    case OP_BUILD_LIST:
+        return byteInstruction("OP_BUILD_LIST", chunk, offset);
+    case OP_INDEX_GET:
+        return simpleInstruction("OP_INDEX_GET", offset);
+    case OP_INDEX_SET:
+        return simpleInstruction("OP_INDEX_SET", offset);
+    case OP_BUILD_MAP:
+        return byteInstruction("OP_BUILD_MAP", chunk, offset);
+    case OP_GET_KEY:
+        return keyInstruction("OP_GET_KEY", chunk, offset);
+    case OP_SET_KEY:
+        return keyInstruction("OP_SET_KEY", chunk, offset);
+    case OP_CLASS:
+        return constantInstruction("OP_CLASS", chunk, offset);
+    case OP_METHOD:
+        return constantInstruction("OP_METHOD", chunk, offset);
+    case OP_INHERIT:
+        return simpleInstruction("OP_INHERIT", offset);
+    case OP_GET_PROPERTY:
+        return propertyInstruction("OP_GET_PROPERTY", chunk, offset, false);
+    case OP_SET_PROPERTY:
+        return propertyInstruction("OP_SET_PROPERTY", chunk, offset, false);
+    case OP_INVOKE:
+        return propertyInstruction("OP_INVOKE", chunk, offset, true);
+    case OP_GET_SUPER:
+        return constantInstruction("OP_GET_SUPER", chunk, offset);
+    case OP_SUPER_INVOKE:
+        return superInvokeInstruction("OP_SUPER_INVOKE", chunk, offset);
     case OP_CONSTANT:
         return constantInstruction("OP_CONSTANT", chunk, offset);
     case OP_CONSTANT_LONG:
@@ -111,11 +200,11 @@ int disassembleInstruction(Chunk *chunk, int offset)
     case OP_POP:
         return simpleInstruction("OP_POP", offset);
     case OP_DEFINE_GLOBAL:
-        return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        return globalInstruction(vm, "OP_DEFINE_GLOBAL", chunk, offset);
     case OP_GET_GLOBAL:
-        return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+        return globalInstruction(vm, "OP_GET_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-        return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        return globalInstruction(vm, "OP_SET_GLOBAL", chunk, offset);
     case OP_GET_LOCAL:
         return byteInstruction("OP_GET_LOCAL", chunk, offset);
     case OP_SET_LOCAL:
@@ -128,6 +217,16 @@ int disassembleInstruction(Chunk *chunk, int offset)
         return jumpInstruction("OP_LOOP", -1, chunk, offset);
     case OP_CALL:
         return byteInstruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+        return byteInstruction("OP_TAIL_CALL", chunk, offset);
+    case OP_ADD_NUM:
+        return simpleInstruction("OP_ADD_NUM", offset);
+    case OP_ADD_STR:
+        return simpleInstruction("OP_ADD_STR", offset);
+    case OP_EQUAL_NUM:
+        return simpleInstruction("OP_EQUAL_NUM", offset);
+    case OP_LOOP_TRACE:
+        return jumpInstruction("OP_LOOP_TRACE", -1, chunk, offset);
     case OP_CLOSURE:
     {
         offset++;
@@ -156,6 +255,22 @@ int disassembleInstruction(Chunk *chunk, int offset)
 
     case OP_CLOSE_UPVALUE:
         return simpleInstruction("OP_CLOSE_UPVALUE", offset);
+    case OP_GREATER_EQUAL:
+        return simpleInstruction("OP_GREATER_EQUAL", offset);
+    case OP_LESS_EQUAL:
+        return simpleInstruction("OP_LESS_EQUAL", offset);
+    case OP_NOT_EQUAL:
+        return simpleInstruction("OP_NOT_EQUAL", offset);
+    case OP_POP_JUMP_IF_FALSE:
+        return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_LESS_JUMP_IF_FALSE:
+        return jumpInstruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_GREATER_JUMP_IF_FALSE:
+        return jumpInstruction("OP_GREATER_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_EQUAL_JUMP_IF_FALSE:
+        return jumpInstruction("OP_EQUAL_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_GET_LOCAL_GET_LOCAL_ADD:
+        return localPairInstruction("OP_GET_LOCAL_GET_LOCAL_ADD", chunk, offset);
     default:
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
@@ -4,8 +4,8 @@
 #include "chunk.h"
 
 // Disassembles all instructions inside the given chunk.
-void disassembleChunk(Chunk *chunk, const char *name);
+void disassembleChunk(VM *vm, Chunk *chunk, const char *name);
 // Disassembles a instruction given the chunk and the offset.
-int disassembleInstruction(Chunk *chunk, int offset);
+int disassembleInstruction(VM *vm, Chunk *chunk, int offset);
 
 #endif
\ No newline at end of file
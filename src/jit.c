@@ -0,0 +1,486 @@
+#include "common.h"
+
+#ifdef JIT_ENABLED
+
+#include <stdio.h>
+#include <string.h>
+
+#include "assembler.h"
+#include "jit.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "trace.h"
+
+/*
+Baseline template JIT for x86-64 (System V).
+Every bytecode instruction is translated on its own into a fixed machine code template with its operands (slot
+indices, constants, jump targets) patched in. The templates work on the VM stack in memory, they only keep these
+registers pinned while native code runs:
+
+    rbx  frame->slots
+    r12  the CallFrame
+    r13  &vm->stackTop
+    r14  the stack top, written back to vm->stackTop before leaving
+
+A function only ever runs on the VM that compiled it, so the code has that VM's addresses baked in.
+
+Numbers are handled inline with SSE2. When an operand isn't what a template expects, or the instruction has no
+template at all (calls, returns, closures...), the code leaves through an exit stub that stores the stack top and
+the instruction's address in frame->ip, so the interpreter runs that instruction as if it had been there all along.
+*/
+
+typedef void (*JitEntry)(CallFrame *frame, void *target);
+
+#define FRAME_IP ((int)offsetof(CallFrame, ip))
+#define FRAME_SLOTS ((int)offsetof(CallFrame, slots))
+#define FRAME_CLOSURE ((int)offsetof(CallFrame, closure))
+
+typedef struct
+{
+    VM *vm;
+    Assembler as;
+    Chunk *chunk;
+    int *labels;     // Bytecode offset -> position of its translation, -1 between instructions.
+    PatchList jumps; // Jumps to bytecode offsets.
+    PatchList exits; // Jumps to the exit stub of an instruction.
+    int instruction; // Offset of the instruction being translated.
+} Translator;
+
+static void jumpToOffset(Translator *t, int at, int target)
+{
+    writePatchList(&t->jumps, at, target);
+}
+
+// Leaves native code through the current instruction's exit stub when the condition holds.
+static void exitIf(Translator *t, int condition)
+{
+    writePatchList(&t->exits, asmJumpIf(&t->as, condition), t->instruction);
+}
+
+static void exitAlways(Translator *t)
+{
+    writePatchList(&t->exits, asmJump(&t->as), t->instruction);
+}
+
+// Address of the value `distance` slots below the stack top.
+static int32_t stackSlot(int distance)
+{
+    return -(distance + 1) * VALUE_SIZE;
+}
+
+static void pushValue(Translator *t, int srcBase, int32_t srcDisp)
+{
+    asmCopyValue(&t->as, R14, 0, srcBase, srcDisp);
+    asmAddImmediate(&t->as, R14, VALUE_SIZE);
+}
+
+static void pushConstant(Translator *t, Value value)
+{
+    asmStoreValue(&t->as, R14, 0, value);
+    asmAddImmediate(&t->as, R14, VALUE_SIZE);
+}
+
+static void guardNumber(Translator *t, int base, int32_t disp)
+{
+    writePatchList(&t->exits, asmJumpIfNotNumber(&t->as, base, disp), t->instruction);
+}
+
+// Guards the two values on top of the stack as numbers and loads the lower one to xmm0, the top one to xmm1.
+static void loadOperands(Translator *t)
+{
+    guardNumber(t, R14, stackSlot(1));
+    guardNumber(t, R14, stackSlot(0));
+    asmLoadDouble(&t->as, 0, R14, stackSlot(1) + NUMBER_OFFSET);
+    asmLoadDouble(&t->as, 1, R14, stackSlot(0) + NUMBER_OFFSET);
+}
+
+static void binaryNumber(Translator *t, uint8_t opcode)
+{
+    loadOperands(t);
+    asmSseOp(&t->as, 0xf2, opcode, 0, 1);
+    asmStoreNumber(&t->as, R14, stackSlot(1), 0);
+    asmAddImmediate(&t->as, R14, -VALUE_SIZE);
+}
+
+/*
+Compares the two numbers on top of the stack into al. The flags come from comparing `first` to `second` (0 is the
+lower operand a, 1 the top one b), condition picks the outcome, e.g. a < b is ucomisd b, a and seta.
+*/
+static void compareNumbers(Translator *t, int first, int second, int condition)
+{
+    loadOperands(t);
+    asmCompareDoubles(&t->as, first, second);
+    asmSetCondition(&t->as, condition, RAX);
+    asmStoreBool(&t->as, R14, stackSlot(1));
+    asmAddImmediate(&t->as, R14, -VALUE_SIZE);
+}
+
+// a == b, NaN is never equal to anything.
+static void equalNumbers(Translator *t, bool negate)
+{
+    loadOperands(t);
+    asmCompareDoubles(&t->as, 0, 1);
+    asmSetCondition(&t->as, negate ? CC_NE : CC_E, RAX);
+    asmSetCondition(&t->as, negate ? CC_P : CC_NP, RCX);
+    asmByte(&t->as, negate ? 0x08 : 0x20); // or/and al, cl
+    asmByte(&t->as, 0xc8);
+    asmStoreBool(&t->as, R14, stackSlot(1));
+    asmAddImmediate(&t->as, R14, -VALUE_SIZE);
+}
+
+// Pops two numbers and jumps to target when the comparison, set up like compareNumbers(), doesn't hold.
+static void compareJump(Translator *t, int first, int second, int target)
+{
+    loadOperands(t);
+    asmAddImmediate(&t->as, R14, -2 * VALUE_SIZE);
+    asmCompareDoubles(&t->as, first, second);
+    jumpToOffset(t, asmJumpIf(&t->as, CC_BE), target);
+}
+
+static void jumpIfFalsey(Translator *t, int32_t disp, int target)
+{
+    int falsey[2];
+    asmJumpIfFalsey(&t->as, R14, disp, falsey);
+    jumpToOffset(t, falsey[0], target);
+    jumpToOffset(t, falsey[1], target);
+}
+
+// Writes back the stack top, calls a C function taking the VM and reloads what it may have moved.
+static void callHelper(Translator *t, void (*helper)(VM *vm))
+{
+    asmStore(&t->as, R13, 0, R14);
+    asmMoveImmediate(&t->as, RDI, (uint64_t)(uintptr_t)t->vm);
+    asmMoveImmediate(&t->as, RAX, (uint64_t)(uintptr_t)helper);
+    asmByte(&t->as, 0xff); // call rax
+    asmByte(&t->as, 0xd0);
+    asmLoad(&t->as, R14, R13, 0);
+    asmLoad(&t->as, RBX, R12, FRAME_SLOTS);
+}
+
+static void printHelper(VM *vm)
+{
+    printValue(pop(vm));
+    printf("\n");
+}
+
+// Loads the address of the global slot array into rdx, it moves whenever a new global is added.
+static void loadGlobals(Translator *t)
+{
+    asmMoveImmediate(&t->as, RAX, (uint64_t)(uintptr_t)&t->vm->globalSlots);
+    asmLoad(&t->as, RDX, RAX, 0);
+}
+
+// Loads the upvalue's location pointer into rdx.
+static void loadUpvalue(Translator *t, int slot)
+{
+    asmLoad(&t->as, RAX, R12, FRAME_CLOSURE);
+    asmLoad(&t->as, RAX, RAX, (int32_t)offsetof(ObjClosure, upvalues));
+    asmLoad(&t->as, RAX, RAX, slot * (int32_t)sizeof(ObjUpvalue *));
+    asmLoad(&t->as, RDX, RAX, (int32_t)offsetof(ObjUpvalue, location));
+}
+
+static uint16_t readShort(Chunk *chunk, int offset)
+{
+    return (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+}
+
+// Translates the instruction at offset, anything without a template leaves native code right there.
+static void translate(Translator *t, int offset)
+{
+    Assembler *as = &t->as;
+    Chunk *chunk = t->chunk;
+    uint8_t *code = chunk->code;
+    switch (code[offset])
+    {
+    case OP_CONSTANT:
+        pushConstant(t, chunk->constants.values[code[offset + 1]]);
+        break;
+    case OP_CONSTANT_LONG:
+        pushConstant(t, chunk->constants.values[(code[offset + 1] << 16) | readShort(chunk, offset + 2)]);
+        break;
+    case OP_NIL:
+        pushConstant(t, NIL_VAL);
+        break;
+    case OP_TRUE:
+        pushConstant(t, BOOL_VAL(true));
+        break;
+    case OP_FALSE:
+        pushConstant(t, BOOL_VAL(false));
+        break;
+    case OP_POP:
+        asmAddImmediate(as, R14, -VALUE_SIZE);
+        break;
+
+    case OP_GET_LOCAL:
+        pushValue(t, RBX, code[offset + 1] * VALUE_SIZE);
+        break;
+    case OP_SET_LOCAL:
+        asmCopyValue(as, RBX, code[offset + 1] * VALUE_SIZE, R14, stackSlot(0));
+        break;
+
+    // Undefined globals exit, the interpreter reports them.
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    {
+        int32_t global = readShort(chunk, offset + 1) * (int32_t)sizeof(GlobalSlot);
+        int32_t value = global + (int32_t)offsetof(GlobalSlot, value);
+        int32_t defined = global + (int32_t)offsetof(GlobalSlot, defined);
+        loadGlobals(t);
+        if (code[offset] == OP_DEFINE_GLOBAL)
+        {
+            asmCopyValue(as, RDX, value, R14, stackSlot(0));
+            asmStoreByteImmediate(as, RDX, defined, 1);
+            asmAddImmediate(as, R14, -VALUE_SIZE);
+            break;
+        }
+        asmCompareByte(as, RDX, defined, 0);
+        exitIf(t, CC_E);
+        if (code[offset] == OP_GET_GLOBAL)
+            pushValue(t, RDX, value);
+        else
+            asmCopyValue(as, RDX, value, R14, stackSlot(0));
+        break;
+    }
+
+    case OP_GET_UPVALUE:
+        loadUpvalue(t, code[offset + 1]);
+        pushValue(t, RDX, 0);
+        break;
+    case OP_SET_UPVALUE:
+        loadUpvalue(t, code[offset + 1]);
+        asmCopyValue(as, RDX, 0, R14, stackSlot(0));
+        break;
+
+    // Strings and type errors are the interpreter's business.
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+        binaryNumber(t, ASM_ADDSD);
+        break;
+    case OP_SUBTRACT:
+        binaryNumber(t, ASM_SUBSD);
+        break;
+    case OP_MULTIPLY:
+        binaryNumber(t, ASM_MULSD);
+        break;
+    case OP_DIVIDE:
+        binaryNumber(t, ASM_DIVSD);
+        break;
+    case OP_GET_LOCAL_GET_LOCAL_ADD:
+    {
+        int32_t a = code[offset + 1] * VALUE_SIZE;
+        int32_t b = code[offset + 2] * VALUE_SIZE;
+        guardNumber(t, RBX, a);
+        guardNumber(t, RBX, b);
+        asmLoadDouble(as, 0, RBX, a + NUMBER_OFFSET);
+        asmLoadDouble(as, 1, RBX, b + NUMBER_OFFSET);
+        asmSseOp(as, 0xf2, ASM_ADDSD, 0, 1);
+        asmStoreNumber(as, R14, 0, 0);
+        asmAddImmediate(as, R14, VALUE_SIZE);
+        break;
+    }
+
+    case OP_NEGATE:
+        guardNumber(t, R14, stackSlot(0));
+        asmLoad(as, RAX, R14, stackSlot(0) + NUMBER_OFFSET);
+        asmMoveImmediate(as, RCX, (uint64_t)1 << 63);
+        asmRegisterOp(as, ASM_XOR, RAX, RCX);
+        asmStore(as, R14, stackSlot(0) + NUMBER_OFFSET, RAX);
+        break;
+    case OP_NOT:
+    {
+        int falsey[2];
+        asmJumpIfFalsey(as, R14, stackSlot(0), falsey);
+        asmByte(as, 0x31); // xor eax, eax
+        asmByte(as, 0xc0);
+        int done = asmJump(as);
+        asmLand(as, falsey[0]);
+        asmLand(as, falsey[1]);
+        asmByte(as, 0xb8); // mov eax, 1
+        asm32(as, 1);
+        asmLand(as, done);
+        asmStoreBool(as, R14, stackSlot(0));
+        break;
+    }
+
+    // Comparisons written as negations keep their NaN behaviour, see foldBinary().
+    case OP_LESS:
+        compareNumbers(t, 1, 0, CC_A);
+        break;
+    case OP_GREATER:
+        compareNumbers(t, 0, 1, CC_A);
+        break;
+    case OP_GREATER_EQUAL:
+        compareNumbers(t, 1, 0, CC_BE);
+        break;
+    case OP_LESS_EQUAL:
+        compareNumbers(t, 0, 1, CC_BE);
+        break;
+    case OP_EQUAL:
+    case OP_EQUAL_NUM:
+        equalNumbers(t, false);
+        break;
+    case OP_NOT_EQUAL:
+        equalNumbers(t, true);
+        break;
+
+    case OP_JUMP:
+        jumpToOffset(t, asmJump(as), jumpTarget(chunk, offset));
+        break;
+    // Counts towards recording a trace of the loop, the interpreter does the recording.
+    case OP_LOOP:
+        asmMoveImmediate(as, RAX, (uint64_t)(uintptr_t)HOT_LOOP_COUNTER(t->vm, code + offset));
+        asmDecrementWord(as, RAX, 0);
+        exitIf(t, CC_E);
+        jumpToOffset(t, asmJump(as), jumpTarget(chunk, offset));
+        break;
+    case OP_JUMP_IF_FALSE:
+        jumpIfFalsey(t, stackSlot(0), jumpTarget(chunk, offset));
+        break;
+    case OP_POP_JUMP_IF_FALSE:
+        asmAddImmediate(as, R14, -VALUE_SIZE);
+        jumpIfFalsey(t, 0, jumpTarget(chunk, offset));
+        break;
+    case OP_LESS_JUMP_IF_FALSE:
+        compareJump(t, 1, 0, jumpTarget(chunk, offset));
+        break;
+    case OP_GREATER_JUMP_IF_FALSE:
+        compareJump(t, 0, 1, jumpTarget(chunk, offset));
+        break;
+    case OP_EQUAL_JUMP_IF_FALSE:
+    {
+        int target = jumpTarget(chunk, offset);
+        loadOperands(t);
+        asmAddImmediate(as, R14, -2 * VALUE_SIZE);
+        asmCompareDoubles(as, 0, 1);
+        jumpToOffset(t, asmJumpIf(as, CC_NE), target);
+        jumpToOffset(t, asmJumpIf(as, CC_P), target);
+        break;
+    }
+
+    case OP_PRINT:
+        callHelper(t, printHelper);
+        break;
+
+    default:
+        exitAlways(t);
+        break;
+    }
+}
+
+static void freeTranslator(Translator *t)
+{
+    freeAssembler(&t->as);
+    FREE_ARRAY(t->vm, int, t->labels, t->chunk->count);
+    freePatchList(&t->jumps);
+    freePatchList(&t->exits);
+}
+
+void jitCompile(VM *vm, ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    Translator t;
+    t.vm = vm;
+    initAssembler(vm, &t.as);
+    t.chunk = chunk;
+    t.labels = ALLOCATE(vm, int, chunk->count);
+    initPatchList(vm, &t.jumps);
+    initPatchList(vm, &t.exits);
+    for (int i = 0; i < chunk->count; i++)
+    {
+        t.labels[i] = -1;
+    }
+    Assembler *as = &t.as;
+
+    // Entry: save the callee-saved registers (five pushes keep rsp 16-byte aligned for calls), pin the frame
+    // state and jump to the translation of the instruction run() stopped at.
+    asmPush(as, RBX);
+    asmPush(as, R12);
+    asmPush(as, R13);
+    asmPush(as, R14);
+    asmPush(as, R15);
+    asmRegisterOp(as, ASM_MOV, R12, RDI);
+    asmLoad(as, RBX, R12, FRAME_SLOTS);
+    asmMoveImmediate(as, R13, (uint64_t)(uintptr_t)&vm->stackTop);
+    asmLoad(as, R14, R13, 0);
+    asmByte(as, 0xff); // jmp rsi
+    asmByte(as, 0xe6);
+
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        t.labels[offset] = as->count;
+        t.instruction = offset;
+        translate(&t, offset);
+    }
+
+    int epilogue = as->count;
+    asmPop(as, R15);
+    asmPop(as, R14);
+    asmPop(as, R13);
+    asmPop(as, R12);
+    asmPop(as, RBX);
+    asmByte(as, 0xc3); // ret
+
+    for (int i = 0; i < t.jumps.count; i++)
+    {
+        asmPatchRel32(as, t.jumps.patches[i].at, t.labels[t.jumps.patches[i].target]);
+    }
+
+    // One stub per instruction that can leave: sync the stack top and point frame->ip at the instruction.
+    // Exits were recorded in code order, so all the exits of an instruction are next to each other.
+    for (int i = 0; i < t.exits.count;)
+    {
+        int instruction = t.exits.patches[i].target;
+        int stub = as->count;
+        asmStore(as, R13, 0, R14);
+        asmMoveImmediate(as, RAX, (uint64_t)(uintptr_t)(chunk->code + instruction));
+        asmStore(as, R12, FRAME_IP, RAX);
+        asmPatchRel32(as, asmJump(as), epilogue);
+        for (; i < t.exits.count && t.exits.patches[i].target == instruction; i++)
+        {
+            asmPatchRel32(as, t.exits.patches[i].at, stub);
+        }
+    }
+
+    uint8_t *memory = asmFinish(as);
+    if (memory == NULL)
+    {
+        freeTranslator(&t);
+        function->hotness = INT32_MIN;
+        return;
+    }
+
+    JitCode *jit = ALLOCATE(vm, JitCode, 1);
+    jit->code = memory;
+    jit->size = as->count;
+    jit->count = chunk->count;
+    jit->entries = ALLOCATE(vm, void *, chunk->count);
+    for (int i = 0; i < chunk->count; i++)
+    {
+        jit->entries[i] = t.labels[i] == -1 ? NULL : memory + t.labels[i];
+    }
+    function->jit = jit;
+    freeTranslator(&t);
+}
+
+void jitRun(JitCode *jit, CallFrame *frame)
+{
+    int offset = (int)(frame->ip - frame->closure->function->chunk.code);
+    void *target = jit->entries[offset];
+    if (target == NULL)
+        return;
+
+    JitEntry entry;
+    memcpy(&entry, &jit->code, sizeof(entry)); // The entry sequence starts the code.
+    entry(frame, target);
+}
+
+void jitFree(VM *vm, JitCode *jit)
+{
+    asmRelease(jit->code, jit->size);
+    FREE_ARRAY(vm, void *, jit->entries, jit->count);
+    FREE(vm, JitCode, jit);
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "object.h"
+#include "vm.h"
+
+// Calls plus loop back-edges a function runs through before it's translated to machine code.
+#define JIT_THRESHOLD 1000
+
+/*
+Machine code for one function.
+Every instruction start of the chunk is also an entry point, so run() can hand a frame over at a call, a return or
+a loop back-edge, wherever its ip is.
+*/
+struct JitCode
+{
+    uint8_t *code;  // Executable mapping.
+    size_t size;
+    void **entries; // Bytecode offset -> native address, NULL for offsets inside an instruction.
+    int count;      // Number of entries, the chunk's size when it was translated.
+};
+
+#ifdef JIT_ENABLED
+// Translates the function's chunk. If it can't, function->jit stays NULL and the function is never tried again.
+void jitCompile(VM *vm, ObjFunction *function);
+
+/*
+Runs the top frame natively from frame->ip until the code reaches an instruction it doesn't translate or whose
+operands it doesn't expect. Then frame->ip and vm->stackTop point at that instruction, for the interpreter to run it.
+*/
+void jitRun(JitCode *jit, CallFrame *frame);
+
+void jitFree(VM *vm, JitCode *jit);
+#endif
+
+#endif
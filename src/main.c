@@ -1,12 +1,13 @@
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "pool.h"
 #include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static void repl()
+static void repl(VM *vm)
 {
    char line[1024];
    for (;;)
@@ -17,7 +18,7 @@ static void repl()
          printf("\n");
          break;
       }
-      interpret(line);
+      interpret(vm, line);
    }
 }
 
@@ -54,10 +55,22 @@ static char *readFile(const char *path)
    return buffer;
 }
 
-static void runFile(const char *path)
+static void runFile(VM *vm, const char *path)
 {
    char *source = readFile(path);
-   InterpretResult result = interpret(source);
+   InterpretResult result = interpret(vm, source);
+   free(source);
+
+   if (result == INTERPRET_COMPILE_ERROR)
+      exit(65);
+   if (result == INTERPRET_RUNTIME_ERROR)
+      exit(70);
+}
+
+static void runIsolatesFile(const char *path, int isolates, int threads, int maxFrames)
+{
+   char *source = readFile(path);
+   InterpretResult result = runIsolates(source, isolates, threads, maxFrames);
    free(source);
 
    if (result == INTERPRET_COMPILE_ERROR)
@@ -69,23 +82,74 @@ static void runFile(const char *path)
 int main(int argc, const char *argv[])
 {
    printf("Working...\n");
-   initVM();
 
-   if (argc == 1)
+   // --no-jit keeps every function in the interpreter, to compare the two tiers.
+   // --max-frames N sets the call depth a runaway recursion stops at, FRAMES_MAX by default.
+   // --isolates N compiles the file once and runs it N times at once on --threads T workers, see pool.h.
+   bool jitEnabled = true;
+   int maxFrames = FRAMES_MAX;
+   int isolates = 0;
+   int threads = 0;
+   while (argc > 1 && strncmp(argv[1], "--", 2) == 0)
    {
-      vm.replMode = true;
+      if (strcmp(argv[1], "--no-jit") == 0)
+      {
+         jitEnabled = false;
+      }
+      else if (strcmp(argv[1], "--max-frames") == 0 && argc > 2 && atoi(argv[2]) > 0)
+      {
+         maxFrames = atoi(argv[2]);
+         argc--;
+         argv++;
+      }
+      else if (strcmp(argv[1], "--isolates") == 0 && argc > 2 && atoi(argv[2]) > 0)
+      {
+         isolates = atoi(argv[2]);
+         argc--;
+         argv++;
+      }
+      else if (strcmp(argv[1], "--threads") == 0 && argc > 2 && atoi(argv[2]) > 0)
+      {
+         threads = atoi(argv[2]);
+         argc--;
+         argv++;
+      }
+      else
+      {
+         break;
+      }
+      argc--;
+      argv++;
    }
-   else if (argc == 2)
+
+   if (argc > 2 || (isolates > 0 && argc != 2))
    {
-      printf("Running file...\n");
-      runFile(argv[1]);
+      fprintf(stderr, "Usage: clox [--no-jit] [--max-frames N] [--isolates N [--threads T]] [path]\n");
+      fprintf(stderr, "Isolates waiting on each other through channels need a thread each, T >= N.\n");
+      exit(64);
+   }
+
+   // Isolates never run on a VM of their own here, the pool makes one per isolate.
+   if (isolates > 0)
+   {
+      runIsolatesFile(argv[1], isolates, threads, maxFrames);
+      return 0;
+   }
+
+   VM vm;
+   initVM(&vm);
+   vm.jitEnabled = jitEnabled;
+   vm.maxFrames = maxFrames;
+   if (argc == 1)
+   {
+      vm.replMode = true;
    }
    else
    {
-      fprintf(stderr, "Usage: clox [path]\n");
-      exit(64);
+      printf("Running file...\n");
+      runFile(&vm, argv[1]);
    }
 
-   freeVM();
+   freeVM(&vm);
    return 0;
 }
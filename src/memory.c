@@ -1,9 +1,30 @@
 #include <stdlib.h>
 #include "memory.h"
+#include "compiler.h"
 #include "vm.h"
+#include "jit.h"
+#include "trace.h"
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize)
+#ifdef DEBUG_LOG_GC
+#include <stdio.h>
+#endif
+
+void *reallocate(VM *vm, void *pointer, size_t oldSize, size_t newSize)
 {
+    vm->bytesAllocated += newSize - oldSize;
+
+    // Only growing allocations may trigger a collection, freeing memory never does.
+    if (newSize > oldSize)
+    {
+#ifdef DEBUG_STRESS_GC
+        collectGarbage(vm);
+#endif
+        if (vm->bytesAllocated > vm->nextGC)
+        {
+            collectGarbage(vm);
+        }
+    }
+
     if (newSize == 0)
     {
         free(pointer);
@@ -20,36 +41,88 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize)
 This is a CS 101 textbook implementation of walking a linked list and freeing its nodes.
 Frees objects specific memory
 */
-static void freeObject(Obj *object)
+static void freeObject(VM *vm, Obj *object)
 {
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void *)object, object->type);
+#endif
+
     switch (object->type)
     {
     case OBJ_STRING:
     {
+        // The characters are in the same allocation, after the header.
         ObjString *string = (ObjString *)object;
-
-        if (string->ownsChars)
-        {
-            FREE_ARRAY(char, string->chars, string->length + 1);
-        }
-        else
-        {
-            FREE(ObjString, object);
-        }
+        reallocate(vm, object, sizeof(ObjString) + string->length + 1, 0);
         break;
     }
     case OBJ_CLOSURE: {
         ObjClosure* closure = (ObjClosure*)object;
-        FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-        FREE(ObjClosure, object);
+        FREE_ARRAY(vm, ObjUpvalue*, closure->upvalues, closure->upvalueCount);
+        FREE(vm, ObjClosure, object);
         break;
     }
     case OBJ_NATIVE: {
-        FREE(ObjNative, object);
+        FREE(vm, ObjNative, object);
         break;
     }
     case OBJ_UPVALUE:
-        FREE(ObjUpvalue, object);
+        FREE(vm, ObjUpvalue, object);
+        break;
+    case OBJ_CHANNEL:
+        FREE(vm, ObjChannel, object);
+        break;
+    case OBJ_FIBER:
+    {
+        ObjFiber *fiber = (ObjFiber *)object;
+        FREE_ARRAY(vm, Value, fiber->stack, fiber->stackCapacity);
+        FREE_ARRAY(vm, CallFrame, fiber->frames, fiber->frameCapacity);
+        FREE(vm, ObjFiber, object);
+        break;
+    }
+    case OBJ_GENERATOR:
+    {
+        ObjGenerator *generator = (ObjGenerator *)object;
+        FREE_ARRAY(vm, Value, generator->slots, generator->slotCapacity);
+        FREE(vm, ObjGenerator, object);
+        break;
+    }
+    case OBJ_LIST:
+        freeValueArray(vm, &((ObjList *)object)->items);
+        FREE(vm, ObjList, object);
+        break;
+    case OBJ_MAP:
+        freeTable(vm, &((ObjMap *)object)->table);
+        FREE(vm, ObjMap, object);
+        break;
+    case OBJ_SHAPE:
+    {
+        ObjShape *shape = (ObjShape *)object;
+        FREE_ARRAY(vm, ObjShape *, shape->transitions, shape->transitionCapacity);
+        FREE(vm, ObjShape, object);
+        break;
+    }
+    case OBJ_CLASS:
+        freeTable(vm, &((ObjClass *)object)->methods);
+        FREE(vm, ObjClass, object);
+        break;
+    case OBJ_INSTANCE:
+    {
+        ObjInstance *instance = (ObjInstance *)object;
+        if (instance->fields != instance->inlineFields)
+            FREE_ARRAY(vm, Value, instance->fields, instance->fieldCapacity);
+        reallocate(vm, object, sizeof(ObjInstance) + sizeof(Value) * instance->inlineCapacity, 0);
+        break;
+    }
+    case OBJ_BOUND_METHOD:
+        FREE(vm, ObjBoundMethod, object);
+        break;
+    case OBJ_ROPE:
+        FREE(vm, ObjRope, object);
+        break;
+    case OBJ_FLOAT_ARRAY:
+        FREE_ARRAY(vm, double, ((ObjFloatArray *)object)->values, ((ObjFloatArray *)object)->count);
+        FREE(vm, ObjFloatArray, object);
         break;
     case OBJ_FUNCTION: {
         /*
@@ -57,8 +130,13 @@ static void freeObject(Obj *object)
         Functions own their chunk, so we call Chunk’s destructor-like function.
         */
         ObjFunction* function = (ObjFunction*)object;
-        freeChunk(&function->chunk);
-        FREE(ObjFunction, object);
+#ifdef JIT_ENABLED
+        if (function->jit != NULL)
+            jitFree(vm, function->jit);
+        freeTraces(vm, function);
+#endif
+        freeChunk(vm, &function->chunk);
+        FREE(vm, ObjFunction, object);
         break;
     }
     
@@ -68,13 +146,308 @@ static void freeObject(Obj *object)
     }
 }
 
-void freeObjects()
+void markObject(VM *vm, Obj *object)
+{
+    if (object == NULL)
+        return;
+    if (object->isMarked)
+        return;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void *)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    object->isMarked = true;
+
+    // The gray stack uses the system realloc() so growing it can't start a nested collection.
+    if (vm->grayCapacity < vm->grayCount + 1)
+    {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+        vm->grayStack = (Obj **)realloc(vm->grayStack, sizeof(Obj *) * vm->grayCapacity);
+        if (vm->grayStack == NULL)
+            exit(1);
+    }
+    vm->grayStack[vm->grayCount++] = object;
+}
+
+void markValue(VM *vm, Value value)
+{
+    if (IS_OBJ(value))
+        markObject(vm, AS_OBJ(value));
+}
+
+static void markArray(VM *vm, ValueArray *array)
 {
-    Obj *object = vm.objects;
+    for (int i = 0; i < array->count; i++)
+    {
+        markValue(vm, array->values[i]);
+    }
+}
+
+// Marks everything the object references, turning it from gray to black.
+static void blackenObject(VM *vm, Obj *object)
+{
+#ifdef DEBUG_LOG_GC
+    printf("%p blacken ", (void *)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    switch (object->type)
+    {
+    case OBJ_CLOSURE:
+    {
+        ObjClosure *closure = (ObjClosure *)object;
+        markObject(vm, (Obj *)closure->function);
+        for (int i = 0; i < closure->upvalueCount; i++)
+        {
+            markObject(vm, (Obj *)closure->upvalues[i]);
+        }
+        break;
+    }
+    case OBJ_FUNCTION:
+    {
+        ObjFunction *function = (ObjFunction *)object;
+        markObject(vm, (Obj *)function->name);
+        markArray(vm, &function->chunk.constants);
+        for (int i = 0; i < function->chunk.cacheCount; i++)
+        {
+            for (int j = 0; j < INLINE_CACHE_SIZE; j++)
+            {
+                CacheEntry *entry = &function->chunk.caches[i].entries[j];
+                markObject(vm, (Obj *)entry->shape);
+                markObject(vm, (Obj *)entry->target);
+                markObject(vm, (Obj *)entry->method);
+            }
+        }
+#ifdef JIT_ENABLED
+        markTraces(vm, function);
+#endif
+        break;
+    }
+    case OBJ_UPVALUE:
+        // Open upvalues point into the stack, which is a root anyway.
+        markValue(vm, ((ObjUpvalue *)object)->closed);
+        break;
+    case OBJ_FIBER:
+    {
+        ObjFiber *fiber = (ObjFiber *)object;
+        markObject(vm, (Obj *)fiber->caller);
+        // The running fiber's state is the VM's, markRoots() took care of it.
+        for (Value *slot = fiber->stack; slot < fiber->stackTop; slot++)
+        {
+            markValue(vm, *slot);
+        }
+        for (int i = 0; i < fiber->frameCount; i++)
+        {
+            markObject(vm, (Obj *)fiber->frames[i].closure);
+        }
+        for (ObjUpvalue *upvalue = fiber->openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+        {
+            markObject(vm, (Obj *)upvalue);
+        }
+        break;
+    }
+    case OBJ_GENERATOR:
+    {
+        ObjGenerator *generator = (ObjGenerator *)object;
+        markObject(vm, (Obj *)generator->closure);
+        for (int i = 0; i < generator->slotCount; i++)
+        {
+            markValue(vm, generator->slots[i]);
+        }
+        for (ObjUpvalue *upvalue = generator->openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+        {
+            markObject(vm, (Obj *)upvalue);
+        }
+        break;
+    }
+    case OBJ_LIST:
+        markArray(vm, &((ObjList *)object)->items);
+        break;
+    case OBJ_MAP:
+        markTable(vm, &((ObjMap *)object)->table);
+        break;
+    case OBJ_SHAPE:
+    {
+        ObjShape *shape = (ObjShape *)object;
+        markObject(vm, (Obj *)shape->klass);
+        markObject(vm, (Obj *)shape->parent);
+        markObject(vm, (Obj *)shape->name);
+        for (int i = 0; i < shape->transitionCount; i++)
+        {
+            markObject(vm, (Obj *)shape->transitions[i]);
+        }
+        break;
+    }
+    case OBJ_CLASS:
+    {
+        ObjClass *klass = (ObjClass *)object;
+        markObject(vm, (Obj *)klass->name);
+        markTable(vm, &klass->methods);
+        markObject(vm, (Obj *)klass->shape);
+        break;
+    }
+    case OBJ_INSTANCE:
+    {
+        ObjInstance *instance = (ObjInstance *)object;
+        markObject(vm, (Obj *)instance->shape);
+        for (int i = 0; i < instance->shape->fieldCount; i++)
+        {
+            markValue(vm, instance->fields[i]);
+        }
+        break;
+    }
+    case OBJ_BOUND_METHOD:
+        markValue(vm, ((ObjBoundMethod *)object)->receiver);
+        markObject(vm, (Obj *)((ObjBoundMethod *)object)->method);
+        break;
+    case OBJ_ROPE:
+        markObject(vm, ((ObjRope *)object)->left);
+        markObject(vm, ((ObjRope *)object)->right);
+        markObject(vm, (Obj *)((ObjRope *)object)->flat);
+        break;
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+    case OBJ_CHANNEL:
+    case OBJ_FLOAT_ARRAY:
+        break;
+    }
+}
+
+static void markRoots(VM *vm)
+{
+    for (Value *slot = vm->stack; slot < vm->stackTop; slot++)
+    {
+        markValue(vm, *slot);
+    }
+
+    for (int i = 0; i < vm->frameCount; i++)
+    {
+        markObject(vm, (Obj *)vm->frames[i].closure);
+    }
+
+    for (ObjUpvalue *upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+    {
+        markObject(vm, (Obj *)upvalue);
+    }
+    markObject(vm, (Obj *)vm->fiber);
+
+    markTable(vm, &vm->globals);
+    markObject(vm, (Obj *)vm->initString);
+    for (int i = 0; i < vm->globalCount; i++)
+    {
+        markObject(vm, (Obj *)vm->globalSlots[i].name);
+        markValue(vm, vm->globalSlots[i].value);
+    }
+    markCompilerRoots(vm);
+#ifdef JIT_ENABLED
+    markTraceRoots(vm);
+#endif
+}
+
+static void traceReferences(VM *vm)
+{
+    while (vm->grayCount > 0)
+    {
+        Obj *object = vm->grayStack[--vm->grayCount];
+        blackenObject(vm, object);
+    }
+}
+
+// Walks the object list unlinking and freeing every object that wasn't marked.
+static void sweep(VM *vm)
+{
+    /*
+    A closure that's still alive may have captured a local of a fiber or generator that isn't. Its upvalue takes the
+    value before the slots go, nothing is freed yet so unmarked upvalues can be written to as well.
+    */
+    if (vm->parkedUpvalues)
+    {
+        for (Obj *object = vm->objects; object != NULL; object = object->next)
+        {
+            if (object->isMarked)
+                continue;
+            ObjUpvalue *upvalue = object->type == OBJ_FIBER       ? ((ObjFiber *)object)->openUpvalues
+                                  : object->type == OBJ_GENERATOR ? ((ObjGenerator *)object)->openUpvalues
+                                                                  : NULL;
+            for (; upvalue != NULL; upvalue = upvalue->next)
+            {
+                upvalue->closed = *upvalue->location;
+                upvalue->location = &upvalue->closed;
+            }
+        }
+    }
+
+    Obj *previous = NULL;
+    Obj *object = vm->objects;
+    while (object != NULL)
+    {
+        if (object->isMarked)
+        {
+            object->isMarked = false;
+            previous = object;
+            object = object->next;
+        }
+        else
+        {
+            Obj *unreached = object;
+            object = object->next;
+            if (previous != NULL)
+            {
+                previous->next = object;
+            }
+            else
+            {
+                vm->objects = object;
+            }
+
+            freeObject(vm, unreached);
+        }
+    }
+}
+
+void collectGarbage(VM *vm)
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+    size_t before = vm->bytesAllocated;
+#endif
+
+    markRoots(vm);
+    traceReferences(vm);
+    // The string table holds its keys weakly: drop them before the sweep frees them.
+    tableRemoveWhite(&vm->strings);
+    sweep(vm);
+
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+           before - vm->bytesAllocated, before, vm->bytesAllocated, vm->nextGC);
+#endif
+}
+
+void freeObjects(VM *vm)
+{
+    Obj *object = vm->objects;
     while (object != NULL)
     {
         Obj *next = object->next;
-        freeObject(object);
+        freeObject(vm, object);
         object = next;
     }
+
+    free(vm->grayStack);
+}
+
+void freezeObjects(VM *vm)
+{
+    for (Obj *object = vm->objects; object != NULL; object = object->next)
+    {
+        object->isMarked = true;
+    }
 }
\ No newline at end of file
@@ -2,32 +2,48 @@
 #define clox_memory_h
 
 #include "common.h"
+#include "value.h"
+
+// After a collection the next one is scheduled when the heap reaches this factor of the surviving bytes.
+#define GC_HEAP_GROW_FACTOR 2
 
 // Allocates an array on the heap.
-#define ALLOCATE(type, count) \
-    (type *)reallocate(NULL, 0, sizeof(type) * count)
+#define ALLOCATE(vm, type, count) \
+    (type *)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
 // Resizes a allocation down to zero bytes.
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
 
 // Calcs a new capacity based on given current capacity. It grows in factor of two because it's efficient and typical. 1.5x it's another obtion.
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, pointer, oldCount, newCount)      \
-    (type *)reallocate(pointer, sizeof(type) * (oldCount), \
+#define GROW_ARRAY(vm, type, pointer, oldCount, newCount)      \
+    (type *)reallocate(vm, pointer, sizeof(type) * (oldCount), \
                        sizeof(type) * (newCount))
 
 // This one frees the memory by passing in zero for the new size.
-#define FREE_ARRAY(type, pointer, oldCount) \
-    (type *)reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(vm, type, pointer, oldCount) \
+    (type *)reallocate(vm, pointer, sizeof(type) * (oldCount), 0)
 
 // Used for all dynamic memory management, allocatig memory, freeing it, and changing the size of an existing allocation.
 // 0, Non-zero - Allowcate a new block.
 // Non-zero, 0 - Free Allocation.
 // Non‑zero, Smaller than oldSize - Shrink existing allocation.
 // Non‑zero, Larger than oldSize - Grow existing allocation.
-void *reallocate(void *pointer, size_t oldSize, size_t newSize);
-void freeObjects();
+// Counts against the given VM's heap, which is the one a collection walks.
+void *reallocate(VM *vm, void *pointer, size_t oldSize, size_t newSize);
+// Marks a reachable object gray so the collector traces its references.
+void markObject(VM *vm, Obj *object);
+// Marks the object inside the value, other values don't live in the heap.
+void markValue(VM *vm, Value value);
+// Mark-and-sweep over the whole heap. Called from reallocate() once the heap outgrows vm->nextGC.
+void collectGarbage(VM *vm);
+void freeObjects(VM *vm);
+/*
+Marks every object vm owns for good. Other VMs can then reach them without their collectors ever writing to them,
+vm must not collect garbage again.
+*/
+void freezeObjects(VM *vm);
 
 #endif
\ No newline at end of file
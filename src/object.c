@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "channel.h"
 #include "object.h"
 #include "value.h"
 #include "vm.h"
@@ -9,22 +11,28 @@
 
 
 // Avoids redundantly cast to a void*.
-#define ALLOCATE_OBJ(type, objectType) \
-    (type *)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type *)allocateObject(vm, sizeof(type), objectType)
 
 // Allocates an object of the given size on the heap. Also you could need pass an extra size for payload fieds needed by specific objects.
-static Obj *allocateObject(size_t size, ObjType type)
+static Obj *allocateObject(VM *vm, size_t size, ObjType type)
 {
-    Obj *object = (Obj *)reallocate(NULL, 0, size);
+    Obj *object = (Obj *)reallocate(vm, NULL, 0, size);
     object->type = type;
-    object->next = vm.objects;
-    vm.objects = object;
+    object->isMarked = false;
+    object->next = vm->objects;
+    vm->objects = object;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p allocate %zu for %d\n", (void *)object, size, type);
+#endif
+
     return object;
 }
 
-ObjClosure* newClosure(ObjFunction* function) {
+ObjClosure* newClosure(VM *vm, ObjFunction* function) {
 
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+    ObjUpvalue** upvalues = ALLOCATE(vm, ObjUpvalue*, function->upvalueCount);
 
     for (int i = 0; i < function->upvalueCount; i++)
     {
@@ -32,101 +40,343 @@ ObjClosure* newClosure(ObjFunction* function) {
     }
     
 
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    ObjClosure* closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
     closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
     return closure;
 }
 
-ObjFunction* newFunction() {
-    ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+ObjFunction* newFunction(VM *vm) {
+    ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxStackDepth = 0;
+    function->hotness = 0;
+    function->jit = NULL;
+    function->traces = NULL;
     function->name = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
-ObjNative* newNative(NativeFn function) {
-    ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+ObjNative* newNative(VM *vm, NativeFn function) {
+    ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
     native->function = function;
     return native;
 }
 
-/*
-It allocates an object of the given size on the heap. Note that the size is not just the size of Obj itself. The caller passes in the number of bytes so that there is room for the extra payload fields needed by the specific object type being created.
+ObjChannel *newChannel(VM *vm, Channel *channel)
+{
+    ObjChannel *object = ALLOCATE_OBJ(vm, ObjChannel, OBJ_CHANNEL);
+    object->channel = channel;
+    return object;
+}
 
-Then it initializes the Obj state—right now, that’s just the type tag. This function returns to allocateString(), which finishes initializing the ObjString fields. Voilà, we can compile and execute string literals.
-*/
-static ObjString *allocateString(char *chars, int length, bool ownsChars, uint32_t hash)
+ObjFiber *newFiber(VM *vm, ObjClosure *closure)
 {
-    // Step 1: Allocate memory for an ObjString object. 
-    // The ALLOCATE_OBJ macro handles memory allocation for the object, ensuring it gets the right size.
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    // The buffers come first, the fiber isn't reachable while they're allocated.
+    Value *stack = NULL;
+    CallFrame *frames = NULL;
+    if (closure != NULL)
+    {
+        stack = ALLOCATE(vm, Value, FIBER_STACK_INITIAL);
+        frames = ALLOCATE(vm, CallFrame, FIBER_FRAMES_INITIAL);
+    }
 
-    // Step 2: Initialize the fields of the ObjString.
-    string->ownsChars = ownsChars; // Whether this object owns the character array.
-    string->chars = chars;
-    string->length = length; // Length of the string.
-    string->hash = hash; // Precomputed hash for the string (used for fast lookup).
+    ObjFiber *fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+    fiber->state = closure != NULL ? FIBER_NEW : FIBER_RUNNING;
+    fiber->caller = NULL;
+    fiber->stack = stack;
+    fiber->stackTop = stack;
+    fiber->stackCapacity = closure != NULL ? FIBER_STACK_INITIAL : 0;
+    fiber->frames = frames;
+    fiber->frameCount = 0;
+    fiber->frameCapacity = closure != NULL ? FIBER_FRAMES_INITIAL : 0;
+    fiber->openUpvalues = NULL;
+    if (closure != NULL)
+        *fiber->stackTop++ = OBJ_VAL(closure); // The callee slot of its first frame.
+    return fiber;
+}
 
-    
-    // Step 3: Set the string in the global string table (for tracking or interning strings).
-    Value key = OBJ_VAL(string); // The key is the string object itself.
-    Value value = NIL_VAL; // No associated value for the string (just tracking it).
-    tableSet(&vm.strings, key, value); // Add the string object to the string table.
-    
-    // Step 4: Return the allocated and initialized ObjString.
-    return string;
+ObjGenerator *newGenerator(VM *vm, ObjClosure *closure)
+{
+    ObjGenerator *generator = ALLOCATE_OBJ(vm, ObjGenerator, OBJ_GENERATOR);
+    generator->state = FIBER_SUSPENDED;
+    generator->closure = closure;
+    generator->ip = NULL;
+    generator->slots = NULL;
+    generator->slotCount = 0;
+    generator->slotCapacity = 0;
+    generator->openUpvalues = NULL;
+    return generator;
+}
+
+ObjList *newList(VM *vm, Value *items, int count)
+{
+    // The array comes first, the list isn't reachable while it's allocated.
+    Value *values = count > 0 ? ALLOCATE(vm, Value, count) : NULL;
+    if (count > 0)
+        memcpy(values, items, sizeof(Value) * count);
+
+    ObjList *list = ALLOCATE_OBJ(vm, ObjList, OBJ_LIST);
+    list->items.values = values;
+    list->items.count = count;
+    list->items.capacity = count;
+    return list;
+}
+
+ObjFloatArray *newFloatArray(VM *vm, int count)
+{
+    double *values = count > 0 ? ALLOCATE(vm, double, count) : NULL;
+    if (count > 0)
+        memset(values, 0, sizeof(double) * count);
+
+    ObjFloatArray *array = ALLOCATE_OBJ(vm, ObjFloatArray, OBJ_FLOAT_ARRAY);
+    array->count = count;
+    array->values = values;
+    return array;
+}
+
+ObjMap *newMap(VM *vm)
+{
+    ObjMap *map = ALLOCATE_OBJ(vm, ObjMap, OBJ_MAP);
+    initTable(&map->table, TABLE_ANY);
+    map->size = 0;
+    return map;
+}
+
+static ObjShape *newShape(VM *vm, ObjClass *klass, ObjShape *parent, ObjString *name)
+{
+    ObjShape *shape = ALLOCATE_OBJ(vm, ObjShape, OBJ_SHAPE);
+    shape->klass = klass;
+    shape->parent = parent;
+    shape->name = name;
+    shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+    shape->transitions = NULL;
+    shape->transitionCount = 0;
+    shape->transitionCapacity = 0;
+    return shape;
+}
+
+ObjClass *newClass(VM *vm, ObjString *name)
+{
+    ObjClass *klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
+    klass->name = name;
+    initTable(&klass->methods, TABLE_STRINGS);
+    klass->shape = NULL;
+    klass->fieldHint = 0;
+
+    push(vm, OBJ_VAL(klass));
+    klass->shape = newShape(vm, klass, NULL, NULL);
+    pop(vm);
+    return klass;
+}
+
+ObjInstance *newInstance(VM *vm, ObjClass *klass)
+{
+    int inlineCapacity = klass->fieldHint < INSTANCE_MAX_INLINE_FIELDS ? klass->fieldHint : INSTANCE_MAX_INLINE_FIELDS;
+    ObjInstance *instance = (ObjInstance *)allocateObject(vm, sizeof(ObjInstance) + sizeof(Value) * inlineCapacity,
+                                                          OBJ_INSTANCE);
+    instance->shape = klass->shape;
+    instance->fields = instance->inlineFields;
+    instance->fieldCapacity = inlineCapacity;
+    instance->inlineCapacity = inlineCapacity;
+    return instance;
+}
+
+ObjBoundMethod *newBoundMethod(VM *vm, Value receiver, ObjClosure *method)
+{
+    ObjBoundMethod *bound = ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
+    bound->receiver = receiver;
+    bound->method = method;
+    return bound;
 }
 
-// FNV-1a
-static uint32_t hashString(const char *key, int length)
+int shapeSlot(ObjShape *shape, ObjString *name)
 {
-    uint32_t hash = 216613621u;
-    for (int i = 0; i < length; i++)
+    // Names are interned, the pointers say whether they're the same.
+    for (; shape->parent != NULL; shape = shape->parent)
     {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+        if (shape->name == name)
+            return shape->fieldCount - 1;
     }
-    return hash;
+    return -1;
+}
+
+ObjShape *shapeAddField(VM *vm, ObjShape *shape, ObjString *name)
+{
+    for (int i = 0; i < shape->transitionCount; i++)
+    {
+        if (shape->transitions[i]->name == name)
+            return shape->transitions[i];
+    }
+
+    ObjShape *child = newShape(vm, shape->klass, shape, name);
+    // Nothing points at the child until it's in the array, which may collect while it grows.
+    push(vm, OBJ_VAL(child));
+    if (shape->transitionCount == shape->transitionCapacity)
+    {
+        int oldCapacity = shape->transitionCapacity;
+        shape->transitionCapacity = oldCapacity < 4 ? 4 : oldCapacity * 2;
+        shape->transitions = GROW_ARRAY(vm, ObjShape *, shape->transitions, oldCapacity, shape->transitionCapacity);
+    }
+    shape->transitions[shape->transitionCount++] = child;
+    pop(vm);
+    return child;
+}
+
+/*
+It allocates an object of the given size on the heap. Note that the size is not just the size of Obj itself. The caller passes in the number of bytes so that there is room for the extra payload fields needed by the specific object type being created.
+
+Then it initializes the Obj state—right now, that’s just the type tag. This function returns to newString(), which finishes initializing the ObjString fields. Voilà, we can compile and execute string literals.
+*/
+ObjString *newString(VM *vm, int length)
+{
+    // The characters go in the same allocation, right after the header, with room for the '\0'.
+    ObjString *string = (ObjString *)allocateObject(vm, sizeof(ObjString) + length + 1, OBJ_STRING);
+    string->hashed = false;
+    string->chars[length] = '\0';
+    string->length = length;
+    return string;
 }
 
-Value copyString(const char *chars, int length) {
+Value copyString(VM *vm, const char *chars, int length) {
     // Calculate the hash value of the string to facilitate lookup
-    uint32_t hash = hashString(chars, length);
+    uint32_t hash = hashBytes(chars, length);
 
     // Look up if the string is already interned in the string table
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
     
     // If the string is already interned, return the pointer to the existing object
     if (interned != NULL) return OBJ_VAL(interned); 
 
-    // If not found, allocate memory for a new string on the heap
-    char *heapChars = ALLOCATE(char, length + 1);
-    
-    // Copy the contents of the original string into the new memory location
-    memcpy(heapChars, chars, length);
-    
-    // Ensure the new string is properly null-terminated ('\0')
-    heapChars[length] = '\0';
+    // If not found, create a new ObjString object holding a copy of the characters
+    ObjString *str = newString(vm, length);
+    memcpy(str->chars, chars, length);
+    str->hash = hash; // Precomputed hash for the string (used for fast lookup).
+    str->hashed = true;
 
-    // Create a new ObjString object with the copied string and associated information
-    ObjString *str = allocateString(heapChars, length, true, hash);
+    // Set the string in the global string table. It's pushed while the table may grow, so a collection can't free it.
+    push(vm, OBJ_VAL(str));
+    tableSet(vm, &vm->strings, OBJ_VAL(str), NIL_VAL);
+    pop(vm);
     
     // Return the newly interned string object
     return OBJ_VAL(str);
 }
 
-ObjUpvalue* newUpvalue(Value* slot) {
-    ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+ObjUpvalue* newUpvalue(VM *vm, Value* slot) {
+    ObjUpvalue* upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
     upvalue->next = NULL;
     upvalue->location = slot;
     upvalue->closed = NIL_VAL;
     return upvalue;
   }
 
+static int textLength(Obj *text)
+{
+    return text->type == OBJ_ROPE ? ((ObjRope *)text)->length : ((ObjString *)text)->length;
+}
+
+static int ropeDepth(Obj *text)
+{
+    return text->type == OBJ_ROPE ? ((ObjRope *)text)->depth : 0;
+}
+
+// A rope flattened since it was made is as good as its string, and doesn't add a level.
+static Obj *ropePiece(Obj *text)
+{
+    if (text->type == OBJ_ROPE && ((ObjRope *)text)->flat != NULL)
+        return (Obj *)((ObjRope *)text)->flat;
+    return text;
+}
+
+ObjRope *newRope(VM *vm, Obj *left, Obj *right)
+{
+    left = ropePiece(left);
+    right = ropePiece(right);
+    ObjRope *rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+    rope->length = textLength(left) + textLength(right);
+    int depth = ropeDepth(left) > ropeDepth(right) ? ropeDepth(left) : ropeDepth(right);
+    rope->depth = depth + 1;
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    return rope;
+}
+
+typedef void (*RopeVisitor)(ObjString *piece, void *context);
+
+/*
+Hands the rope's strings to visit() from left to right. Ropes built in a loop are as deep as they have pieces, so the
+walk keeps the right halves still to visit in `stack`, which has room for rope->depth + 1 of them, not on the C stack.
+*/
+static void walkRope(ObjRope *rope, Obj **stack, RopeVisitor visit, void *context)
+{
+    int count = 0;
+    stack[count++] = (Obj *)rope;
+    while (count > 0)
+    {
+        Obj *text = ropePiece(stack[--count]);
+        if (text->type == OBJ_STRING)
+        {
+            visit((ObjString *)text, context);
+            continue;
+        }
+        stack[count++] = ((ObjRope *)text)->right;
+        stack[count++] = ((ObjRope *)text)->left;
+    }
+}
+
+static void copyPiece(ObjString *piece, void *context)
+{
+    char **dest = (char **)context;
+    memcpy(*dest, piece->chars, piece->length);
+    *dest += piece->length;
+}
+
+static void printPiece(ObjString *piece, void *context)
+{
+    fwrite(piece->chars, 1, piece->length, stdout);
+}
+
+ObjString *flattenRope(VM *vm, ObjRope *rope)
+{
+    if (rope->flat != NULL)
+        return rope->flat;
+
+    // A collection meanwhile finds the pieces through the rope. The pieces go straight into the string, which isn't
+    // interned, so nothing is looked up or hashed.
+    Obj **stack = ALLOCATE(vm, Obj *, rope->depth + 1);
+    ObjString *string = newString(vm, rope->length);
+    char *dest = string->chars;
+    walkRope(rope, stack, copyPiece, &dest);
+    FREE_ARRAY(vm, Obj *, stack, rope->depth + 1);
+
+    rope->flat = string;
+    rope->left = NULL;
+    rope->right = NULL;
+    return rope->flat;
+}
+
+// Printing doesn't need the rope flat, the pieces are written one after another.
+static void printRope(ObjRope *rope)
+{
+    if (rope->flat != NULL)
+    {
+        printf("\"%s\"", rope->flat->chars);
+        return;
+    }
+    Obj **stack = malloc(sizeof(Obj *) * (rope->depth + 1));
+    if (stack == NULL)
+        exit(1);
+    printf("\"");
+    walkRope(rope, stack, printPiece, NULL);
+    printf("\"");
+    free(stack);
+}
+
 static void printFunction(ObjFunction* function) {
     if(function->name == NULL) {
         printf("<script>");
@@ -135,6 +385,71 @@ static void printFunction(ObjFunction* function) {
     printf("<fn %s>", function->name->chars);
 }
 
+// Lists and maps nested deeper than this, which one that contains itself always gets to, print as [...] or {...}.
+#define PRINT_MAX_NESTING 16
+
+static void printNested(Value value, int nesting);
+
+static void printList(ObjList *list, int nesting)
+{
+    if (nesting >= PRINT_MAX_NESTING)
+    {
+        printf("[...]");
+        return;
+    }
+    printf("[");
+    for (int i = 0; i < list->items.count; i++)
+    {
+        if (i > 0)
+            printf(", ");
+        printNested(list->items.values[i], nesting + 1);
+    }
+    printf("]");
+}
+
+static void printMap(ObjMap *map, int nesting)
+{
+    if (nesting >= PRINT_MAX_NESTING)
+    {
+        printf("{...}");
+        return;
+    }
+    printf("{");
+    bool first = true;
+    for (int i = 0; i < map->table.capacity; i++)
+    {
+        Entry *entry = &map->table.entries[i];
+        if (IS_NIL(entry->key))
+            continue;
+        printf(first ? "" : ", ");
+        first = false;
+        printNested(entry->key, nesting + 1);
+        printf(": ");
+        printNested(entry->value, nesting + 1);
+    }
+    printf("}");
+}
+
+static void printNested(Value value, int nesting)
+{
+    if (IS_LIST(value))
+        printList(AS_LIST(value), nesting);
+    else if (IS_MAP(value))
+        printMap(AS_MAP(value), nesting);
+    else
+        printValue(value);
+}
+
+static void printFloatArray(ObjFloatArray *array)
+{
+    printf("floats[");
+    for (int i = 0; i < array->count; i++)
+    {
+        printf(i > 0 ? ", %g" : "%g", array->values[i]);
+    }
+    printf("]");
+}
+
 void printObject(Value value)
 {
     switch (OBJ_TYPE(value))
@@ -155,6 +470,39 @@ void printObject(Value value)
     case OBJ_UPVALUE:
         printf("upvalue");
         break;
+    case OBJ_FIBER:
+        printf("<fiber>");
+        break;
+    case OBJ_GENERATOR:
+        printf("<generator %s>", AS_GENERATOR(value)->closure->function->name->chars);
+        break;
+    case OBJ_LIST:
+        printList(AS_LIST(value), 0);
+        break;
+    case OBJ_MAP:
+        printMap(AS_MAP(value), 0);
+        break;
+    case OBJ_FLOAT_ARRAY:
+        printFloatArray(AS_FLOAT_ARRAY(value));
+        break;
+    case OBJ_CHANNEL:
+        printf("<channel %.*s>", AS_CHANNEL(value)->nameLength, AS_CHANNEL(value)->name);
+        break;
+    case OBJ_CLASS:
+        printf("%s", AS_CLASS(value)->name->chars);
+        break;
+    case OBJ_INSTANCE:
+        printf("<%s instance>", AS_INSTANCE(value)->shape->klass->name->chars);
+        break;
+    case OBJ_BOUND_METHOD:
+        printFunction(AS_BOUND_METHOD(value)->method->function);
+        break;
+    case OBJ_SHAPE:
+        printf("<shape>");
+        break;
+    case OBJ_ROPE:
+        printRope(AS_ROPE(value));
+        break;
 
     default:
         printf("Unknown object type: %d", OBJ_TYPE(value));
@@ -163,22 +511,9 @@ void printObject(Value value)
 }
 
 
-ObjString *constString(const char *chars, int length)
-{
-    ObjString *str = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    str->length = length;
-    str->ownsChars = false;
-    str->chars = (char *)chars;
-    return str;
-}
-
-// Takes ownerships
-ObjString *takeString(char *chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
-    }
-    return allocateString(chars, length, true, hash);
+// Takes ownership of the buffer. Strings keep their characters inline, so they're copied once more and it's freed.
+ObjString *takeString(VM *vm, char *chars, int length) {
+    ObjString *string = AS_STRING(copyString(vm, chars, length));
+    FREE_ARRAY(vm, char, chars, length + 1);
+    return string;
 }
@@ -4,18 +4,41 @@
 #include "common.h"
 #include "value.h"
 #include "chunk.h"
+#include "table.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+#define IS_CHANNEL(value) isObjType(value, OBJ_CHANNEL)
+#define IS_FIBER(value) isObjType(value, OBJ_FIBER)
+#define IS_GENERATOR(value) isObjType(value, OBJ_GENERATOR)
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
+#define IS_FLOAT_ARRAY(value) isObjType(value, OBJ_FLOAT_ARRAY)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
+#define IS_CLASS(value) isObjType(value, OBJ_CLASS)
+#define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+// A string or a rope, either kind of value `+` concatenates.
+#define IS_TEXT(value) (IS_STRING(value) || IS_ROPE(value))
 
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (AS_STRING(value)->chars)
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
+#define AS_CHANNEL(value) (((ObjChannel *)AS_OBJ(value))->channel)
+#define AS_FIBER(value) ((ObjFiber *)AS_OBJ(value))
+#define AS_GENERATOR(value) ((ObjGenerator *)AS_OBJ(value))
+#define AS_LIST(value) ((ObjList *)AS_OBJ(value))
+#define AS_FLOAT_ARRAY(value) ((ObjFloatArray *)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap *)AS_OBJ(value))
+#define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
+#define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
 
 typedef enum
 {
@@ -23,24 +46,58 @@ typedef enum
     OBJ_FUNCTION,
     OBJ_NATIVE,
     OBJ_STRING,
-    OBJ_UPVALUE
+    OBJ_UPVALUE,
+    OBJ_CHANNEL,
+    OBJ_FIBER,
+    OBJ_GENERATOR,
+    OBJ_LIST,
+    OBJ_FLOAT_ARRAY,
+    OBJ_MAP,
+    OBJ_SHAPE,
+    OBJ_CLASS,
+    OBJ_INSTANCE,
+    OBJ_BOUND_METHOD,
+    OBJ_ROPE
 } ObjType;
 
 struct Obj
 {
     ObjType type;
+    bool isMarked; // Set while tracing, cleared by the sweep.
     struct Obj *next;
 };
 
+/*
+A string and its characters are one allocation, chars is right after the header. Reading them takes no pointer load
+and stays on the same cache lines. Interned strings are hashed as they're made, the ones newString() builds at runtime the first time a table asks.
+*/
 struct ObjString
 {
     Obj obj;
     int length;
-    bool ownsChars;
+    bool hashed;    // Whether hash is set yet, read it through stringHash().
     uint32_t hash;
-    char *chars;
+    char chars[]; // length characters and a '\0'.
 };
 
+// Concatenations this long or longer make a rope, shorter ones a flat string right away.
+#define ROPE_MIN_LENGTH 64
+
+/*
+The result of concatenating long strings, before anything needed its characters. Building a string piece by piece
+then costs a node per piece instead of copying and hashing everything so far each time. The rope is flattened into
+a string the first time its characters, its hash or an equality test need it, the pieces are dropped then.
+*/
+typedef struct
+{
+    Obj obj;
+    int length;
+    int depth;       // Nodes on the longest path down to a string, bounds the stack walking it takes.
+    Obj *left;       // An ObjString or an ObjRope, NULL once flattened.
+    Obj *right;
+    ObjString *flat; // The string with the same characters, NULL until something needed it.
+} ObjRope;
+
 typedef struct ObjUpvalue {
     Obj obj;
     Value* location;
@@ -49,15 +106,22 @@ typedef struct ObjUpvalue {
 } ObjUpvalue;  
 
 
+typedef struct JitCode JitCode;
+typedef struct Trace Trace;
+
 typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
+    int maxStackDepth; // Most stack slots a call uses, the callee slot and arguments included.
+    int hotness;       // Calls and loop back-edges so far, the JIT translates the function past JIT_THRESHOLD.
+    JitCode *jit;      // Machine code for the chunk, NULL while it's only interpreted.
+    Trace *traces;     // Traces of its hot loops, and loops that failed to record too often.
     Chunk chunk;
     ObjString* name;
 } ObjFunction;
 
-typedef struct
+typedef struct ObjClosure
 {
     Obj obj;
     ObjFunction* function;
@@ -67,23 +131,184 @@ typedef struct
 
 
 
-typedef Value(*NativeFn)(int argCount, Value* args);
+typedef Value(*NativeFn)(VM *vm, int argCount, Value* args);
 typedef struct {
     Obj obj;
     NativeFn function;
 } ObjNative;
 
-ObjClosure* newClosure(ObjFunction* function);
-ObjFunction* newFunction();
-ObjNative* newNative(NativeFn function);
-ObjString* takeString(char *chars, int length);
+typedef struct Channel Channel;
 
-Value copyString(const char *chars, int length);
-ObjUpvalue* newUpvalue(Value* slot);
-ObjString *constString(const char *chars, int length);
+// A VM's handle on a channel, the channel itself is shared and outlives it, see channel.h.
+typedef struct
+{
+    Obj obj;
+    Channel *channel;
+} ObjChannel;
+
+// Room a new fiber starts with, both grow on demand like the VM's.
+#define FIBER_STACK_INITIAL 32
+#define FIBER_FRAMES_INITIAL 4
+
+typedef enum
+{
+    FIBER_NEW,       // Created, resume() calls its function.
+    FIBER_RUNNING,   // Running, or waiting for a fiber it resumed.
+    FIBER_SUSPENDED, // Called suspend(), resume() picks up where it left.
+    FIBER_DONE       // Its function returned.
+} FiberState; // Generators go through the same states, save FIBER_NEW.
+
+typedef struct CallFrame CallFrame;
+
+/*
+A coroutine with its own stack, frames and open upvalues. Switching fibers swaps these with the VM's, nothing is
+copied. The running fiber's fields are empty, the VM holds its state while it runs.
+*/
+typedef struct ObjFiber
+{
+    Obj obj;
+    FiberState state;
+    struct ObjFiber *caller; // The fiber that resumed this one, it gets control back at suspend() or the return.
+    Value *stack;
+    Value *stackTop;
+    int stackCapacity;
+    CallFrame *frames;
+    int frameCount;
+    int frameCapacity;
+    ObjUpvalue *openUpvalues;
+} ObjFiber;
+
+/*
+The frame of a generator function between calls. Only the frame is suspended, so its locals and temporaries are
+copied out at a yield and back onto the stack when it's called again, above the generator in the callee slot.
+*/
+typedef struct
+{
+    Obj obj;
+    FiberState state;
+    ObjClosure *closure;
+    uint8_t *ip;
+    Value *slots; // The frame's slots after the callee slot.
+    int slotCount;
+    int slotCapacity;
+    ObjUpvalue *openUpvalues; // Captured locals, pointing into `slots` while the generator is suspended.
+} ObjGenerator;
+
+// The items sit in one contiguous array that grows like any other ValueArray.
+typedef struct
+{
+    Obj obj;
+    ValueArray items;
+} ObjList;
+
+// Fixed number of doubles stored unboxed, side by side, for the bulk natives in simd.h.
+typedef struct
+{
+    Obj obj;
+    int count;
+    double *values;
+} ObjFloatArray;
+
+// A Table scripts can use, keyed by any value but nil.
+typedef struct
+{
+    Obj obj;
+    Table table;
+    int size; // Keys in it, the table's count includes tombstones.
+} ObjMap;
+
+typedef struct ObjClass ObjClass;
+
+/*
+Hidden class: which fields an instance has and the slot each one is in. Instances that got the same fields in the
+same order share a shape, so a property access that saw a shape once knows the slot for every instance of it.
+The shapes of a class form a tree, each one adds a field to its parent and the root has none.
+*/
+typedef struct ObjShape
+{
+    Obj obj;
+    ObjClass *klass;
+    struct ObjShape *parent; // NULL for the class's root shape.
+    ObjString *name;         // The field this shape adds, in slot fieldCount - 1.
+    int fieldCount;
+    struct ObjShape **transitions; // Shapes that add one more field to this one.
+    int transitionCount;
+    int transitionCapacity;
+} ObjShape;
+
+// Fields an instance keeps inside its own allocation at most, more go in a separate array.
+#define INSTANCE_MAX_INLINE_FIELDS 16
+
+struct ObjClass
+{
+    Obj obj;
+    ObjString *name;
+    Table methods; // Name -> closure, inherited ones are copied in.
+    ObjShape *shape; // Root shape, new instances have no fields.
+    int fieldHint;   // Most fields an instance has had, later ones are made with room for that many inline.
+};
+
+typedef struct
+{
+    Obj obj;
+    ObjShape *shape;
+    Value *fields;     // The first shape->fieldCount are set. Points at inlineFields until they run out.
+    int fieldCapacity;
+    int inlineCapacity;
+    Value inlineFields[];
+} ObjInstance;
+
+typedef struct
+{
+    Obj obj;
+    Value receiver;
+    ObjClosure *method;
+} ObjBoundMethod;
+
+ObjClosure* newClosure(VM *vm, ObjFunction* function);
+ObjFunction* newFunction(VM *vm);
+ObjNative* newNative(VM *vm, NativeFn function);
+// The interned string with the characters of the heap buffer, which is freed.
+ObjString* takeString(VM *vm, char *chars, int length);
+
+Value copyString(VM *vm, const char *chars, int length);
+// A string of `length` characters for the caller to fill in, not interned. Equal strings may be separate objects.
+ObjString *newString(VM *vm, int length);
+// The concatenation of two strings or ropes, which must stay reachable while it's allocated.
+ObjRope *newRope(VM *vm, Obj *left, Obj *right);
+// The string with the rope's characters, built once. The rope must stay reachable meanwhile.
+ObjString *flattenRope(VM *vm, ObjRope *rope);
+ObjUpvalue* newUpvalue(VM *vm, Value* slot);
+ObjChannel *newChannel(VM *vm, Channel *channel);
+// A fiber that will run the closure, or with a NULL closure the one for code already running on the VM's stack.
+ObjFiber *newFiber(VM *vm, ObjClosure *closure);
+ObjGenerator *newGenerator(VM *vm, ObjClosure *closure);
+// A list holding a copy of the `count` values at `items`, which must stay reachable while it's allocated.
+ObjList *newList(VM *vm, Value *items, int count);
+// An array of `count` zeros.
+ObjFloatArray *newFloatArray(VM *vm, int count);
+ObjMap *newMap(VM *vm);
+ObjClass *newClass(VM *vm, ObjString *name);
+ObjInstance *newInstance(VM *vm, ObjClass *klass);
+ObjBoundMethod *newBoundMethod(VM *vm, Value receiver, ObjClosure *method);
+// The slot of the field in the shape, or -1.
+int shapeSlot(ObjShape *shape, ObjString *name);
+// The shape an instance of `shape` gets once the field is added, the same one every time.
+ObjShape *shapeAddField(VM *vm, ObjShape *shape, ObjString *name);
 
 void printObject(Value value);
 
+// Hashes the characters the first time, strings that weren't interned may never need it.
+static inline uint32_t stringHash(ObjString *string)
+{
+    if (!string->hashed)
+    {
+        string->hash = hashBytes(string->chars, string->length);
+        string->hashed = true;
+    }
+    return string->hash;
+}
+
 static inline bool isObjType(Value value, ObjType type)
 {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
@@ -0,0 +1,430 @@
+#include <stdlib.h>
+
+#include "optimizer.h"
+#include "memory.h"
+#include "object.h"
+
+// A jump whose operand still has to be rewritten once every instruction has its new offset.
+typedef struct
+{
+    int operand; // Offset of the two operand bytes in the optimized code.
+    int target;  // Offset the jump landed on in the original code.
+    bool isLoop; // Loops jump backwards.
+} PendingJump;
+
+typedef struct
+{
+    VM *vm;
+    Chunk *chunk;       // Original chunk, it's read only until the end of the pass.
+    Chunk out;          // Optimized code and its line table.
+    int *jumpsTo;       // Number of jumps that land on each original offset.
+    int *poppedJumps;   // How many of those were fused into a jump that already pops the condition.
+    int *newOffset;     // Original offset -> optimized offset, -1 for removed instructions.
+    PendingJump *jumps;
+    int jumpCount;
+    int jumpCapacity;
+} Optimizer;
+
+int instructionLength(Chunk *chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_BUILD_LIST:
+    case OP_BUILD_MAP:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CONSTANT:
+        return 2;
+
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_LOOP_TRACE:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_GREATER_JUMP_IF_FALSE:
+    case OP_EQUAL_JUMP_IF_FALSE:
+    case OP_GET_LOCAL_GET_LOCAL_ADD:
+    case OP_SUPER_INVOKE:
+        return 3;
+
+    case OP_CONSTANT_LONG:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+        return 4;
+
+    case OP_INVOKE:
+        return 5;
+
+    case OP_GET_KEY:
+    case OP_SET_KEY:
+        return 6;
+
+    case OP_CLOSURE:
+    {
+        // Each captured variable adds an isLocal byte and an index byte.
+        ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+        return 2 + function->upvalueCount * 2;
+    }
+
+    default:
+        return 1;
+    }
+}
+
+int jumpTarget(Chunk *chunk, int offset)
+{
+    int sign;
+    switch (chunk->code[offset])
+    {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_GREATER_JUMP_IF_FALSE:
+    case OP_EQUAL_JUMP_IF_FALSE:
+        sign = 1;
+        break;
+    case OP_LOOP:
+    case OP_LOOP_TRACE:
+        sign = -1;
+        break;
+    default:
+        return -1;
+    }
+
+    uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    return offset + 3 + sign * jump;
+}
+
+// How many values the instruction at offset leaves on the stack compared to before it.
+static int stackEffect(Chunk *chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_CLOSURE:
+    case OP_GET_LOCAL_GET_LOCAL_ADD:
+    case OP_CLASS:
+        return 1;
+
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_YIELD:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_EQUAL_NUM:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_INDEX_GET:
+    case OP_SET_KEY:
+    case OP_SET_PROPERTY:
+    case OP_METHOD:
+    case OP_INHERIT:
+    case OP_GET_SUPER:
+        return -1;
+
+    case OP_INDEX_SET:
+    case OP_LESS_JUMP_IF_FALSE:
+    case OP_GREATER_JUMP_IF_FALSE:
+    case OP_EQUAL_JUMP_IF_FALSE:
+        return -2;
+
+    // The callee and its arguments are replaced by the result.
+    case OP_CALL:
+    case OP_TAIL_CALL:
+        return -chunk->code[offset + 1];
+    case OP_INVOKE:
+        return -chunk->code[offset + 2];
+    case OP_SUPER_INVOKE: // The superclass goes too.
+        return -chunk->code[offset + 2] - 1;
+    case OP_BUILD_LIST:
+        return 1 - chunk->code[offset + 1];
+    case OP_BUILD_MAP:
+        return 1 - 2 * chunk->code[offset + 1];
+
+    default:
+        return 0;
+    }
+}
+
+int maxStackDepth(VM *vm, Chunk *chunk, int initialDepth)
+{
+    if (chunk->count == 0)
+        return initialDepth;
+
+    // Every path into an instruction reaches it with the same depth, so each offset is visited once.
+    int *depths = ALLOCATE(vm, int, chunk->count);
+    int *worklist = ALLOCATE(vm, int, chunk->count);
+    for (int i = 0; i < chunk->count; i++)
+    {
+        depths[i] = -1;
+    }
+
+    int max = initialDepth;
+    int pending = 0;
+    depths[0] = initialDepth;
+    worklist[pending++] = 0;
+    while (pending > 0)
+    {
+        int offset = worklist[--pending];
+        uint8_t instruction = chunk->code[offset];
+        int depth = depths[offset] + stackEffect(chunk, offset);
+
+        // The fused add pushes both operands before adding when they aren't numbers.
+        int peak = instruction == OP_GET_LOCAL_GET_LOCAL_ADD ? depth + 1 : depth;
+        if (peak > max)
+            max = peak;
+
+        int successors[2];
+        int successorCount = 0;
+        if (instruction != OP_RETURN && instruction != OP_GENERATOR_RETURN && instruction != OP_JUMP &&
+            instruction != OP_LOOP)
+            successors[successorCount++] = offset + instructionLength(chunk, offset);
+        int target = jumpTarget(chunk, offset);
+        if (target != -1)
+            successors[successorCount++] = target;
+
+        for (int i = 0; i < successorCount; i++)
+        {
+            int next = successors[i];
+            if (next < chunk->count && depths[next] == -1)
+            {
+                depths[next] = depth;
+                worklist[pending++] = next;
+            }
+        }
+    }
+
+    FREE_ARRAY(vm, int, worklist, chunk->count);
+    FREE_ARRAY(vm, int, depths, chunk->count);
+    return max;
+}
+
+// True if nothing jumps to the offset, so the instruction there can be folded into the one before it.
+static bool isPlain(Optimizer *opt, int offset, uint8_t instruction)
+{
+    return offset < opt->chunk->count &&
+           opt->chunk->code[offset] == instruction &&
+           opt->jumpsTo[offset] == 0;
+}
+
+/*
+Matches `OP_JUMP_IF_FALSE target; OP_POP` where target is an OP_POP too.
+Both paths pop the condition, so the jump can pop it itself and land just past the pop at target.
+*/
+static bool isPoppingJump(Optimizer *opt, int offset)
+{
+    if (!isPlain(opt, offset, OP_JUMP_IF_FALSE) || !isPlain(opt, offset + 3, OP_POP))
+        return false;
+
+    int target = jumpTarget(opt->chunk, offset);
+    return target < opt->chunk->count && opt->chunk->code[target] == OP_POP;
+}
+
+static void emit(Optimizer *opt, uint8_t byte, int line)
+{
+    writeChunk(opt->vm, &opt->out, byte, line);
+}
+
+// Emits a jump instruction, its operand is filled in by patchJumps().
+static void emitJump(Optimizer *opt, uint8_t instruction, int target, int line)
+{
+    emit(opt, instruction, line);
+    if (opt->jumpCapacity < opt->jumpCount + 1)
+    {
+        int oldCapacity = opt->jumpCapacity;
+        opt->jumpCapacity = GROW_CAPACITY(oldCapacity);
+        opt->jumps = GROW_ARRAY(opt->vm, PendingJump, opt->jumps, oldCapacity, opt->jumpCapacity);
+    }
+    PendingJump *jump = &opt->jumps[opt->jumpCount++];
+    jump->operand = opt->out.count;
+    jump->target = target;
+    jump->isLoop = instruction == OP_LOOP;
+    emit(opt, 0xff, line);
+    emit(opt, 0xff, line);
+}
+
+// Emits a jump fused with the `OP_JUMP_IF_FALSE; OP_POP` at offset, see isPoppingJump().
+static void emitPoppingJump(Optimizer *opt, uint8_t instruction, int offset, int line)
+{
+    int target = jumpTarget(opt->chunk, offset);
+    opt->poppedJumps[target]++;
+    emitJump(opt, instruction, target + 1, line);
+}
+
+static void patchJumps(Optimizer *opt)
+{
+    for (int i = 0; i < opt->jumpCount; i++)
+    {
+        PendingJump *jump = &opt->jumps[i];
+        int end = jump->operand + 2;
+        int target = opt->newOffset[jump->target];
+        int distance = jump->isLoop ? end - target : target - end;
+        opt->out.code[jump->operand] = (distance >> 8) & 0xff;
+        opt->out.code[jump->operand + 1] = distance & 0xff;
+    }
+}
+
+void optimizeChunk(VM *vm, Chunk *chunk)
+{
+    int count = chunk->count;
+    Optimizer opt;
+    opt.vm = vm;
+    opt.chunk = chunk;
+    initChunk(&opt.out);
+    opt.jumpsTo = ALLOCATE(vm, int, count + 1);
+    opt.poppedJumps = ALLOCATE(vm, int, count + 1);
+    opt.newOffset = ALLOCATE(vm, int, count + 1);
+    opt.jumps = NULL;
+    opt.jumpCount = 0;
+    opt.jumpCapacity = 0;
+
+    for (int i = 0; i <= count; i++)
+    {
+        opt.jumpsTo[i] = 0;
+        opt.poppedJumps[i] = 0;
+        opt.newOffset[i] = -1;
+    }
+
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        int target = jumpTarget(chunk, offset);
+        if (target != -1)
+            opt.jumpsTo[target]++;
+    }
+
+    uint8_t *code = chunk->code;
+    uint8_t previous = OP_NIL; // Last original instruction, tells whether execution can fall into the current one.
+    int offset = 0;
+    while (offset < chunk->count)
+    {
+        uint8_t instruction = code[offset];
+        int length = instructionLength(chunk, offset);
+        int next = offset + length;
+        int line = getLine(chunk, offset);
+
+        // A pop only reached through jumps that already popped is dead.
+        if (instruction == OP_POP && opt.jumpsTo[offset] > 0 &&
+            opt.jumpsTo[offset] == opt.poppedJumps[offset] &&
+            (previous == OP_JUMP || previous == OP_LOOP || previous == OP_RETURN || previous == OP_GENERATOR_RETURN))
+        {
+            previous = instruction;
+            offset = next;
+            continue;
+        }
+
+        opt.newOffset[offset] = opt.out.count;
+
+        // Compare-and-branch: the comparison feeds a condition that is popped on both paths.
+        if ((instruction == OP_LESS || instruction == OP_GREATER || instruction == OP_EQUAL) &&
+            opt.jumpsTo[next] == 0 && isPoppingJump(&opt, next))
+        {
+            uint8_t fused = instruction == OP_LESS      ? OP_LESS_JUMP_IF_FALSE
+                            : instruction == OP_GREATER ? OP_GREATER_JUMP_IF_FALSE
+                                                        : OP_EQUAL_JUMP_IF_FALSE;
+            emitPoppingJump(&opt, fused, next, line);
+            previous = OP_POP;
+            offset = next + 4;
+            continue;
+        }
+
+        if (isPoppingJump(&opt, offset))
+        {
+            emitPoppingJump(&opt, OP_POP_JUMP_IF_FALSE, offset, line);
+            previous = OP_POP;
+            offset = next + 1;
+            continue;
+        }
+
+        // `a >= b` compiles to `!(a < b)`, `a <= b` to `!(a > b)` and `a != b` to `!(a == b)`.
+        if ((instruction == OP_LESS || instruction == OP_GREATER || instruction == OP_EQUAL) &&
+            isPlain(&opt, next, OP_NOT))
+        {
+            emit(&opt, instruction == OP_LESS      ? OP_GREATER_EQUAL
+                       : instruction == OP_GREATER ? OP_LESS_EQUAL
+                                                   : OP_NOT_EQUAL,
+                 line);
+            previous = OP_NOT;
+            offset = next + 1;
+            continue;
+        }
+
+        if (instruction == OP_GET_LOCAL && isPlain(&opt, next, OP_GET_LOCAL) &&
+            isPlain(&opt, next + 2, OP_ADD))
+        {
+            emit(&opt, OP_GET_LOCAL_GET_LOCAL_ADD, line);
+            emit(&opt, code[offset + 1], line);
+            emit(&opt, code[next + 1], line);
+            previous = OP_ADD;
+            offset = next + 3;
+            continue;
+        }
+
+        int target = jumpTarget(chunk, offset);
+        if (target != -1)
+        {
+            emitJump(&opt, instruction, target, line);
+        }
+        else
+        {
+            for (int i = 0; i < length; i++)
+            {
+                emit(&opt, code[offset + i], line);
+            }
+        }
+        previous = instruction;
+        offset = next;
+    }
+
+    // Removed instructions resolve to whatever follows them.
+    opt.newOffset[chunk->count] = opt.out.count;
+    for (int i = chunk->count - 1; i >= 0; i--)
+    {
+        if (opt.newOffset[i] == -1)
+            opt.newOffset[i] = opt.newOffset[i + 1];
+    }
+    patchJumps(&opt);
+
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, LineInfo, chunk->lines, chunk->lineCapacity);
+    chunk->code = opt.out.code;
+    chunk->count = opt.out.count;
+    chunk->capacity = opt.out.capacity;
+    chunk->lines = opt.out.lines;
+    chunk->lineCount = opt.out.lineCount;
+    chunk->lineCapacity = opt.out.lineCapacity;
+
+    FREE_ARRAY(vm, PendingJump, opt.jumps, opt.jumpCapacity);
+    FREE_ARRAY(vm, int, opt.newOffset, count + 1);
+    FREE_ARRAY(vm, int, opt.poppedJumps, count + 1);
+    FREE_ARRAY(vm, int, opt.jumpsTo, count + 1);
+}
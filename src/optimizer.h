@@ -0,0 +1,25 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+// Returns the size in bytes of the instruction at the given offset, operands included.
+int instructionLength(Chunk *chunk, int offset);
+
+// Returns the offset a jump or loop instruction lands on, or -1 if the instruction doesn't jump.
+int jumpTarget(Chunk *chunk, int offset);
+
+/*
+Returns the most values a call to the chunk's function ever has on the stack, counting from its frame's first slot.
+initialDepth is what the frame starts with: the callee slot plus the arguments.
+*/
+int maxStackDepth(VM *vm, Chunk *chunk, int initialDepth);
+
+/*
+Peephole pass over a finished chunk.
+Fuses common instruction sequences into superinstructions, drops the pops they make dead and rewrites
+jump offsets and the line table to match the new layout.
+*/
+void optimizeChunk(VM *vm, Chunk *chunk);
+
+#endif
@@ -0,0 +1,176 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "compiler.h"
+#include "memory.h"
+#include "pool.h"
+
+// Workers run whole interpreters, musl's default thread stack is far smaller than a main thread's.
+#define WORKER_STACK_SIZE (8 * 1024 * 1024)
+
+// Isolates a worker has left to run. Its own worker takes from the back, thieves take from the front.
+typedef struct
+{
+    pthread_mutex_t lock;
+    int *items; // Isolate numbers.
+    int head;
+    int tail;
+} WorkQueue;
+
+typedef struct Pool Pool;
+
+typedef struct
+{
+    Pool *pool;
+    int index;
+    pthread_t thread;
+} Worker;
+
+struct Pool
+{
+    VM owner; // Compiled the script and owns the shared code, it never runs anything.
+    ObjFunction *function;
+    WorkQueue *queues;
+    Worker *workers;
+    int workerCount;
+    int maxFrames;
+    InterpretResult *results; // One per isolate, written by the worker that ran it.
+};
+
+// Returns the next isolate for the worker to run, stealing one when its queue is empty, or -1 when all are taken.
+static int takeWork(Pool *pool, int self)
+{
+    WorkQueue *own = &pool->queues[self];
+    int item = -1;
+    pthread_mutex_lock(&own->lock);
+    if (own->head < own->tail)
+        item = own->items[--own->tail];
+    pthread_mutex_unlock(&own->lock);
+
+    for (int i = 1; item == -1 && i < pool->workerCount; i++)
+    {
+        WorkQueue *victim = &pool->queues[(self + i) % pool->workerCount];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail)
+            item = victim->items[victim->head++];
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return item;
+}
+
+static InterpretResult runIsolate(Pool *pool, int item)
+{
+    VM vm;
+    initIsolate(&vm, &pool->owner);
+    vm.isolate = item;
+    vm.maxFrames = pool->maxFrames;
+    InterpretResult result = runFunction(&vm, pool->function);
+    freeVM(&vm);
+    return result;
+}
+
+static void *workerMain(void *argument)
+{
+    Worker *worker = (Worker *)argument;
+    int item;
+    while ((item = takeWork(worker->pool, worker->index)) != -1)
+    {
+        worker->pool->results[item] = runIsolate(worker->pool, item);
+    }
+    return NULL;
+}
+
+InterpretResult runIsolates(const char *source, int isolates, int threads, int maxFrames)
+{
+    Pool pool;
+    initVM(&pool.owner);
+    pool.function = compile(&pool.owner, source);
+    if (pool.function == NULL)
+    {
+        freeVM(&pool.owner);
+        return INTERPRET_COMPILE_ERROR;
+    }
+    freezeObjects(&pool.owner);
+
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > isolates)
+        threads = isolates;
+    if (threads < 1)
+        threads = 1;
+    if (threads < isolates)
+        fprintf(stderr, "Warning: %d isolates on %d threads, isolates that wait on each other will deadlock.\n",
+                isolates, threads);
+
+    pool.workerCount = threads;
+    pool.maxFrames = maxFrames;
+    pool.queues = malloc(sizeof(WorkQueue) * threads);
+    pool.workers = malloc(sizeof(Worker) * threads);
+    pool.results = malloc(sizeof(InterpretResult) * isolates);
+    if (pool.queues == NULL || pool.workers == NULL || pool.results == NULL)
+        exit(1);
+
+    // Isolates are dealt round robin, stealing evens the queues out when some scripts run longer.
+    for (int i = 0; i < threads; i++)
+    {
+        WorkQueue *queue = &pool.queues[i];
+        pthread_mutex_init(&queue->lock, NULL);
+        queue->items = malloc(sizeof(int) * (isolates / threads + 1));
+        if (queue->items == NULL)
+            exit(1);
+        queue->head = 0;
+        queue->tail = 0;
+    }
+    for (int i = 0; i < isolates; i++)
+    {
+        WorkQueue *queue = &pool.queues[i % threads];
+        queue->items[queue->tail++] = i;
+        pool.results[i] = INTERPRET_OK;
+    }
+
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setstacksize(&attributes, WORKER_STACK_SIZE);
+    int started = 0;
+    for (; started < threads; started++)
+    {
+        Worker *worker = &pool.workers[started];
+        worker->pool = &pool;
+        worker->index = started;
+        if (pthread_create(&worker->thread, &attributes, workerMain, worker) != 0)
+            break;
+    }
+    pthread_attr_destroy(&attributes);
+
+    // Workers that couldn't start leave their queues to be stolen, the calling thread helps if none did.
+    if (started == 0)
+    {
+        Worker self = {&pool, 0, pthread_self()};
+        workerMain(&self);
+    }
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+
+    InterpretResult result = INTERPRET_OK;
+    for (int i = 0; i < isolates; i++)
+    {
+        if (pool.results[i] != INTERPRET_OK)
+            result = pool.results[i];
+    }
+
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_mutex_destroy(&pool.queues[i].lock);
+        free(pool.queues[i].items);
+    }
+    free(pool.queues);
+    free(pool.workers);
+    free(pool.results);
+    freeVM(&pool.owner);
+    return result;
+}
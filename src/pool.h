@@ -0,0 +1,22 @@
+#ifndef clox_pool_h
+#define clox_pool_h
+
+#include "vm.h"
+
+/*
+Isolate pool.
+A script is compiled once and then run by several VMs, the isolates, on a pool of worker threads. The isolates share
+the compiled functions and their constants, which are frozen and never written again, while each one has its own
+stack, globals, heap and string table. Every worker has a queue of isolates to run and steals from the others once
+its own is empty.
+*/
+
+/*
+Runs `isolates` instances of the script on `threads` workers, 0 picks one per online processor, each with a call
+depth limit of `maxFrames`. Returns the worst result any of them had.
+A worker runs its isolates one after the other and a blocked one keeps its thread, so isolates that wait on each
+other deadlock with fewer threads than isolates. That case gets a warning on stderr.
+*/
+InterpretResult runIsolates(const char *source, int isolates, int threads, int maxFrames);
+
+#endif
@@ -4,45 +4,36 @@
 #include "common.h"
 #include "scanner.h"
 
-typedef struct scanner
-{
-    const char *start;
-    const char *current;
-    int line;
-} Scanner;
-
-Scanner scanner;
-
 // === Utility Functions ===
 
-static bool isAtEnd()
+static bool isAtEnd(Scanner *scanner)
 {
-    return *scanner.current == '\0';
+    return *scanner->current == '\0';
 }
 
-static char advance()
+static char advance(Scanner *scanner)
 {
-    scanner.current++;
-    return scanner.current[-1];
+    scanner->current++;
+    return scanner->current[-1];
 }
 
-static char peek()
+static char peek(Scanner *scanner)
 {
-    return *scanner.current;
+    return *scanner->current;
 }
 
-static char peekNext()
+static char peekNext(Scanner *scanner)
 {
-    if (isAtEnd())
+    if (isAtEnd(scanner))
         return '\0';
-    return scanner.current[1];
+    return scanner->current[1];
 }
 
-static bool match(char expected)
+static bool match(Scanner *scanner, char expected)
 {
-    if (isAtEnd() || *scanner.current != expected)
+    if (isAtEnd(scanner) || *scanner->current != expected)
         return false;
-    scanner.current++;
+    scanner->current++;
     return true;
 }
 
@@ -58,27 +49,27 @@ static bool isDigit(char c)
     return c >= '0' && c <= '9';
 }
 
-static void skipWhitespace()
+static void skipWhitespace(Scanner *scanner)
 {
     for (;;)
     {
-        char c = peek();
+        char c = peek(scanner);
         switch (c)
         {
         case ' ':
         case '\r':
         case '\t':
-            advance();
+            advance(scanner);
             break;
         case '\n':
-            scanner.line++;
-            advance();
+            scanner->line++;
+            advance(scanner);
             break;
         case '/':
-            if (peekNext() == '/')
+            if (peekNext(scanner) == '/')
             {
-                while (peek() != '\n' && !isAtEnd())
-                    advance();
+                while (peek(scanner) != '\n' && !isAtEnd(scanner))
+                    advance(scanner);
             }
             else
             {
@@ -94,42 +85,42 @@ static void skipWhitespace()
 // === Token Helpers ===
 
 // Returns a token given the type.
-static Token makeToken(TokenType type)
+static Token makeToken(Scanner *scanner, TokenType type)
 {
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
     return token;
 }
 
 // Returns an error token given the message.
-static Token errorToken(const char *message)
+static Token errorToken(Scanner *scanner, const char *message)
 {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int)strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
     return token;
 }
 
 // === Scanner Init ===
 
-void initScanner(const char *source)
+void initScanner(Scanner *scanner, const char *source)
 {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+    scanner->start = source;
+    scanner->current = source;
+    scanner->line = 1;
 }
 
 // === Keyword Check ===
 
-static TokenType checkKeyword(int start, int length,
+static TokenType checkKeyword(Scanner *scanner, int start, int length,
                               const char *rest, TokenType type)
 {
-    if (scanner.current - scanner.start == start + length && memcmp(scanner.start + start, rest, length) == 0)
+    if (scanner->current - scanner->start == start + length && memcmp(scanner->start + start, rest, length) == 0)
     {
         return type;
     }
@@ -140,58 +131,60 @@ static TokenType checkKeyword(int start, int length,
 /*
 Identifies the the token type looking at the first letters and returns the expected token.
 */
-static TokenType identifierType()
+static TokenType identifierType(Scanner *scanner)
 {
-    switch (scanner.start[0])
+    switch (scanner->start[0])
     {
     case 'a':
-        return checkKeyword(1, 2, "nd", TOKEN_AND);
+        return checkKeyword(scanner, 1, 2, "nd", TOKEN_AND);
     case 'c':
-        return checkKeyword(1, 4, "lass", TOKEN_CLASS);
+        return checkKeyword(scanner, 1, 4, "lass", TOKEN_CLASS);
     case 'e':
-        return checkKeyword(1, 3, "lse", TOKEN_ELSE);
+        return checkKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
     case 'f':
-        if (scanner.current - scanner.start > 1)
+        if (scanner->current - scanner->start > 1)
         {
-            switch (scanner.start[1])
+            switch (scanner->start[1])
             {
             case 'a':
-                return checkKeyword(2, 3, "lse", TOKEN_FALSE);
+                return checkKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
             case 'o':
-                return checkKeyword(2, 1, "r", TOKEN_FOR);
+                return checkKeyword(scanner, 2, 1, "r", TOKEN_FOR);
             case 'u':
-                return checkKeyword(2, 1, "n", TOKEN_FUN);
+                return checkKeyword(scanner, 2, 1, "n", TOKEN_FUN);
             }
         }
         break;
     case 'i':
-        return checkKeyword(1, 1, "f", TOKEN_IF);
+        return checkKeyword(scanner, 1, 1, "f", TOKEN_IF);
     case 'n':
-        return checkKeyword(1, 2, "il", TOKEN_NIL);
+        return checkKeyword(scanner, 1, 2, "il", TOKEN_NIL);
     case 'o':
-        return checkKeyword(1, 1, "r", TOKEN_OR);
+        return checkKeyword(scanner, 1, 1, "r", TOKEN_OR);
     case 'p': return 
-            checkKeyword(1, 4, "rint", TOKEN_PRINT);
+            checkKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
     case 'r':
-        return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
+        return checkKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
     case 's':
-        return checkKeyword(1, 4, "uper", TOKEN_SUPER);
+        return checkKeyword(scanner, 1, 4, "uper", TOKEN_SUPER);
     case 't':
-        if (scanner.current - scanner.start > 1)
+        if (scanner->current - scanner->start > 1)
         {
-            switch (scanner.start[1])
+            switch (scanner->start[1])
             {
             case 'h':
-                return checkKeyword(2, 2, "is", TOKEN_THIS);
+                return checkKeyword(scanner, 2, 2, "is", TOKEN_THIS);
             case 'r':
-                return checkKeyword(2, 2, "ue", TOKEN_TRUE);
+                return checkKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
             }
         }
         break;
     case 'v':
-        return checkKeyword(1, 2, "ar", TOKEN_VAR);
+        return checkKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
     case 'w':
-        return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+        return checkKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
+    case 'y':
+        return checkKeyword(scanner, 1, 4, "ield", TOKEN_YIELD);
     }
     return TOKEN_IDENTIFIER;
 }
@@ -199,101 +192,107 @@ static TokenType identifierType()
 // === Token Type Parsers ===
 
 // Check if exists some identifier and returns its token.
-static Token identifier()
+static Token identifier(Scanner *scanner)
 {
-    while (isAlpha(peek()) || isDigit(peek()))
-        advance();
-    return makeToken(identifierType());
+    while (isAlpha(peek(scanner)) || isDigit(peek(scanner)))
+        advance(scanner);
+    return makeToken(scanner, identifierType(scanner));
 }
 
 // Check if exists some number and returns its token.
-static Token number()
+static Token number(Scanner *scanner)
 {
-    while (isDigit(peek()))
-        advance();
+    while (isDigit(peek(scanner)))
+        advance(scanner);
 
-    if (peek() == '.' && isDigit(peekNext()))
+    if (peek(scanner) == '.' && isDigit(peekNext(scanner)))
     {
-        advance();
-        while (isDigit(peek()))
-            advance();
+        advance(scanner);
+        while (isDigit(peek(scanner)))
+            advance(scanner);
     }
 
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
 // Check if exists some string and returns its token.
-static Token string()
+static Token string(Scanner *scanner)
 {
-    while (peek() != '"' && !isAtEnd())
+    while (peek(scanner) != '"' && !isAtEnd(scanner))
     {
-        if (peek() == '\n')
-            scanner.line++;
-        advance();
+        if (peek(scanner) == '\n')
+            scanner->line++;
+        advance(scanner);
     }
 
-    if (isAtEnd())
-        return errorToken("Unterminated string.");
+    if (isAtEnd(scanner))
+        return errorToken(scanner, "Unterminated string.");
 
-    advance(); // closing "
-    return makeToken(TOKEN_STRING);
+    advance(scanner); // closing "
+    return makeToken(scanner, TOKEN_STRING);
 }
 
 // === Main Scanner Function ===
 
-Token scanToken()
+Token scanToken(Scanner *scanner)
 {
-    skipWhitespace();
+    skipWhitespace(scanner);
 
-    scanner.start = scanner.current;
+    scanner->start = scanner->current;
 
-    if (isAtEnd())
-        return makeToken(TOKEN_EOF);
+    if (isAtEnd(scanner))
+        return makeToken(scanner, TOKEN_EOF);
 
-    char c = advance();
+    char c = advance(scanner);
 
     if (isAlpha(c))
-        return identifier();
+        return identifier(scanner);
     if (isDigit(c))
-        return number();
+        return number(scanner);
 
     switch (c)
     {
     case '?':
-        return makeToken(TOKEN_INTERROGATION_OPEN);
+        return makeToken(scanner, TOKEN_INTERROGATION_OPEN);
     case ':':
-        return makeToken(TOKEN_COLON);
+        return makeToken(scanner, TOKEN_COLON);
     case '(':
-        return makeToken(TOKEN_LEFT_PAREN);
+        return makeToken(scanner, TOKEN_LEFT_PAREN);
     case ')':
-        return makeToken(TOKEN_RIGHT_PAREN);
+        return makeToken(scanner, TOKEN_RIGHT_PAREN);
     case '{':
-        return makeToken(TOKEN_LEFT_BRACE);
+        return makeToken(scanner, TOKEN_LEFT_BRACE);
     case '}':
-        return makeToken(TOKEN_RIGHT_BRACE);
+        return makeToken(scanner, TOKEN_RIGHT_BRACE);
+    case '[':
+        return makeToken(scanner, TOKEN_LEFT_BRACKET);
+    case ']':
+        return makeToken(scanner, TOKEN_RIGHT_BRACKET);
     case ';':
-        return makeToken(TOKEN_SEMICOLON);
+        return makeToken(scanner, TOKEN_SEMICOLON);
     case ',':
-        return makeToken(TOKEN_COMMA);
+        return makeToken(scanner, TOKEN_COMMA);
+    case '.':
+        return makeToken(scanner, TOKEN_DOT);
     case '-':
-        return makeToken(TOKEN_MINUS);
+        return makeToken(scanner, TOKEN_MINUS);
     case '+':
-        return makeToken(TOKEN_PLUS);
+        return makeToken(scanner, TOKEN_PLUS);
     case '/':
-        return makeToken(TOKEN_SLASH);
+        return makeToken(scanner, TOKEN_SLASH);
     case '*':
-        return makeToken(TOKEN_STAR);
+        return makeToken(scanner, TOKEN_STAR);
     case '!':
-        return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
     case '=':
-        return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
     case '<':
-        return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
     case '>':
-        return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+        return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
     case '"':
-        return string();
+        return string(scanner);
     }
 
-    return errorToken("Unexpected character.");
+    return errorToken(scanner, "Unexpected character.");
 }
@@ -8,6 +8,8 @@ typedef enum
     TOKEN_RIGHT_PAREN,
     TOKEN_LEFT_BRACE,
     TOKEN_RIGHT_BRACE,
+    TOKEN_LEFT_BRACKET,
+    TOKEN_RIGHT_BRACKET,
     TOKEN_COMMA,
     TOKEN_DOT,
     TOKEN_MINUS,
@@ -47,6 +49,7 @@ typedef enum
     TOKEN_TRUE,
     TOKEN_VAR,
     TOKEN_WHILE,
+    TOKEN_YIELD,
 
     TOKEN_ERROR,
     TOKEN_EOF
@@ -60,9 +63,17 @@ typedef struct
     int line;
 } Token;
 
-void initScanner(const char *source);
+// Where scanning is in the source, each compilation has its own.
+typedef struct
+{
+    const char *start;
+    const char *current;
+    int line;
+} Scanner;
+
+void initScanner(Scanner *scanner, const char *source);
 
 // Scans the tokens throught the source code.
-Token scanToken();
+Token scanToken(Scanner *scanner);
 
 #endif
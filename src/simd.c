@@ -0,0 +1,339 @@
+#include <pthread.h>
+
+#include "simd.h"
+
+#ifdef SIMD_ENABLED
+#include <immintrin.h>
+#endif
+
+static double sumScalar(const double *a, int count)
+{
+    double sum = 0;
+    for (int i = 0; i < count; i++)
+        sum += a[i];
+    return sum;
+}
+
+static double dotScalar(const double *a, const double *b, int count)
+{
+    double sum = 0;
+    for (int i = 0; i < count; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+// A NaN anywhere is the result, the first one in the array. Every version below follows the same rule.
+static double minScalar(const double *a, int count)
+{
+    double min = a[0];
+    for (int i = 0; i < count; i++)
+    {
+        if (a[i] != a[i])
+            return a[i];
+        min = a[i] < min ? a[i] : min;
+    }
+    return min;
+}
+
+static double maxScalar(const double *a, int count)
+{
+    double max = a[0];
+    for (int i = 0; i < count; i++)
+    {
+        if (a[i] != a[i])
+            return a[i];
+        max = a[i] > max ? a[i] : max;
+    }
+    return max;
+}
+
+static void scaleScalar(double *a, double k, int count)
+{
+    for (int i = 0; i < count; i++)
+        a[i] *= k;
+}
+
+static void axpyScalar(double k, const double *x, double *y, int count)
+{
+    for (int i = 0; i < count; i++)
+        y[i] += k * x[i];
+}
+
+static void addScalar(const double *a, const double *b, double *out, int count)
+{
+    for (int i = 0; i < count; i++)
+        out[i] = a[i] + b[i];
+}
+
+static void mulScalar(const double *a, const double *b, double *out, int count)
+{
+    for (int i = 0; i < count; i++)
+        out[i] = a[i] * b[i];
+}
+
+static const FloatKernels scalarKernels = {
+    "scalar", sumScalar, dotScalar, minScalar, maxScalar, scaleScalar, axpyScalar, addScalar, mulScalar,
+};
+
+#ifdef SIMD_ENABLED
+/*
+SSE2 is part of x86-64, these always run. Reductions keep two accumulators so consecutive adds don't wait on each
+other, and the items left over after the last full vector go through the scalar loop.
+*/
+static double sumSse2(const double *a, int count)
+{
+    __m128d sum0 = _mm_setzero_pd();
+    __m128d sum1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        sum0 = _mm_add_pd(sum0, _mm_loadu_pd(a + i));
+        sum1 = _mm_add_pd(sum1, _mm_loadu_pd(a + i + 2));
+    }
+    __m128d sum = _mm_add_pd(sum0, sum1);
+    sum = _mm_add_sd(sum, _mm_unpackhi_pd(sum, sum));
+    return _mm_cvtsd_f64(sum) + sumScalar(a + i, count - i);
+}
+
+static double dotSse2(const double *a, const double *b, int count)
+{
+    __m128d sum0 = _mm_setzero_pd();
+    __m128d sum1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        sum0 = _mm_add_pd(sum0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        sum1 = _mm_add_pd(sum1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    __m128d sum = _mm_add_pd(sum0, sum1);
+    sum = _mm_add_sd(sum, _mm_unpackhi_pd(sum, sum));
+    return _mm_cvtsd_f64(sum) + dotScalar(a + i, b + i, count - i);
+}
+
+/*
+_mm_min_pd and _mm_max_pd pass a NaN through only in their second operand, so the loops don't rely on them for it:
+every vector is also checked for NaNs, and once one was seen the scalar loop finds the first.
+*/
+static double minSse2(const double *a, int count)
+{
+    if (count < 2)
+        return minScalar(a, count);
+    __m128d min = _mm_loadu_pd(a);
+    __m128d nan = _mm_cmpunord_pd(min, min);
+    int i = 2;
+    for (; i + 2 <= count; i += 2)
+    {
+        __m128d x = _mm_loadu_pd(a + i);
+        nan = _mm_or_pd(nan, _mm_cmpunord_pd(x, x));
+        min = _mm_min_pd(min, x);
+    }
+    if (_mm_movemask_pd(nan) != 0)
+        return minScalar(a, count);
+    min = _mm_min_sd(min, _mm_unpackhi_pd(min, min));
+    double result = _mm_cvtsd_f64(min);
+    if (i == count)
+        return result;
+    double rest = minScalar(a + i, count - i);
+    return rest < result || rest != rest ? rest : result;
+}
+
+static double maxSse2(const double *a, int count)
+{
+    if (count < 2)
+        return maxScalar(a, count);
+    __m128d max = _mm_loadu_pd(a);
+    __m128d nan = _mm_cmpunord_pd(max, max);
+    int i = 2;
+    for (; i + 2 <= count; i += 2)
+    {
+        __m128d x = _mm_loadu_pd(a + i);
+        nan = _mm_or_pd(nan, _mm_cmpunord_pd(x, x));
+        max = _mm_max_pd(max, x);
+    }
+    if (_mm_movemask_pd(nan) != 0)
+        return maxScalar(a, count);
+    max = _mm_max_sd(max, _mm_unpackhi_pd(max, max));
+    double result = _mm_cvtsd_f64(max);
+    if (i == count)
+        return result;
+    double rest = maxScalar(a + i, count - i);
+    return rest > result || rest != rest ? rest : result;
+}
+
+static void scaleSse2(double *a, double k, int count)
+{
+    __m128d factor = _mm_set1_pd(k);
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(a + i, _mm_mul_pd(_mm_loadu_pd(a + i), factor));
+    scaleScalar(a + i, k, count - i);
+}
+
+static void axpySse2(double k, const double *x, double *y, int count)
+{
+    __m128d factor = _mm_set1_pd(k);
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), _mm_mul_pd(factor, _mm_loadu_pd(x + i))));
+    axpyScalar(k, x + i, y + i, count - i);
+}
+
+static void addSse2(const double *a, const double *b, double *out, int count)
+{
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    addScalar(a + i, b + i, out + i, count - i);
+}
+
+static void mulSse2(const double *a, const double *b, double *out, int count)
+{
+    int i = 0;
+    for (; i + 2 <= count; i += 2)
+        _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    mulScalar(a + i, b + i, out + i, count - i);
+}
+
+static const FloatKernels sse2Kernels = {
+    "sse2", sumSse2, dotSse2, minSse2, maxSse2, scaleSse2, axpySse2, addSse2, mulSse2,
+};
+
+// Compiled for AVX2 whatever the build targets, they only run once the CPU says it has it. No FMA, so every
+// product is rounded before it's added, like the other versions do.
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static double reduceAvx2(__m256d sum)
+{
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+}
+
+AVX2 static double sumAvx2(const double *a, int count)
+{
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        sum0 = _mm256_add_pd(sum0, _mm256_loadu_pd(a + i));
+        sum1 = _mm256_add_pd(sum1, _mm256_loadu_pd(a + i + 4));
+    }
+    return reduceAvx2(_mm256_add_pd(sum0, sum1)) + sumScalar(a + i, count - i);
+}
+
+AVX2 static double dotAvx2(const double *a, const double *b, int count)
+{
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        sum1 = _mm256_add_pd(sum1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+    return reduceAvx2(_mm256_add_pd(sum0, sum1)) + dotScalar(a + i, b + i, count - i);
+}
+
+AVX2 static double minAvx2(const double *a, int count)
+{
+    if (count < 4)
+        return minSse2(a, count);
+    __m256d min = _mm256_loadu_pd(a);
+    __m256d nan = _mm256_cmp_pd(min, min, _CMP_UNORD_Q);
+    int i = 4;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256d x = _mm256_loadu_pd(a + i);
+        nan = _mm256_or_pd(nan, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+        min = _mm256_min_pd(min, x);
+    }
+    if (_mm256_movemask_pd(nan) != 0)
+        return minScalar(a, count);
+    __m128d half = _mm_min_pd(_mm256_castpd256_pd128(min), _mm256_extractf128_pd(min, 1));
+    double result = _mm_cvtsd_f64(_mm_min_sd(half, _mm_unpackhi_pd(half, half)));
+    if (i == count)
+        return result;
+    double rest = minScalar(a + i, count - i);
+    return rest < result || rest != rest ? rest : result;
+}
+
+AVX2 static double maxAvx2(const double *a, int count)
+{
+    if (count < 4)
+        return maxSse2(a, count);
+    __m256d max = _mm256_loadu_pd(a);
+    __m256d nan = _mm256_cmp_pd(max, max, _CMP_UNORD_Q);
+    int i = 4;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256d x = _mm256_loadu_pd(a + i);
+        nan = _mm256_or_pd(nan, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+        max = _mm256_max_pd(max, x);
+    }
+    if (_mm256_movemask_pd(nan) != 0)
+        return maxScalar(a, count);
+    __m128d half = _mm_max_pd(_mm256_castpd256_pd128(max), _mm256_extractf128_pd(max, 1));
+    double result = _mm_cvtsd_f64(_mm_max_sd(half, _mm_unpackhi_pd(half, half)));
+    if (i == count)
+        return result;
+    double rest = maxScalar(a + i, count - i);
+    return rest > result || rest != rest ? rest : result;
+}
+
+AVX2 static void scaleAvx2(double *a, double k, int count)
+{
+    __m256d factor = _mm256_set1_pd(k);
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(a + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), factor));
+    scaleScalar(a + i, k, count - i);
+}
+
+AVX2 static void axpyAvx2(double k, const double *x, double *y, int count)
+{
+    __m256d factor = _mm256_set1_pd(k);
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(y + i,
+                         _mm256_add_pd(_mm256_loadu_pd(y + i), _mm256_mul_pd(factor, _mm256_loadu_pd(x + i))));
+    axpyScalar(k, x + i, y + i, count - i);
+}
+
+AVX2 static void addAvx2(const double *a, const double *b, double *out, int count)
+{
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    addScalar(a + i, b + i, out + i, count - i);
+}
+
+AVX2 static void mulAvx2(const double *a, const double *b, double *out, int count)
+{
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    mulScalar(a + i, b + i, out + i, count - i);
+}
+
+static const FloatKernels avx2Kernels = {
+    "avx2", sumAvx2, dotAvx2, minAvx2, maxAvx2, scaleAvx2, axpyAvx2, addAvx2, mulAvx2,
+};
+#endif
+
+static const FloatKernels *selectedKernels = &scalarKernels;
+static pthread_once_t selectOnce = PTHREAD_ONCE_INIT;
+
+static void selectKernels()
+{
+#ifdef SIMD_ENABLED
+    __builtin_cpu_init();
+    selectedKernels = __builtin_cpu_supports("avx2") ? &avx2Kernels : &sse2Kernels;
+#endif
+}
+
+// Isolates may ask from several threads at once, the CPU is only checked by the first.
+const FloatKernels *floatKernels()
+{
+    pthread_once(&selectOnce, selectKernels);
+    return selectedKernels;
+}
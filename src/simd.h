@@ -0,0 +1,26 @@
+#ifndef clox_simd_h
+#define clox_simd_h
+
+#include "common.h"
+
+/*
+Loops behind the float array natives, over packed doubles. Each has a scalar version and, on x86-64, an SSE2 and an
+AVX2 one, the first call picks the widest the CPU runs. The vector versions add in a different order, so a sum or a
+dot product may differ in its last bits between machines. min and max return the first NaN among the items.
+*/
+typedef struct
+{
+    const char *name;
+    double (*sum)(const double *a, int count);
+    double (*dot)(const double *a, const double *b, int count);
+    double (*min)(const double *a, int count); // count > 0.
+    double (*max)(const double *a, int count); // count > 0.
+    void (*scale)(double *a, double k, int count);
+    void (*axpy)(double k, const double *x, double *y, int count); // y += k * x.
+    void (*add)(const double *a, const double *b, double *out, int count);
+    void (*mul)(const double *a, const double *b, double *out, int count);
+} FloatKernels;
+
+const FloatKernels *floatKernels();
+
+#endif
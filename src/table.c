@@ -1,6 +1,8 @@
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "memory.h"
 #include "object.h"
@@ -10,8 +12,9 @@
 #define TABLE_MAX_LOAD 0.75
 #define VALUE_HASH(value) (getHash(value))
 
-void initTable(Table *table)
+void initTable(Table *table, TableKind kind)
 {
+    table->kind = kind;
     table->count = 0;
     table->capacity = 0;
     table->entries = NULL;
@@ -19,50 +22,150 @@ void initTable(Table *table)
     table->vLast = NULL;
 }
 
-void freeTable(Table *table)
+void freeTable(VM *vm, Table *table)
 {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    initTable(table);
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
+    initTable(table, table->kind);
 }
 
-static uint32_t hashNumber(const void *data, size_t length)
+/*
+Hashes are keyed with a seed picked at random once per process, so which keys collide can't be worked out ahead of
+time and fed to a script to turn its tables into long probe chains. Isolates share it, their frozen strings were
+hashed by the owner. The fallback only matters where there's no /dev/urandom.
+*/
+static uint64_t hashSeed;
+static pthread_once_t seedOnce = PTHREAD_ONCE_INIT;
+
+static void pickSeed()
 {
-    uint32_t hash = 216613621u;
-    const uint8_t *bytes = (const uint8_t *)data;
-    for (int i = 0; i < length; i++)
+    uint64_t seed = 0;
+    FILE *random = fopen("/dev/urandom", "rb");
+    if (random != NULL)
     {
-        hash ^= bytes[i];
-        hash *= 16777619;
+        if (fread(&seed, sizeof(seed), 1, random) != 1)
+            seed = 0;
+        fclose(random);
     }
-    return hash;
+    if (seed == 0)
+        seed = ((uint64_t)time(NULL) << 32) ^ (uint64_t)clock() ^ (uint64_t)(uintptr_t)&seed;
+    hashSeed = seed;
+}
+
+void seedHashes()
+{
+    pthread_once(&seedOnce, pickSeed);
+}
+
+// Constants of wyhash, which the functions below follow.
+#define HASH_K0 0xa0761d6478bd642full
+#define HASH_K1 0xe7037ed1a0b428dbull
+
+// The full 128-bit product of a and b folded back into 64 bits, the only mixing step.
+static inline uint64_t mix(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    uint64_t ha = a >> 32, la = (uint32_t)a, hb = b >> 32, lb = (uint32_t)b;
+    uint64_t high = ha * hb, middle0 = ha * lb, middle1 = la * hb, low = la * lb;
+    uint64_t carry = ((low >> 32) + (uint32_t)middle0 + (uint32_t)middle1) >> 32;
+    high += (middle0 >> 32) + (middle1 >> 32) + carry;
+    return (low + (middle0 << 32) + (middle1 << 32)) ^ high;
+#endif
+}
+
+// Unaligned loads, memcpy compiles down to a single mov.
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
 }
 
+static inline uint64_t read32(const uint8_t *p)
+{
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+/*
+Takes the characters 16 bytes at a time, two words per multiply, instead of FNV-1a's multiply per byte. Up to 16
+bytes, which most names and keys are, it's two overlapping loads and no loop at all.
+*/
+uint32_t hashBytes(const char *chars, int length)
+{
+    const uint8_t *p = (const uint8_t *)chars;
+    uint64_t seed = hashSeed ^ mix(hashSeed ^ HASH_K0, HASH_K1);
+    uint64_t a, b;
+    if (length <= 16)
+    {
+        if (length >= 4)
+        {
+            int middle = (length >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + middle);
+            b = (read32(p + length - 4) << 32) | read32(p + length - 4 - middle);
+        }
+        else if (length > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) | p[length - 1];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        int i = length;
+        for (; i > 16; i -= 16, p += 16)
+            seed = mix(read64(p) ^ HASH_K1, read64(p + 8) ^ seed);
+        // The last 16 bytes, overlapping what the loop took when the length isn't a multiple of 16.
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+    uint64_t hash = mix(HASH_K1 ^ (uint64_t)length, mix(a ^ HASH_K1, b ^ seed));
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// A number's bits are one word, a single multiply spreads them.
+static uint32_t hashNumber(double number)
+{
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    uint64_t hash = mix(bits ^ hashSeed ^ HASH_K0, HASH_K1);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// Checks go through the IS_* macros so they work with either Value representation.
 static uint32_t getHash(Value value)
 {
-    switch (value.type)
+    if (IS_OBJ(value))
     {
-    case VAL_OBJ:
         switch (OBJ_TYPE(value))
         {
         case OBJ_STRING:
-            return AS_STRING(value)->hash;
+            return stringHash(AS_STRING(value));
 
         default:
-            return 0;
+            // Any other object is only equal to itself, its address will do. The low bits are alignment.
+            return (uint32_t)(((uintptr_t)AS_OBJ(value) >> 4) * 2654435761u);
         }
-
-    case VAL_NUMBER:
-        return hashNumber(&value.as.number, sizeof(double));
-
-    case VAL_BOOL:
+    }
+    if (IS_NUMBER(value))
+    {
+        double number = AS_NUMBER(value);
+        if (number == 0)
+            number = 0; // -0 equals 0, it has to land in the same bucket.
+        return hashNumber(number);
+    }
+    if (IS_BOOL(value))
         return AS_BOOL(value) ? 1231 : 1237;
 
-    case VAL_NIL:
-        return 2166136261u;
-
-    default:
-        return 0;
-    }
+    // Nil.
+    return 2166136261u;
 }
 
 /*
@@ -71,17 +174,14 @@ It's responsible for taking a key and an array of buckeys, and figuring
 out wich bucket the entry belong in.
 https://craftinginterpreters.com/hash-tables.html#hashing-strings:~:text=This%20function%20is,insert%20new%20ones.
 */
-static Entry *findEntry(Entry *entries, int capacity, Value key)
+static Entry *findEntry(Entry *entries, int capacity, Value key, uint32_t hash)
 {
-
-    // Gets the hash of the value or creates it
-    uint32_t index = VALUE_HASH(key) % capacity;
+    uint32_t index = hash % capacity;
     Entry *tombstone = NULL;
 
     for (;;)
     {
         Entry *entry = &entries[index];
-        printValue(entry->key);
 
         if (IS_NIL(entry->key))
         {
@@ -104,20 +204,80 @@ static Entry *findEntry(Entry *entries, int capacity, Value key)
     }
 }
 
+// findEntry() for a TABLE_STRINGS table. The keys are interned, so a probe compares addresses and never the types.
+static Entry *findString(Entry *entries, int capacity, Obj *key, uint32_t hash)
+{
+    uint32_t index = hash % capacity;
+    Entry *tombstone = NULL;
+
+    for (;;)
+    {
+        Entry *entry = &entries[index];
+
+        if (IS_NIL(entry->key))
+        {
+            if (IS_NIL(entry->value))
+                return tombstone != NULL ? tombstone : entry;
+            if (tombstone == NULL)
+                tombstone = entry;
+        }
+        else if (AS_OBJ(entry->key) == key)
+        {
+            return entry;
+        }
+
+        index = (index + 1) % capacity;
+    }
+}
+
+// The variant is picked once per operation, not per probe.
+static inline Entry *findKey(TableKind kind, Entry *entries, int capacity, Value key, uint32_t hash)
+{
+    if (kind == TABLE_STRINGS)
+        return findString(entries, capacity, AS_OBJ(key), hash);
+    return findEntry(entries, capacity, key, hash);
+}
+
+// An interned string was hashed when it was made.
+static inline uint32_t keyHash(Table *table, Value key)
+{
+    return table->kind == TABLE_STRINGS ? AS_STRING(key)->hash : VALUE_HASH(key);
+}
+
+// Whether the key is the one the last tableSet() stored.
+static inline bool isLastKey(Table *table, Value *key)
+{
+    if (table->kLast == NULL)
+        return false;
+    if (table->kind == TABLE_STRINGS)
+        return AS_OBJ(*table->kLast) == AS_OBJ(*key);
+    return valuesEqualPointers(table->kLast, key);
+}
+
+uint32_t hashValue(Value value)
+{
+    return VALUE_HASH(value);
+}
+
 // Assings the value of the key in the pointer if it exists in the table.
 bool tableGet(Table *table, Value key, Value *value)
+{
+    return tableGetHashed(table, key, keyHash(table, key), value);
+}
+
+bool tableGetHashed(Table *table, Value key, uint32_t hash, Value *value)
 {
     if (table->count == 0)
         return false;
 
     // If lives in cache.
-    if (table->kLast != NULL && valuesEqualPointers(table->kLast, &key))
+    if (isLastKey(table, &key))
     {
         *value = *table->vLast;
         return true;
     }
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
+    Entry *entry = findKey(table->kind, table->entries, table->capacity, key, hash);
     if (IS_NIL(entry->key))
         return false;
 
@@ -130,13 +290,13 @@ bool tableGet(Table *table, Value key, Value *value)
 2. Allocate the array, we initialize every element to be an empty bucket
 to be an empty bucket and then store the array(and its capacity) in the hash table's main struct.
 */
-static void adjustCapacity(Table *table, int capacity)
+static void adjustCapacity(VM *vm, Table *table, int capacity)
 {
     // Invalidate cache.
     table->kLast = NULL;
     table->vLast = NULL;
     
-    Entry *entries = ALLOCATE(Entry, capacity);
+    Entry *entries = ALLOCATE(vm, Entry, capacity);
     for (int i = 0; i < capacity; i++)
     {
         entries[i].key = NIL_VAL;
@@ -151,25 +311,30 @@ static void adjustCapacity(Table *table, int capacity)
         if (IS_NIL(entry->key))
             continue;
 
-        Entry *dest = findEntry(entries, capacity, entry->key);
+        Entry *dest = findKey(table->kind, entries, capacity, entry->key, keyHash(table, entry->key));
         dest->key = entry->key;
         dest->value = entry->value;
         table->count++;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
     table->entries = entries;
     table->capacity = capacity;
 }
 
-bool tableSet(Table *table, Value key, Value value)
+bool tableSet(VM *vm, Table *table, Value key, Value value)
+{
+    return tableSetHashed(vm, table, key, keyHash(table, key), value);
+}
+
+bool tableSetHashed(VM *vm, Table *table, Value key, uint32_t hash, Value value)
 {
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
     {
         int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+        adjustCapacity(vm, table, capacity);
     }
-    Entry *entry = findEntry(table->entries, table->capacity, key);
+    Entry *entry = findKey(table->kind, table->entries, table->capacity, key, hash);
     bool isNewKey = IS_NIL(entry->key);
     if (isNewKey && IS_NIL(entry->value))
     {
@@ -190,14 +355,14 @@ bool tableDelete(Table *table, Value *key)
     if (table->count == 0)
         return false;
 
-    if (table->kLast != NULL && valuesEqualPointers(table->kLast, key))
+    if (isLastKey(table, key))
     {
         table->vLast = NULL;
         table->kLast = NULL;
     }
 
     // Find the entry
-    Entry *entry = findEntry(table->entries, table->capacity, *key);
+    Entry *entry = findKey(table->kind, table->entries, table->capacity, *key, keyHash(table, *key));
     if (IS_NIL(entry->key))
         return false;
 
@@ -207,14 +372,14 @@ bool tableDelete(Table *table, Value *key)
     return true;
 }
 
-void tableAddAll(Table *from, Table *to)
+void tableAddAll(VM *vm, Table *from, Table *to)
 {
     for (int i = 0; i < from->capacity; i++)
     {
         Entry *entry = &from->entries[i];
         if (!IS_NIL(entry->key))
         {
-            tableSet(to, entry->key, entry->value);
+            tableSet(vm, to, entry->key, entry->value);
         }
     }
 }
@@ -257,42 +422,25 @@ Value *tableFindValue(Table *table, Value *key)
         else
         {
             Value candidate = entry->key;
-            if (candidate.type == key->type)
+            if (IS_OBJ(candidate) && IS_OBJ(*key))
             {
-                switch (key->type)
+                if (OBJ_TYPE(candidate) == OBJ_STRING &&
+                    OBJ_TYPE(*key) == OBJ_STRING)
                 {
-                case VAL_BOOL:
-                    if (AS_BOOL(candidate) == AS_BOOL(*key))
-                        return &entry->key;
-                    break;
-
-                case VAL_NIL:
-                    return &entry->key; // Solo hay un valor nil.
-
-                case VAL_NUMBER:
-                    if (AS_NUMBER(candidate) == AS_NUMBER(*key))
-                        return &entry->key;
-                    break;
-
-                case VAL_OBJ:
-                    if (OBJ_TYPE(candidate) == OBJ_STRING &&
-                        OBJ_TYPE(*key) == OBJ_STRING)
+                    ObjString *candStr = AS_STRING(candidate);
+                    ObjString *keyStr = AS_STRING(*key);
+                    if (candStr->length == keyStr->length &&
+                        stringHash(candStr) == stringHash(keyStr))
                     {
-                        ObjString *candStr = AS_STRING(candidate);
-                        ObjString *keyStr = AS_STRING(*key);
-                        if (candStr->length == keyStr->length &&
-                            candStr->hash == keyStr->hash)
-                        {
-                            if (memcmp(candStr->chars, keyStr->chars, candStr->length) == 0)
-                                return &entry->key;
-                        }
+                        if (memcmp(candStr->chars, keyStr->chars, candStr->length) == 0)
+                            return &entry->key;
                     }
-                    break;
-
-                default:
-                    break;
                 }
             }
+            else if (!IS_OBJ(candidate) && !IS_OBJ(*key) && valuesEqual(candidate, *key))
+            {
+                return &entry->key; // Numbers, bools and nil compare by value.
+            }
         }
 
         index = (index + 1) % table->capacity;
@@ -348,3 +496,25 @@ void tablePrintContent(Table *table)
         printf("\n");
     }
 }
+
+void markTable(VM *vm, Table *table)
+{
+    for (int i = 0; i < table->capacity; i++)
+    {
+        Entry *entry = &table->entries[i];
+        markValue(vm, entry->key);
+        markValue(vm, entry->value);
+    }
+}
+
+void tableRemoveWhite(Table *table)
+{
+    for (int i = 0; i < table->capacity; i++)
+    {
+        Entry *entry = &table->entries[i];
+        if (IS_OBJ(entry->key) && !AS_OBJ(entry->key)->isMarked)
+        {
+            tableDelete(table, &entry->key);
+        }
+    }
+}
@@ -10,6 +10,16 @@ typedef struct
     Value key;
     Value value;
 } Entry;
+/*
+What a table's keys can be, fixed when it's initialized. A TABLE_STRINGS table only takes interned strings, like names,
+and compares them by address. A TABLE_ANY one takes any value and compares them with valuesEqual().
+*/
+typedef enum
+{
+    TABLE_ANY,
+    TABLE_STRINGS,
+} TableKind;
+
 /*
 A Hash-Table is an array of entries.
 We track of both allocated size of the array (capacity) and the
@@ -18,6 +28,7 @@ The ratio of count to capacity is exactly the load factor of the hash table.
 */
 typedef struct
 {
+    TableKind kind;
     int count;
     int capacity;
     Value *vLast;
@@ -25,21 +36,33 @@ typedef struct
     Entry *entries;
 } Table;
 
-void initTable(Table *table);
-void freeTable(Table *table);
+void initTable(Table *table, TableKind kind);
+void freeTable(VM *vm, Table *table);
 /*
 Adds the given key/value pair to the given hash table.
 If a the key exists it get overwrited.
 The function returns true if the entry was added.
 */
-bool tableSet(Table *table, Value key, Value value);
+bool tableSet(VM *vm, Table *table, Value key, Value value);
 bool tableGet(Table *table, Value key, Value *value);
+// The hash tableGet() and tableSet() compute for a key, callers that reuse a key can compute it once.
+uint32_t hashValue(Value value);
+// Picks the seed every hash is keyed with, the first VM created does it.
+void seedHashes();
+// The hash of a string's characters, see copyString() and stringHash().
+uint32_t hashBytes(const char *chars, int length);
+bool tableGetHashed(Table *table, Value key, uint32_t hash, Value *value);
+bool tableSetHashed(VM *vm, Table *table, Value key, uint32_t hash, Value value);
 bool tableDelete(Table *table, Value *key);
-void tableAddAll(Table *from, Table *to);
+void tableAddAll(VM *vm, Table *from, Table *to);
 Value *tableFindValue(Table *table, Value *key);
 ObjString *tableFindString(Table *table, const char *chars,
                            int length, uint32_t hash);
 void tablePrintContent(Table *table);
+// Marks every key and value of the table as reachable.
+void markTable(VM *vm, Table *table);
+// Deletes the entries whose key is an object the collector didn't mark.
+void tableRemoveWhite(Table *table);
 
 /*
 You pass in a table and a key.
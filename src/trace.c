@@ -0,0 +1,1347 @@
+#include "common.h"
+
+#ifdef JIT_ENABLED
+
+#include <string.h>
+
+#include "assembler.h"
+#include "jit.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "trace.h"
+
+/*
+A recording is a list of IR instructions in SSA form, every instruction is its own result and operands refer to
+earlier ones by index (a "ref"). Results are either numbers, kept unboxed in an xmm register, or Values known when
+the trace is compiled: nil, bools and objects whose identity a guard checks.
+
+Stack slots are numbered from the root frame's slots up, inlined frames and temporaries included. The recorder keeps
+the ref each slot currently holds, so loads and stores of locals never reach memory inside the trace:
+
+  - The first read of a slot the trace didn't write yet is an IR_SLOT. It's loaded and guarded once, before the loop
+    body, into a register that stays pinned to the slot for the whole trace.
+  - Writes only change the slot's ref. At the back-edge, slots that were also read first have their new value moved
+    to the pinned register, the rest are stored back.
+  - A guard that fails leaves through a snapshot, the slot refs at the instruction that made the guard. The exit
+    stub stores them back, then traceRun() rebuilds the inlined frames and points the top one at that instruction.
+
+Globals and upvalues are read and written in memory like the interpreter does.
+*/
+
+void initTraces(VM *vm)
+{
+    vm->recorder = NULL;
+    vm->hotLoops = ALLOCATE(vm, uint16_t, HOTLOOP_SLOTS);
+    for (int i = 0; i < HOTLOOP_SLOTS; i++)
+    {
+        vm->hotLoops[i] = HOTLOOP_THRESHOLD;
+    }
+}
+
+#define TRACE_MAX_IR 512
+#define TRACE_MAX_SLOTS 512
+#define TRACE_MAX_FRAMES 8
+#define TRACE_MAX_SNAPSHOTS 256
+#define TRACE_MAX_ENTRIES 4096
+#define TRACE_MAX_SNAPSHOT_FRAMES 1024
+
+#define NO_REF -1
+
+// Registers numbers can live in, xmm0 and xmm1 are scratch.
+#define FIRST_REGISTER 2
+#define REGISTER_COUNT 14
+
+typedef enum
+{
+    IR_SLOT,        // Slot a as it was at the loop header.
+    IR_NUMBER,      // A constant number.
+    IR_VALUE,       // A constant Value that isn't a number.
+    IR_ADD,         // a + b
+    IR_SUBTRACT,    // a - b
+    IR_MULTIPLY,    // a * b
+    IR_DIVIDE,      // a / b
+    IR_NEGATE,      // -a
+    IR_GLOBAL,      // Global a, guarded to be defined.
+    IR_SET_GLOBAL,  // Global a = b, guarded to be defined.
+    IR_UPVALUE,     // Upvalue a of `closure`, guarded to be closed so it can't alias a stack slot.
+    IR_SET_UPVALUE, // Upvalue a of `closure` = b, same guard.
+    IR_GUARD        // Exits unless comparing a to b sets `condition` as it did while recording.
+} IROp;
+
+// What IR_GUARD checks after ucomisd a, b.
+typedef enum
+{
+    GUARD_ABOVE, // a > b
+    GUARD_EQUAL  // a == b, false for NaN
+} GuardCondition;
+
+typedef struct
+{
+    IROp op;
+    bool number;         // The result is a number, otherwise it's always `value`, loads guard that it is.
+    int a;
+    int b;
+    Value value;
+    ObjClosure *closure; // For upvalues, NULL for the root frame's closure which may differ between runs.
+    GuardCondition condition;
+    bool holds;          // IR_GUARD: whether the condition held while recording.
+    int snapshot;        // Exit taken by the guards of loads, stores and IR_GUARD.
+} IRIns;
+
+typedef struct
+{
+    ObjClosure *closure;
+    int base;          // Slot of the callee, the frame's slot 0.
+    uint8_t *returnIp; // Where the caller resumes.
+} InlineFrame;
+
+typedef struct
+{
+    int slot;
+    int ref;
+} SnapshotEntry;
+
+typedef struct
+{
+    uint8_t *ip; // The instruction the interpreter resumes at.
+    int top;     // Stack height.
+    int entries; // First entry, all modified slots below top.
+    int entryCount;
+    int frames;  // First inlined frame, outermost first.
+    int frameCount;
+} Snapshot;
+
+struct Trace
+{
+    Trace *next;
+    int anchor;   // Bytecode offset of the loop header.
+    int attempts; // Recordings that failed.
+    uint8_t *code;
+    size_t size;
+    Snapshot *snapshots;
+    int snapshotCount;
+    InlineFrame *frames;
+    int frameCount;
+    int maxSlots;  // Stack slots used above the root frame's slots.
+    int maxFrames; // Deepest inlining.
+    ValueArray constants; // Objects the code compares against or inlined, kept alive for it.
+};
+
+typedef int (*TraceEntry)(Value *slots, CallFrame *frame);
+
+typedef struct
+{
+    int ref;      // Current value, NO_REF while it's still what the slot held at the loop header.
+    int entryRef; // IR_SLOT of the first read, when it came before any write.
+    bool written;
+} SlotState;
+
+typedef enum
+{
+    RECORD_CONTINUE,
+    RECORD_DONE,
+    RECORD_ABORT
+} RecordStatus;
+
+struct Recorder
+{
+    VM *vm;
+    bool active;
+    ObjFunction *function;
+    int rootFrame; // Index in vm->frames.
+    int anchor;
+    int anchorTop; // Stack height at the loop header.
+    uint8_t *loop; // The OP_LOOP closing the trace.
+    IRIns ir[TRACE_MAX_IR];
+    int irCount;
+    SlotState slots[TRACE_MAX_SLOTS];
+    int top;
+    int maxSlots;
+    InlineFrame frames[TRACE_MAX_FRAMES];
+    int depth;
+    int maxFrames;
+    Snapshot snapshots[TRACE_MAX_SNAPSHOTS];
+    int snapshotCount;
+    SnapshotEntry entries[TRACE_MAX_ENTRIES];
+    int entryCount;
+    InlineFrame snapshotFrames[TRACE_MAX_SNAPSHOT_FRAMES];
+    int snapshotFrameCount;
+    ValueArray constants;
+    int recorded;   // Instructions recorded so far.
+    int snapshotAt; // Instruction that made the last snapshot.
+    bool failed;    // Set by helpers that hit something the trace can't express.
+};
+
+static Trace *findTrace(ObjFunction *function, int anchor)
+{
+    for (Trace *trace = function->traces; trace != NULL; trace = trace->next)
+    {
+        if (trace->anchor == anchor)
+            return trace;
+    }
+    return NULL;
+}
+
+static Trace *findOrAddTrace(VM *vm, ObjFunction *function, int anchor)
+{
+    Trace *trace = findTrace(function, anchor);
+    if (trace != NULL)
+        return trace;
+
+    trace = ALLOCATE(vm, Trace, 1);
+    trace->anchor = anchor;
+    trace->attempts = 0;
+    trace->code = NULL;
+    trace->size = 0;
+    trace->snapshots = NULL;
+    trace->snapshotCount = 0;
+    trace->frames = NULL;
+    trace->frameCount = 0;
+    trace->maxSlots = 0;
+    trace->maxFrames = 0;
+    initValueArray(&trace->constants);
+    trace->next = function->traces;
+    function->traces = trace;
+    return trace;
+}
+
+static bool falsey(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Same representation, which is what the guards of constant Values check.
+static bool identical(Value a, Value b)
+{
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    if (a.type != b.type)
+        return false;
+    switch (a.type)
+    {
+    case VAL_BOOL:
+        return AS_BOOL(a) == AS_BOOL(b);
+    case VAL_NIL:
+        return true;
+    case VAL_NUMBER:
+        return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+    case VAL_OBJ:
+        return AS_OBJ(a) == AS_OBJ(b);
+    }
+    return false;
+#endif
+}
+
+static Value *rootSlots(Recorder *recorder)
+{
+    return recorder->vm->frames[recorder->rootFrame].slots;
+}
+
+static int frameBase(Recorder *recorder)
+{
+    return recorder->depth == 0 ? 0 : recorder->frames[recorder->depth - 1].base;
+}
+
+static void keepConstant(Recorder *recorder, Value value)
+{
+    if (IS_OBJ(value))
+        writeValueArray(recorder->vm, &recorder->constants, value);
+}
+
+static int emitIR(Recorder *recorder, IROp op, bool number)
+{
+    if (recorder->irCount == TRACE_MAX_IR)
+    {
+        recorder->failed = true;
+        return 0;
+    }
+    IRIns *ins = &recorder->ir[recorder->irCount];
+    ins->op = op;
+    ins->number = number;
+    ins->a = NO_REF;
+    ins->b = NO_REF;
+    ins->value = NIL_VAL;
+    ins->closure = NULL;
+    ins->snapshot = 0;
+    return recorder->irCount++;
+}
+
+// Snapshot of the state before the instruction at ip, shared by all the guards it makes.
+static int snapshot(Recorder *recorder, uint8_t *ip)
+{
+    if (recorder->snapshotCount > 0 && recorder->snapshotAt == recorder->recorded)
+        return recorder->snapshotCount - 1;
+    if (recorder->snapshotCount == TRACE_MAX_SNAPSHOTS ||
+        recorder->entryCount + recorder->top > TRACE_MAX_ENTRIES ||
+        recorder->snapshotFrameCount + recorder->depth > TRACE_MAX_SNAPSHOT_FRAMES)
+    {
+        recorder->failed = true;
+        return 0;
+    }
+
+    Snapshot *snapshot = &recorder->snapshots[recorder->snapshotCount];
+    snapshot->ip = ip;
+    snapshot->top = recorder->top;
+    snapshot->entries = recorder->entryCount;
+    for (int slot = 0; slot < recorder->top; slot++)
+    {
+        if (recorder->slots[slot].ref == NO_REF)
+            continue;
+        recorder->entries[recorder->entryCount].slot = slot;
+        recorder->entries[recorder->entryCount].ref = recorder->slots[slot].ref;
+        recorder->entryCount++;
+    }
+    snapshot->entryCount = recorder->entryCount - snapshot->entries;
+    snapshot->frames = recorder->snapshotFrameCount;
+    snapshot->frameCount = recorder->depth;
+    for (int i = 0; i < recorder->depth; i++)
+    {
+        recorder->snapshotFrames[recorder->snapshotFrameCount++] = recorder->frames[i];
+    }
+    recorder->snapshotAt = recorder->recorded;
+    return recorder->snapshotCount++;
+}
+
+static void pushRef(Recorder *recorder, int ref)
+{
+    if (recorder->top == TRACE_MAX_SLOTS)
+    {
+        recorder->failed = true;
+        return;
+    }
+    recorder->slots[recorder->top].ref = ref;
+    recorder->slots[recorder->top].entryRef = NO_REF;
+    recorder->slots[recorder->top].written = true;
+    recorder->top++;
+    if (recorder->top > recorder->maxSlots)
+        recorder->maxSlots = recorder->top;
+}
+
+static int popRef(Recorder *recorder)
+{
+    return recorder->slots[--recorder->top].ref;
+}
+
+static int peekRef(Recorder *recorder, int distance)
+{
+    return recorder->slots[recorder->top - 1 - distance].ref;
+}
+
+static int constant(Recorder *recorder, Value value)
+{
+    int ref = emitIR(recorder, IS_NUMBER(value) ? IR_NUMBER : IR_VALUE, IS_NUMBER(value));
+    recorder->ir[ref].value = value;
+    keepConstant(recorder, value);
+    return ref;
+}
+
+// Makes a load of `value` a number or that exact constant.
+static void specialize(Recorder *recorder, int ref, Value value)
+{
+    recorder->ir[ref].number = IS_NUMBER(value);
+    if (!IS_NUMBER(value))
+    {
+        recorder->ir[ref].value = value;
+        keepConstant(recorder, value);
+    }
+}
+
+static int readSlot(Recorder *recorder, int slot)
+{
+    if (recorder->slots[slot].ref != NO_REF)
+        return recorder->slots[slot].ref;
+    // Anything above the header's stack height was pushed by the trace itself.
+    if (slot >= recorder->anchorTop)
+    {
+        recorder->failed = true;
+        return 0;
+    }
+
+    int ref = emitIR(recorder, IR_SLOT, false);
+    recorder->ir[ref].a = slot;
+    specialize(recorder, ref, rootSlots(recorder)[slot]);
+    recorder->slots[slot].ref = ref;
+    recorder->slots[slot].entryRef = ref;
+    return ref;
+}
+
+static void writeSlot(Recorder *recorder, int slot, int ref)
+{
+    recorder->slots[slot].ref = ref;
+    recorder->slots[slot].written = true;
+}
+
+static bool isNumber(Recorder *recorder, int ref)
+{
+    return recorder->ir[ref].number;
+}
+
+static Value constantOf(Recorder *recorder, int ref)
+{
+    return recorder->ir[ref].value;
+}
+
+static void arithmetic(Recorder *recorder, IROp op)
+{
+    int b = popRef(recorder);
+    int a = popRef(recorder);
+    if (!isNumber(recorder, a) || !isNumber(recorder, b))
+    {
+        recorder->failed = true;
+        return;
+    }
+    int ref = emitIR(recorder, op, true);
+    recorder->ir[ref].a = a;
+    recorder->ir[ref].b = b;
+    pushRef(recorder, ref);
+}
+
+static void guard(Recorder *recorder, uint8_t *ip, int a, int b, GuardCondition condition, bool holds)
+{
+    int ref = emitIR(recorder, IR_GUARD, false);
+    recorder->ir[ref].a = a;
+    recorder->ir[ref].b = b;
+    recorder->ir[ref].condition = condition;
+    recorder->ir[ref].holds = holds;
+    recorder->ir[ref].snapshot = snapshot(recorder, ip);
+}
+
+/*
+Records a comparison of the two values on top of the stack and returns its outcome, which the guards make a
+constant for the rest of the trace. LESS_EQUAL and GREATER_EQUAL are negations, like in the interpreter.
+*/
+static bool compare(Recorder *recorder, uint8_t *ip, OpCode op)
+{
+    int b = peekRef(recorder, 0);
+    int a = peekRef(recorder, 1);
+    Value bValue = recorder->vm->stackTop[-1];
+    Value aValue = recorder->vm->stackTop[-2];
+
+    if (op == OP_EQUAL || op == OP_NOT_EQUAL)
+    {
+        bool equal;
+        if (isNumber(recorder, a) && isNumber(recorder, b))
+        {
+            equal = AS_NUMBER(aValue) == AS_NUMBER(bValue);
+            guard(recorder, ip, a, b, GUARD_EQUAL, equal);
+        }
+        else if (IS_ROPE(aValue) || IS_ROPE(bValue))
+        {
+            // The interpreter flattens it first, which the trace has no instruction for.
+            recorder->failed = true;
+            return false;
+        }
+        else
+        {
+            // A number never equals anything else, two constants are what they are.
+            equal = !isNumber(recorder, a) && !isNumber(recorder, b) && valuesEqual(constantOf(recorder, a), constantOf(recorder, b));
+        }
+        return op == OP_EQUAL ? equal : !equal;
+    }
+
+    if (!isNumber(recorder, a) || !isNumber(recorder, b))
+    {
+        recorder->failed = true;
+        return false;
+    }
+    double x = AS_NUMBER(aValue);
+    double y = AS_NUMBER(bValue);
+    switch (op)
+    {
+    case OP_LESS:
+        guard(recorder, ip, b, a, GUARD_ABOVE, x < y);
+        return x < y;
+    case OP_GREATER:
+        guard(recorder, ip, a, b, GUARD_ABOVE, x > y);
+        return x > y;
+    case OP_LESS_EQUAL:
+        guard(recorder, ip, a, b, GUARD_ABOVE, x > y);
+        return !(x > y);
+    case OP_GREATER_EQUAL:
+        guard(recorder, ip, b, a, GUARD_ABOVE, x < y);
+        return !(x < y);
+    default:
+        recorder->failed = true;
+        return false;
+    }
+}
+
+static void pushComparison(Recorder *recorder, uint8_t *ip, OpCode op)
+{
+    bool result = compare(recorder, ip, op);
+    popRef(recorder);
+    popRef(recorder);
+    pushRef(recorder, constant(recorder, BOOL_VAL(result)));
+}
+
+static void compareJump(Recorder *recorder, uint8_t *ip, OpCode op)
+{
+    compare(recorder, ip, op);
+    popRef(recorder);
+    popRef(recorder);
+}
+
+// Loads a global or upvalue, specialized on what it holds now.
+static void load(Recorder *recorder, IROp op, int a, ObjClosure *closure, Value value, uint8_t *ip)
+{
+    int ref = emitIR(recorder, op, false);
+    recorder->ir[ref].a = a;
+    recorder->ir[ref].closure = closure;
+    recorder->ir[ref].snapshot = snapshot(recorder, ip);
+    specialize(recorder, ref, value);
+    pushRef(recorder, ref);
+}
+
+static void store(Recorder *recorder, IROp op, int a, ObjClosure *closure, uint8_t *ip)
+{
+    int ref = emitIR(recorder, op, false);
+    recorder->ir[ref].a = a;
+    recorder->ir[ref].b = peekRef(recorder, 0);
+    recorder->ir[ref].closure = closure;
+    recorder->ir[ref].snapshot = snapshot(recorder, ip);
+}
+
+// The upvalue, when it's closed. An open one points into the stack, where the trace keeps values in registers.
+static ObjUpvalue *closedUpvalue(Recorder *recorder, CallFrame *frame, int index)
+{
+    ObjUpvalue *upvalue = frame->closure->upvalues[index];
+    if (upvalue->location != &upvalue->closed)
+    {
+        recorder->failed = true;
+        return NULL;
+    }
+    return upvalue;
+}
+
+static void call(Recorder *recorder, uint8_t *ip, int argCount)
+{
+    int callee = peekRef(recorder, argCount);
+    if (isNumber(recorder, callee) || !IS_OBJ(constantOf(recorder, callee)) || !IS_CLOSURE(constantOf(recorder, callee)) ||
+        recorder->depth == TRACE_MAX_FRAMES)
+    {
+        recorder->failed = true;
+        return;
+    }
+    ObjClosure *closure = AS_CLOSURE(constantOf(recorder, callee));
+    if (closure->function->arity != argCount)
+    {
+        recorder->failed = true;
+        return;
+    }
+
+    InlineFrame *frame = &recorder->frames[recorder->depth++];
+    frame->closure = closure;
+    frame->base = recorder->top - argCount - 1;
+    frame->returnIp = ip + 2;
+    if (recorder->depth > recorder->maxFrames)
+        recorder->maxFrames = recorder->depth;
+    if (frame->base + closure->function->maxStackDepth > recorder->maxSlots)
+        recorder->maxSlots = frame->base + closure->function->maxStackDepth;
+}
+
+static void returnFromCall(Recorder *recorder)
+{
+    if (recorder->depth == 0)
+    {
+        recorder->failed = true;
+        return;
+    }
+    int result = popRef(recorder);
+    recorder->top = recorder->frames[--recorder->depth].base;
+    pushRef(recorder, result);
+}
+
+static uint16_t readShort(uint8_t *ip)
+{
+    return (uint16_t)((ip[0] << 8) | ip[1]);
+}
+
+static RecordStatus recordInstruction(Recorder *recorder, CallFrame *frame)
+{
+    Chunk *chunk = &frame->closure->function->chunk;
+    uint8_t *ip = frame->ip;
+    recorder->recorded++;
+
+    // The interpreter is the reference, the recording has to agree with it about where it is.
+    if (recorder->vm->frameCount - 1 != recorder->rootFrame + recorder->depth || recorder->vm->stackTop - rootSlots(recorder) != recorder->top)
+        return RECORD_ABORT;
+
+    switch (*ip)
+    {
+    case OP_CONSTANT:
+        pushRef(recorder, constant(recorder, chunk->constants.values[ip[1]]));
+        break;
+    case OP_CONSTANT_LONG:
+        pushRef(recorder, constant(recorder, chunk->constants.values[(ip[1] << 16) | readShort(ip + 2)]));
+        break;
+    case OP_NIL:
+        pushRef(recorder, constant(recorder, NIL_VAL));
+        break;
+    case OP_TRUE:
+        pushRef(recorder, constant(recorder, BOOL_VAL(true)));
+        break;
+    case OP_FALSE:
+        pushRef(recorder, constant(recorder, BOOL_VAL(false)));
+        break;
+    case OP_POP:
+        popRef(recorder);
+        break;
+
+    case OP_GET_LOCAL:
+        pushRef(recorder, readSlot(recorder, frameBase(recorder) + ip[1]));
+        break;
+    case OP_SET_LOCAL:
+        writeSlot(recorder, frameBase(recorder) + ip[1], peekRef(recorder, 0));
+        break;
+    case OP_GET_GLOBAL:
+    {
+        GlobalSlot *global = &recorder->vm->globalSlots[readShort(ip + 1)];
+        if (!global->defined)
+            return RECORD_ABORT;
+        load(recorder, IR_GLOBAL, readShort(ip + 1), NULL, global->value, ip);
+        break;
+    }
+    case OP_SET_GLOBAL:
+        if (!recorder->vm->globalSlots[readShort(ip + 1)].defined)
+            return RECORD_ABORT;
+        store(recorder, IR_SET_GLOBAL, readShort(ip + 1), NULL, ip);
+        break;
+    case OP_GET_UPVALUE:
+    {
+        ObjUpvalue *upvalue = closedUpvalue(recorder, frame, ip[1]);
+        if (upvalue != NULL)
+            load(recorder, IR_UPVALUE, ip[1], recorder->depth == 0 ? NULL : frame->closure, upvalue->closed, ip);
+        break;
+    }
+    case OP_SET_UPVALUE:
+        if (closedUpvalue(recorder, frame, ip[1]) != NULL)
+            store(recorder, IR_SET_UPVALUE, ip[1], recorder->depth == 0 ? NULL : frame->closure, ip);
+        break;
+
+    case OP_ADD:
+    case OP_ADD_NUM:
+        arithmetic(recorder, IR_ADD);
+        break;
+    case OP_SUBTRACT:
+        arithmetic(recorder, IR_SUBTRACT);
+        break;
+    case OP_MULTIPLY:
+        arithmetic(recorder, IR_MULTIPLY);
+        break;
+    case OP_DIVIDE:
+        arithmetic(recorder, IR_DIVIDE);
+        break;
+    case OP_GET_LOCAL_GET_LOCAL_ADD:
+        pushRef(recorder, readSlot(recorder, frameBase(recorder) + ip[1]));
+        pushRef(recorder, readSlot(recorder, frameBase(recorder) + ip[2]));
+        arithmetic(recorder, IR_ADD);
+        break;
+    case OP_NEGATE:
+    {
+        int a = popRef(recorder);
+        if (!isNumber(recorder, a))
+            return RECORD_ABORT;
+        int ref = emitIR(recorder, IR_NEGATE, true);
+        recorder->ir[ref].a = a;
+        pushRef(recorder, ref);
+        break;
+    }
+    case OP_NOT:
+    {
+        int a = popRef(recorder);
+        pushRef(recorder, constant(recorder, BOOL_VAL(!isNumber(recorder, a) && falsey(constantOf(recorder, a)))));
+        break;
+    }
+
+    case OP_EQUAL_NUM:
+        // Not numbers, the interpreter deoptimizes and dispatches it again.
+        if (!isNumber(recorder, peekRef(recorder, 0)) || !isNumber(recorder, peekRef(recorder, 1)))
+            return RECORD_ABORT;
+        pushComparison(recorder, ip, OP_EQUAL);
+        break;
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_LESS:
+    case OP_GREATER:
+    case OP_LESS_EQUAL:
+    case OP_GREATER_EQUAL:
+        pushComparison(recorder, ip, *ip);
+        break;
+    case OP_LESS_JUMP_IF_FALSE:
+        compareJump(recorder, ip, OP_LESS);
+        break;
+    case OP_GREATER_JUMP_IF_FALSE:
+        compareJump(recorder, ip, OP_GREATER);
+        break;
+    case OP_EQUAL_JUMP_IF_FALSE:
+        compareJump(recorder, ip, OP_EQUAL);
+        break;
+
+    // The condition is a number or a constant by now, the branch the interpreter takes is the only one there is.
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+        break;
+    case OP_POP_JUMP_IF_FALSE:
+        popRef(recorder);
+        break;
+    case OP_LOOP:
+        if (recorder->depth == 0 && jumpTarget(chunk, (int)(ip - chunk->code)) == recorder->anchor &&
+            recorder->top == recorder->anchorTop)
+            return RECORD_DONE;
+        return RECORD_ABORT;
+
+    case OP_CALL:
+        call(recorder, ip, ip[1]);
+        break;
+    case OP_RETURN:
+        returnFromCall(recorder);
+        break;
+
+    default:
+        return RECORD_ABORT;
+    }
+    return recorder->failed ? RECORD_ABORT : RECORD_CONTINUE;
+}
+
+// Code generation.
+
+typedef struct
+{
+    Recorder *recorder;
+    Assembler as;
+    PatchList exits;  // Jumps to the exit stub of a snapshot.
+    int reg[TRACE_MAX_IR];  // Kept after the register is released, the exit stubs are generated last.
+    bool held[TRACE_MAX_IR];
+    int lastUse[TRACE_MAX_IR];
+    bool used[REGISTER_COUNT];
+    bool failed;      // Ran out of registers.
+} Compiler;
+
+#define FRAME_CLOSURE ((int)offsetof(CallFrame, closure))
+
+static void exitIf(Compiler *c, int jump, int snapshot)
+{
+    if (jump != -1)
+        writePatchList(&c->exits, jump, snapshot);
+}
+
+static int allocate(Compiler *c, int ref)
+{
+    for (int i = 0; i < REGISTER_COUNT; i++)
+    {
+        if (!c->used[i])
+        {
+            c->used[i] = true;
+            c->reg[ref] = FIRST_REGISTER + i;
+            c->held[ref] = true;
+            return c->reg[ref];
+        }
+    }
+    c->failed = true;
+    c->reg[ref] = FIRST_REGISTER;
+    return FIRST_REGISTER;
+}
+
+static void release(Compiler *c, int ref)
+{
+    if (c->held[ref])
+    {
+        c->used[c->reg[ref] - FIRST_REGISTER] = false;
+        c->held[ref] = false;
+    }
+}
+
+static bool hasSnapshot(IRIns *ins)
+{
+    return ins->op == IR_GLOBAL || ins->op == IR_SET_GLOBAL || ins->op == IR_UPVALUE ||
+           ins->op == IR_SET_UPVALUE || ins->op == IR_GUARD;
+}
+
+static void use(Compiler *c, int ref, int at)
+{
+    if (ref != NO_REF && c->lastUse[ref] < at)
+        c->lastUse[ref] = at;
+}
+
+// A ref lives until its last use, snapshots count, and values the back-edge needs live to the end.
+static void computeLastUses(Compiler *c)
+{
+    int end = c->recorder->irCount;
+    for (int i = 0; i < c->recorder->irCount; i++)
+    {
+        c->lastUse[i] = c->recorder->ir[i].op == IR_SLOT ? end : -1;
+        c->reg[i] = -1;
+        c->held[i] = false;
+    }
+    for (int i = 0; i < c->recorder->irCount; i++)
+    {
+        IRIns *ins = &c->recorder->ir[i];
+        switch (ins->op)
+        {
+        case IR_ADD:
+        case IR_SUBTRACT:
+        case IR_MULTIPLY:
+        case IR_DIVIDE:
+        case IR_GUARD:
+            use(c, ins->a, i);
+            use(c, ins->b, i);
+            break;
+        case IR_NEGATE:
+            use(c, ins->a, i);
+            break;
+        case IR_SET_GLOBAL:
+        case IR_SET_UPVALUE:
+            use(c, ins->b, i);
+            break;
+        default:
+            break;
+        }
+        if (hasSnapshot(ins))
+        {
+            Snapshot *snapshot = &c->recorder->snapshots[ins->snapshot];
+            for (int e = 0; e < snapshot->entryCount; e++)
+            {
+                use(c, c->recorder->entries[snapshot->entries + e].ref, i);
+            }
+        }
+    }
+    for (int slot = 0; slot < c->recorder->anchorTop; slot++)
+    {
+        if (c->recorder->slots[slot].written)
+            use(c, c->recorder->slots[slot].ref, end);
+    }
+}
+
+// Loads a Value from [base + disp]: a number into a new register or a guard that it's the constant.
+static void loadValue(Compiler *c, int ref, int base, int32_t disp, int exit)
+{
+    IRIns *ins = &c->recorder->ir[ref];
+    if (ins->number)
+    {
+        exitIf(c, asmJumpIfNotNumber(&c->as, base, disp), exit);
+        asmLoadDouble(&c->as, allocate(c, ref), base, disp + NUMBER_OFFSET);
+    }
+    else
+    {
+        int jumps[2];
+        asmJumpIfNotValue(&c->as, base, disp, ins->value, jumps);
+        exitIf(c, jumps[0], exit);
+        exitIf(c, jumps[1], exit);
+    }
+}
+
+static void storeRef(Compiler *c, int base, int32_t disp, int ref)
+{
+    if (c->recorder->ir[ref].number)
+        asmStoreNumber(&c->as, base, disp, c->reg[ref]);
+    else
+        asmStoreValue(&c->as, base, disp, c->recorder->ir[ref].value);
+}
+
+// Points rdx at the upvalue's value, exiting when it's open.
+static void locateUpvalue(Compiler *c, IRIns *ins)
+{
+    Assembler *as = &c->as;
+    if (ins->closure != NULL)
+        asmMoveImmediate(as, RAX, (uint64_t)(uintptr_t)ins->closure);
+    else
+        asmLoad(as, RAX, R12, FRAME_CLOSURE);
+    asmLoad(as, RAX, RAX, (int32_t)offsetof(ObjClosure, upvalues));
+    asmLoad(as, RAX, RAX, ins->a * (int32_t)sizeof(ObjUpvalue *));
+    asmLoad(as, RDX, RAX, (int32_t)offsetof(ObjUpvalue, location));
+    asmAddImmediate(as, RAX, (int32_t)offsetof(ObjUpvalue, closed));
+    asmRegisterOp(as, ASM_CMP, RDX, RAX);
+    exitIf(c, asmJumpIf(as, CC_NE), ins->snapshot);
+}
+
+static int32_t globalOffset(int index)
+{
+    return index * (int32_t)sizeof(GlobalSlot);
+}
+
+static void checkDefined(Compiler *c, IRIns *ins)
+{
+    asmCompareByte(&c->as, R15, globalOffset(ins->a) + (int32_t)offsetof(GlobalSlot, defined), 0);
+    exitIf(c, asmJumpIf(&c->as, CC_E), ins->snapshot);
+}
+
+static void binary(Compiler *c, int ref, uint8_t opcode)
+{
+    IRIns *ins = &c->recorder->ir[ref];
+    int a = c->reg[ins->a];
+    int b = c->reg[ins->b];
+    // Only a may give its register to the result, b is still read after the move.
+    if (c->lastUse[ins->a] == ref && c->recorder->ir[ins->a].op != IR_SLOT)
+        release(c, ins->a);
+    int dst = allocate(c, ref);
+    if (dst != a)
+        asmMoveDouble(&c->as, dst, a);
+    asmSseOp(&c->as, 0xf2, opcode, dst, b);
+}
+
+static void compileGuard(Compiler *c, IRIns *ins)
+{
+    Assembler *as = &c->as;
+    asmCompareDoubles(as, c->reg[ins->a], c->reg[ins->b]);
+    if (ins->condition == GUARD_ABOVE)
+    {
+        exitIf(c, asmJumpIf(as, ins->holds ? CC_BE : CC_A), ins->snapshot);
+    }
+    else if (ins->holds)
+    {
+        exitIf(c, asmJumpIf(as, CC_NE), ins->snapshot);
+        exitIf(c, asmJumpIf(as, CC_P), ins->snapshot);
+    }
+    else
+    {
+        int unordered = asmJumpIf(as, CC_P);
+        exitIf(c, asmJumpIf(as, CC_E), ins->snapshot);
+        asmLand(as, unordered);
+    }
+}
+
+static void compileIns(Compiler *c, int ref)
+{
+    Assembler *as = &c->as;
+    IRIns *ins = &c->recorder->ir[ref];
+    switch (ins->op)
+    {
+    case IR_SLOT:
+    case IR_VALUE:
+        break;
+    case IR_NUMBER:
+    {
+        uint64_t bits;
+        double number = AS_NUMBER(ins->value);
+        memcpy(&bits, &number, sizeof(bits));
+        asmMoveImmediate(as, RAX, bits);
+        asmMoveToDouble(as, allocate(c, ref), RAX);
+        break;
+    }
+    case IR_ADD:
+        binary(c, ref, ASM_ADDSD);
+        break;
+    case IR_SUBTRACT:
+        binary(c, ref, ASM_SUBSD);
+        break;
+    case IR_MULTIPLY:
+        binary(c, ref, ASM_MULSD);
+        break;
+    case IR_DIVIDE:
+        binary(c, ref, ASM_DIVSD);
+        break;
+    case IR_NEGATE:
+    {
+        int a = c->reg[ins->a];
+        if (c->lastUse[ins->a] == ref && c->recorder->ir[ins->a].op != IR_SLOT)
+            release(c, ins->a);
+        int dst = allocate(c, ref);
+        if (dst != a)
+            asmMoveDouble(as, dst, a);
+        asmMoveImmediate(as, RAX, (uint64_t)1 << 63);
+        asmMoveToDouble(as, 0, RAX);
+        asmSseOp(as, 0x66, 0x57, dst, 0); // xorpd
+        break;
+    }
+    case IR_GLOBAL:
+        checkDefined(c, ins);
+        loadValue(c, ref, R15, globalOffset(ins->a) + (int32_t)offsetof(GlobalSlot, value), ins->snapshot);
+        break;
+    case IR_SET_GLOBAL:
+        checkDefined(c, ins);
+        storeRef(c, R15, globalOffset(ins->a) + (int32_t)offsetof(GlobalSlot, value), ins->b);
+        break;
+    case IR_UPVALUE:
+        locateUpvalue(c, ins);
+        loadValue(c, ref, RDX, 0, ins->snapshot);
+        break;
+    case IR_SET_UPVALUE:
+        locateUpvalue(c, ins);
+        storeRef(c, RDX, 0, ins->b);
+        break;
+    case IR_GUARD:
+        compileGuard(c, ins);
+        break;
+    }
+}
+
+// Frees the registers of refs that are dead after instruction `at`. IR_SLOTs stay pinned.
+static void releaseDead(Compiler *c, int at)
+{
+    for (int ref = 0; ref <= at; ref++)
+    {
+        if (c->held[ref] && c->lastUse[ref] <= at && c->recorder->ir[ref].op != IR_SLOT)
+            release(c, ref);
+    }
+}
+
+/*
+The back-edge. Slots that are only written go back to memory, slots that were read first get their new value in
+the IR_SLOT's register. Those moves happen at once: a value that sits in another pinned register could be
+overwritten before it's read, so those go through the red zone below rsp.
+*/
+static void compileBackEdge(Compiler *c)
+{
+    Assembler *as = &c->as;
+
+    for (int slot = 0; slot < c->recorder->anchorTop; slot++)
+    {
+        SlotState *state = &c->recorder->slots[slot];
+        if (state->written && state->entryRef == NO_REF)
+            storeRef(c, RBX, slot * VALUE_SIZE, state->ref);
+    }
+
+    for (int pass = 0; pass < 3; pass++)
+    {
+        int spill = 0;
+        for (int slot = 0; slot < c->recorder->anchorTop; slot++)
+        {
+            SlotState *state = &c->recorder->slots[slot];
+            if (!state->written || state->entryRef == NO_REF || state->ref == state->entryRef ||
+                !c->recorder->ir[state->ref].number)
+                continue;
+            bool pinned = c->recorder->ir[state->ref].op == IR_SLOT;
+            int dst = c->reg[state->entryRef];
+            int src = c->reg[state->ref];
+            if (pass == 0 && pinned)
+                asmStoreDouble(as, RSP, -8 * ++spill, src);
+            else if (pass == 1 && !pinned)
+                asmMoveDouble(as, dst, src);
+            else if (pass == 2 && pinned)
+                asmLoadDouble(as, dst, RSP, -8 * ++spill);
+        }
+    }
+}
+
+static void freeCompiler(Compiler *c)
+{
+    freeAssembler(&c->as);
+    freePatchList(&c->exits);
+}
+
+static bool covers(Recorder *recorder, Snapshot *snapshot, int slot)
+{
+    for (int e = 0; e < snapshot->entryCount; e++)
+    {
+        if (recorder->entries[snapshot->entries + e].slot == slot)
+            return true;
+    }
+    return false;
+}
+
+// The red zone holds 16 doubles.
+#define MAX_SPILLS 16
+
+static bool compileTrace(Recorder *recorder, Trace *trace)
+{
+    Compiler c;
+    c.recorder = recorder;
+    initAssembler(recorder->vm, &c.as);
+    initPatchList(recorder->vm, &c.exits);
+    for (int i = 0; i < REGISTER_COUNT; i++)
+    {
+        c.used[i] = false;
+    }
+    c.failed = false;
+    computeLastUses(&c);
+    Assembler *as = &c.as;
+
+    int spills = 0;
+    for (int slot = 0; slot < recorder->anchorTop; slot++)
+    {
+        SlotState *state = &recorder->slots[slot];
+        if (state->written && state->entryRef != NO_REF && state->ref != state->entryRef &&
+            recorder->ir[state->ref].op == IR_SLOT)
+            spills++;
+    }
+    if (spills > MAX_SPILLS)
+    {
+        freeCompiler(&c);
+        return false;
+    }
+
+    // rbx holds the root frame's slots, r12 the root frame and r15 the global slots.
+    asmPush(as, RBX);
+    asmPush(as, R12);
+    asmPush(as, R15);
+    asmRegisterOp(as, ASM_MOV, RBX, RDI);
+    asmRegisterOp(as, ASM_MOV, R12, RSI);
+    asmMoveImmediate(as, RAX, (uint64_t)(uintptr_t)&recorder->vm->globalSlots);
+    asmLoad(as, R15, RAX, 0);
+
+    // Before the loop: load and guard every slot read before it's written.
+    for (int ref = 0; ref < recorder->irCount; ref++)
+    {
+        if (recorder->ir[ref].op == IR_SLOT)
+            loadValue(&c, ref, RBX, recorder->ir[ref].a * VALUE_SIZE, 0);
+    }
+
+    int loop = as->count;
+    for (int ref = 0; ref < recorder->irCount; ref++)
+    {
+        compileIns(&c, ref);
+        releaseDead(&c, ref);
+    }
+    compileBackEdge(&c);
+    asmPatchRel32(as, asmJump(as), loop);
+
+    int epilogue = as->count;
+    asmPop(as, R15);
+    asmPop(as, R12);
+    asmPop(as, RBX);
+    asmByte(as, 0xc3); // ret
+
+    /*
+    One stub per snapshot, storing the slots it changed. Refs keep their register for their whole life and
+    snapshots count as uses, so each of them is still in its register whichever guard jumps here.
+    Slots the trace writes but carries in a pinned register are only stored here: the ones this snapshot doesn't
+    cover yet still hold their value from the loop header, in the IR_SLOT's register. Snapshot 0 leaves before the
+    loop, when memory is still all right.
+    */
+    int *stubs = ALLOCATE(recorder->vm, int, recorder->snapshotCount);
+    for (int i = 0; i < recorder->snapshotCount; i++)
+    {
+        stubs[i] = -1;
+    }
+    for (int i = 0; i < c.exits.count; i++)
+    {
+        int index = c.exits.patches[i].target;
+        if (stubs[index] == -1)
+        {
+            stubs[index] = as->count;
+            Snapshot *snapshot = &recorder->snapshots[index];
+            for (int slot = 0; index > 0 && slot < recorder->anchorTop; slot++)
+            {
+                SlotState *state = &recorder->slots[slot];
+                if (state->written && state->entryRef != NO_REF && !covers(recorder, snapshot, slot))
+                    storeRef(&c, RBX, slot * VALUE_SIZE, state->entryRef);
+            }
+            for (int e = 0; e < snapshot->entryCount; e++)
+            {
+                SnapshotEntry *entry = &recorder->entries[snapshot->entries + e];
+                IRIns *ins = &recorder->ir[entry->ref];
+                if (ins->op == IR_SLOT && ins->a == entry->slot && !recorder->slots[entry->slot].written)
+                    continue;
+                storeRef(&c, RBX, entry->slot * VALUE_SIZE, entry->ref);
+            }
+            asmByte(as, 0xb8); // mov eax, index
+            asm32(as, (uint32_t)index);
+            asmPatchRel32(as, asmJump(as), epilogue);
+        }
+        asmPatchRel32(as, c.exits.patches[i].at, stubs[index]);
+    }
+    FREE_ARRAY(recorder->vm, int, stubs, recorder->snapshotCount);
+
+    if (c.failed)
+    {
+        freeCompiler(&c);
+        return false;
+    }
+    uint8_t *code = asmFinish(as);
+    if (code == NULL)
+    {
+        freeCompiler(&c);
+        return false;
+    }
+
+    trace->code = code;
+    trace->size = as->count;
+    trace->snapshots = ALLOCATE(recorder->vm, Snapshot, recorder->snapshotCount);
+    memcpy(trace->snapshots, recorder->snapshots, sizeof(Snapshot) * recorder->snapshotCount);
+    trace->snapshotCount = recorder->snapshotCount;
+    trace->frames = ALLOCATE(recorder->vm, InlineFrame, recorder->snapshotFrameCount);
+    if (recorder->snapshotFrameCount > 0)
+        memcpy(trace->frames, recorder->snapshotFrames, sizeof(InlineFrame) * recorder->snapshotFrameCount);
+    trace->frameCount = recorder->snapshotFrameCount;
+    trace->maxSlots = recorder->maxSlots;
+    trace->maxFrames = recorder->maxFrames;
+    for (int i = 0; i < recorder->constants.count; i++)
+    {
+        writeValueArray(recorder->vm, &trace->constants, recorder->constants.values[i]);
+    }
+    freeCompiler(&c);
+    return true;
+}
+
+// A loop only closes into a trace if every slot it carries keeps its type from one iteration to the next.
+static bool stable(Recorder *recorder)
+{
+    for (int slot = 0; slot < recorder->anchorTop; slot++)
+    {
+        SlotState *state = &recorder->slots[slot];
+        if (!state->written || state->entryRef == NO_REF)
+            continue;
+        IRIns *entry = &recorder->ir[state->entryRef];
+        IRIns *exit = &recorder->ir[state->ref];
+        if (entry->number != exit->number || (!entry->number && !identical(entry->value, exit->value)))
+            return false;
+    }
+    return true;
+}
+
+// The recorder stays a root until the trace owns its constants.
+static void finishRecording(Recorder *recorder, RecordStatus status)
+{
+    Trace *trace = findOrAddTrace(recorder->vm, recorder->function, recorder->anchor);
+    if (status == RECORD_DONE && stable(recorder) && compileTrace(recorder, trace))
+    {
+        // From now on the back-edge enters the trace. Machine code for the function gets translated again, with
+        // the back-edge leaving for the interpreter.
+        *recorder->loop = OP_LOOP_TRACE;
+        if (recorder->function->jit != NULL)
+        {
+            jitFree(recorder->vm, recorder->function->jit);
+            recorder->function->jit = NULL;
+        }
+    }
+    else
+    {
+        trace->attempts++;
+    }
+    recorder->active = false;
+    freeValueArray(recorder->vm, &recorder->constants);
+}
+
+bool traceStart(VM *vm, CallFrame *frame, uint8_t *loop)
+{
+    ObjFunction *function = frame->closure->function;
+    int anchor = (int)(frame->ip - function->chunk.code);
+    Trace *trace = findTrace(function, anchor);
+    int top = (int)(vm->stackTop - frame->slots);
+    if ((trace != NULL && (trace->code != NULL || trace->attempts >= TRACE_MAX_ATTEMPTS)) || top > TRACE_MAX_SLOTS)
+        return false;
+
+    Recorder *recorder = vm->recorder;
+    if (recorder == NULL)
+    {
+        recorder = ALLOCATE(vm, Recorder, 1);
+        recorder->vm = vm;
+        recorder->active = false;
+        vm->recorder = recorder;
+    }
+    // A recording cut short by a runtime error is dropped here.
+    if (recorder->active)
+        freeValueArray(vm, &recorder->constants);
+    recorder->active = true;
+    recorder->function = function;
+    recorder->rootFrame = (int)(frame - vm->frames);
+    recorder->anchor = anchor;
+    recorder->anchorTop = top;
+    recorder->loop = loop;
+    recorder->irCount = 0;
+    recorder->top = top;
+    recorder->maxSlots = top;
+    recorder->depth = 0;
+    recorder->maxFrames = 0;
+    recorder->snapshotCount = 0;
+    recorder->entryCount = 0;
+    recorder->snapshotFrameCount = 0;
+    recorder->recorded = 0;
+    recorder->failed = false;
+    initValueArray(&recorder->constants);
+    for (int slot = 0; slot < top; slot++)
+    {
+        recorder->slots[slot].ref = NO_REF;
+        recorder->slots[slot].entryRef = NO_REF;
+        recorder->slots[slot].written = false;
+    }
+    // Snapshot 0 is the loop header, where guards on the slots loaded before the loop leave.
+    snapshot(recorder, frame->ip);
+    return true;
+}
+
+bool traceRecord(VM *vm, CallFrame *frame)
+{
+    Recorder *recorder = vm->recorder;
+    if (recorder == NULL || !recorder->active)
+        return false;
+    RecordStatus status = recordInstruction(recorder, frame);
+    if (status == RECORD_CONTINUE)
+        return true;
+    finishRecording(recorder, status);
+    return false;
+}
+
+void traceRun(VM *vm, CallFrame *frame)
+{
+    ObjFunction *function = frame->closure->function;
+    Trace *trace = findTrace(function, (int)(frame->ip - function->chunk.code));
+    if (trace == NULL || trace->code == NULL)
+        return;
+    // Exits rebuild inlined frames without growing anything.
+    if (vm->frameCount + trace->maxFrames > vm->frameCapacity ||
+        (int)(frame->slots - vm->stack) + trace->maxSlots + STACK_HEADROOM > vm->stackCapacity)
+        return;
+
+    TraceEntry entry;
+    memcpy(&entry, &trace->code, sizeof(entry));
+    Snapshot *snapshot = &trace->snapshots[entry(frame->slots, frame)];
+
+    CallFrame *caller = frame;
+    for (int i = 0; i < snapshot->frameCount; i++)
+    {
+        InlineFrame *inlined = &trace->frames[snapshot->frames + i];
+        caller->ip = inlined->returnIp;
+        CallFrame *callee = &vm->frames[vm->frameCount++];
+        callee->closure = inlined->closure;
+        callee->slots = frame->slots + inlined->base;
+        caller = callee;
+    }
+    caller->ip = snapshot->ip;
+    vm->stackTop = frame->slots + snapshot->top;
+}
+
+void markTraces(VM *vm, ObjFunction *function)
+{
+    for (Trace *trace = function->traces; trace != NULL; trace = trace->next)
+    {
+        for (int i = 0; i < trace->constants.count; i++)
+        {
+            markValue(vm, trace->constants.values[i]);
+        }
+    }
+}
+
+void markTraceRoots(VM *vm)
+{
+    Recorder *recorder = vm->recorder;
+    if (recorder == NULL || !recorder->active)
+        return;
+    for (int i = 0; i < recorder->constants.count; i++)
+    {
+        markValue(vm, recorder->constants.values[i]);
+    }
+}
+
+void freeTraces(VM *vm, ObjFunction *function)
+{
+    Trace *trace = function->traces;
+    while (trace != NULL)
+    {
+        Trace *next = trace->next;
+        if (trace->code != NULL)
+            asmRelease(trace->code, trace->size);
+        FREE_ARRAY(vm, Snapshot, trace->snapshots, trace->snapshotCount);
+        FREE_ARRAY(vm, InlineFrame, trace->frames, trace->frameCount);
+        freeValueArray(vm, &trace->constants);
+        FREE(vm, Trace, trace);
+        trace = next;
+    }
+    function->traces = NULL;
+}
+
+void freeTraceState(VM *vm)
+{
+    if (vm->recorder != NULL)
+    {
+        if (vm->recorder->active)
+            freeValueArray(vm, &vm->recorder->constants);
+        FREE(vm, Recorder, vm->recorder);
+        vm->recorder = NULL;
+    }
+    FREE_ARRAY(vm, uint16_t, vm->hotLoops, HOTLOOP_SLOTS);
+    vm->hotLoops = NULL;
+}
+
+#endif
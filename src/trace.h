@@ -0,0 +1,53 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "object.h"
+#include "vm.h"
+
+/*
+Tracing tier for hot loops.
+Once a loop's back-edge has been taken HOTLOOP_THRESHOLD times, the interpreter records the opcodes the next
+iteration actually executes, following calls into closures, and the recording is compiled into a linear piece of
+machine code specialized on the types it saw. Numbers stay unboxed in xmm registers across iterations. Every
+assumption is a guard, when one fails the trace writes the values back, rebuilds the CallFrames it had inlined and
+returns to the interpreter at the instruction where the assumption was made.
+*/
+
+// Back-edges of a loop before the next iteration gets recorded.
+#define HOTLOOP_THRESHOLD 56
+// Recordings of one loop that may fail before the loop is left to the other tiers for good.
+#define TRACE_MAX_ATTEMPTS 4
+
+#ifdef JIT_ENABLED
+/*
+Back-edge counters in vm->hotLoops, loops share them by the address of their OP_LOOP. Both the interpreter and
+machine code count down, the interpreter starts a recording when it finds one at 1 or below.
+*/
+#define HOTLOOP_SLOTS 64
+#define HOT_LOOP_COUNTER(vm, loop) (&(vm)->hotLoops[(uintptr_t)(loop) % HOTLOOP_SLOTS])
+
+void initTraces(VM *vm);
+// Frees the counters and the recorder, the traces themselves go with their functions.
+void freeTraceState(VM *vm);
+
+/*
+Starts recording the loop the top frame just jumped back to, frame->ip at the loop header and `loop` the OP_LOOP.
+Returns false when the loop shouldn't be recorded.
+*/
+bool traceStart(VM *vm, CallFrame *frame, uint8_t *loop);
+
+/*
+Records the instruction at the top frame's ip before the interpreter runs it.
+Returns false once recording is over, because the trace got compiled or because it hit something it can't record.
+*/
+bool traceRecord(VM *vm, CallFrame *frame);
+
+// Runs the trace anchored at the top frame's ip, frame->ip and vm->stackTop point where the interpreter takes over.
+void traceRun(VM *vm, CallFrame *frame);
+
+void markTraces(VM *vm, ObjFunction *function);
+void markTraceRoots(VM *vm);
+void freeTraces(VM *vm, ObjFunction *function);
+#endif
+
+#endif
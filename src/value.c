@@ -4,13 +4,13 @@
 #include "object.h"
 #include <string.h>
 
-void writeValueArray(ValueArray *array, Value value)
+void writeValueArray(VM *vm, ValueArray *array, Value value)
 {
     if (array->capacity < array->count + 1)
     {
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+        array->values = GROW_ARRAY(vm, Value, array->values, oldCapacity, array->capacity);
     }
     array->values[array->count] = value;
     array->count++;
@@ -21,14 +21,32 @@ void initValueArray(ValueArray *array)
     array->capacity = 0;
     array->values = NULL;
 }
-void freeValueArray(ValueArray *array)
+void freeValueArray(VM *vm, ValueArray *array)
 {
-    FREE_ARRAY(uint8_t, array->values, array->capacity);
+    FREE_ARRAY(vm, Value, array->values, array->capacity);
     initValueArray(array);
 }
 
 void printValue(Value value)
 {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value))
+    {
+        printf(AS_BOOL(value) ? "TRUE" : "FALSE");
+    }
+    else if (IS_NIL(value))
+    {
+        printf("NIL");
+    }
+    else if (IS_NUMBER(value))
+    {
+        printf("%g", AS_NUMBER(value));
+    }
+    else if (IS_OBJ(value))
+    {
+        printObject(value);
+    }
+#else
     switch (value.type)
     {
     case VAL_BOOL:
@@ -52,6 +70,30 @@ void printValue(Value value)
         printf("Unknown value type: %d", value.type);
         break;
     }
+#endif
+}
+
+/*
+Strings are equal when they have the same characters, any other object only to itself.
+A flattened rope compares as its string. The VM flattens ropes before comparing them, an unflattened one is only
+equal to itself.
+*/
+static bool objectsEqual(Value a, Value b)
+{
+    if (IS_ROPE(a) && AS_ROPE(a)->flat != NULL)
+        a = OBJ_VAL(AS_ROPE(a)->flat);
+    if (IS_ROPE(b) && AS_ROPE(b)->flat != NULL)
+        b = OBJ_VAL(AS_ROPE(b)->flat);
+    if (AS_OBJ(a) == AS_OBJ(b))
+        return true;
+    if (!IS_STRING(a) || !IS_STRING(b))
+        return false;
+
+    ObjString *aString = AS_STRING(a);
+    ObjString *bString = AS_STRING(b);
+    return aString->length == bString->length &&
+           memcmp(aString->chars, bString->chars,
+                  aString->length) == 0;
 }
 
 /*
@@ -59,6 +101,14 @@ First, we check the types. If the Values have different types, they are definite
 */
 bool valuesEqual(Value a, Value b)
 {
+#ifdef NAN_BOXING
+    // Compared as doubles so NaN != NaN, every other kind is equal only to the same bits.
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    if (IS_OBJ(a) && IS_OBJ(b))
+        return objectsEqual(a, b);
+    return a == b;
+#else
     if (a.type != b.type)
         return false;
     switch (a.type)
@@ -71,23 +121,20 @@ bool valuesEqual(Value a, Value b)
     case VAL_NUMBER:
         return AS_NUMBER(a) == AS_NUMBER(b);
 
-    // If both are strings and have the same length checks the characters.
     case VAL_OBJ:
-    {
-        ObjString *aString = AS_STRING(a);
-        ObjString *bString = AS_STRING(b);
-        return aString->length == bString->length &&
-               memcmp(aString->chars, bString->chars,
-                      aString->length) == 0;
-    }
+        return objectsEqual(a, b);
 
     default:
         return false; // Unreachable.
     }
+#endif
 }
 
 bool valuesEqualPointers(Value *a, Value *b)
 {
+#ifdef NAN_BOXING
+    return valuesEqual(*a, *b);
+#else
     if (a->type != b->type)
         return false;
     switch (a->type)
@@ -100,17 +147,11 @@ bool valuesEqualPointers(Value *a, Value *b)
     case VAL_NUMBER:
         return a->as.number == b->as.number;
 
-    // If both are strings and have the same length checks the characters.
     case VAL_OBJ:
-    {
-        ObjString *aString = ((ObjString *)a->as.obj);
-        ObjString *bString = ((ObjString *)b->as.obj);
-        return aString->length == bString->length &&
-               memcmp(aString->chars, bString->chars,
-                      aString->length) == 0;
-    }
+        return objectsEqual(*a, *b);
 
     default:
         return false; // Unreachable.
     }
+#endif
 }
\ No newline at end of file
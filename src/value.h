@@ -4,7 +4,68 @@
 #include "common.h"
 
 typedef struct Obj Obj;
+// Everything that allocates takes the VM that owns the memory.
+typedef struct VM VM;
 typedef struct ObjString ObjString;
+
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+/*
+A double is a NaN when all exponent bits are set, and it's a quiet NaN when the highest mantissa bit is set too.
+Real arithmetic only ever produces one quiet NaN, so the remaining 51 mantissa bits are free to carry our own values.
+Nil and the bools use the lowest two bits as a tag, objects set the sign bit and keep their 48-bit pointer in the low bits.
+*/
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL 1   // 01.
+#define TAG_FALSE 2 // 10.
+#define TAG_TRUE 3  // 11.
+
+typedef uint64_t Value;
+
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+// Return true has the given type.
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) \
+    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+// Returns the corresponding raw C value.
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) valueToNum(value)
+#define AS_OBJ(value) \
+    ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+// Takes a C value of the appropiate type and produces the boxed Value.
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define NUMBER_VAL(num) numToValue(num)
+#define OBJ_VAL(obj) \
+    (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+// Type punning through memcpy, compilers turn it into a plain register move.
+static inline double valueToNum(Value value)
+{
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value numToValue(double num)
+{
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
+
 typedef enum
 {
     VAL_BOOL,
@@ -43,6 +104,8 @@ typedef struct
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj *)object}})
 
+#endif
+
 typedef struct
 {
     int count;
@@ -53,8 +116,8 @@ typedef struct
 bool valuesEqual(Value a, Value b);
 bool valuesEqualPointers(Value *a, Value *b);
 void initValueArray(ValueArray *valueArray);
-void freeValueArray(ValueArray *valueArray);
-void writeValueArray(ValueArray *valueArray, Value value);
+void freeValueArray(VM *vm, ValueArray *valueArray);
+void writeValueArray(VM *vm, ValueArray *valueArray, Value value);
 void printValue(Value value);
 
 #endif
\ No newline at end of file
@@ -2,30 +2,28 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "vm.h"
+#include "channel.h"
 #include "common.h"
 #include "debug.h"
 #include "memory.h"
 #include "compiler.h"
+#include "jit.h"
+#include "simd.h"
+#include "trace.h"
 #include "value.h"
 #include "table.h"
 #include <string.h>
 #include <time.h>
 
-VM vm;
-
-static void resetStack()
+// Empties the stack and the frames, the stack buffer itself is kept.
+static void resetStack(VM *vm)
 {
-    if (vm.stack != NULL)
-    {
-        free(vm.stack);
-    }
-    vm.stack = ALLOCATE(Value, vm.stackCapacity);
-    vm.stackTop = vm.stack;
-    vm.stackCount = 0;
-    vm.openUpvalues = NULL;
+    vm->stackTop = vm->stack;
+    vm->frameCount = 0;
+    vm->openUpvalues = NULL;
 }
 
-static void runtimeWarning(const char *format, ...)
+static void runtimeWarning(VM *vm, const char *format, ...)
 {
     va_list args;
     va_start(args, format);
@@ -36,7 +34,7 @@ static void runtimeWarning(const char *format, ...)
 
     va_end(args);
 
-    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
     size_t instruction = frame->ip - frame->closure->function->chunk.code - 1;
     int line = getLine(&frame->closure->function->chunk, instruction);
 
@@ -44,7 +42,10 @@ static void runtimeWarning(const char *format, ...)
 }
 
 // ! https://craftinginterpreters.com/calls-and-functions.html#returning-from-functions
-static void runtimeError(const char *format, ...)
+// Frames listed from each end of the stack trace.
+#define TRACE_FRAMES 10
+
+static void runtimeError(VM *vm, const char *format, ...)
 {
     // Uses args with given format.
     va_list args;
@@ -57,13 +58,19 @@ static void runtimeError(const char *format, ...)
     va_end(args);                   // Clear the args lits.
     fputs("\n", stderr);            // Line Jump.
 
-    for (int i = vm.frameCount - 1; i >= 0; i--)
+    // A runaway recursion has up to vm->maxFrames frames, only the innermost and outermost ones are listed.
+    for (int i = vm->frameCount - 1; i >= 0; i--)
     {
-        CallFrame *frame = &vm.frames[i];
+        if (vm->frameCount > 2 * TRACE_FRAMES && i == vm->frameCount - 1 - TRACE_FRAMES)
+        {
+            fprintf(stderr, "... %d more frames\n", vm->frameCount - 2 * TRACE_FRAMES);
+            i = TRACE_FRAMES - 1;
+        }
+        CallFrame *frame = &vm->frames[i];
         ObjFunction *function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
-        if (function->name = NULL)
+        fprintf(stderr, "[line %d] in ", getLine(&function->chunk, instruction));
+        if (function->name == NULL)
         {
             fprintf(stderr, "script\n");
         }
@@ -73,121 +80,823 @@ static void runtimeError(const char *format, ...)
         }
     }
 
-    /*CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    /*CallFrame* frame = &vm->frames[vm->frameCount - 1];
     size_t instruction = frame->ip - frame->function->chunk.code - 1;
     int line = getLine(&frame->function->chunk,instruction);
 
     fprintf(stderr, "\033[1;31m[line %d] in script\033[0m\n", line); // Prints the line of the error.
     */
-    resetStack(); // Reset the stack.
+    resetStack(vm); // Reset the stack.
+}
+
+Value nativeError(VM *vm, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vsnprintf(vm->nativeError, sizeof(vm->nativeError), format, args);
+    va_end(args);
+    vm->nativeFailed = true;
+    return NIL_VAL;
 }
 
-static void defineNative(const char *name, NativeFn function)
+// Replaces a rope in the slot with its flattened string, for code that needs the characters or the hash.
+static void flattenText(VM *vm, Value *slot)
 {
-    push(copyString(name, (int)strlen(name)));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, vm.stack[0], vm.stack[1]);
-    pop();
-    pop();
+    if (IS_ROPE(*slot))
+        *slot = OBJ_VAL(flattenRope(vm, AS_ROPE(*slot)));
 }
 
-static Value clockNative(int argCount, Value *args)
+int globalSlot(VM *vm, ObjString *name)
+{
+    Value index;
+    if (tableGet(&vm->globals, OBJ_VAL(name), &index))
+        return (int)AS_NUMBER(index);
+
+    // The name is only referenced from the C stack until it's stored in the slot.
+    push(vm, OBJ_VAL(name));
+    if (vm->globalCapacity < vm->globalCount + 1)
+    {
+        int oldCapacity = vm->globalCapacity;
+        vm->globalCapacity = GROW_CAPACITY(oldCapacity);
+        vm->globalSlots = GROW_ARRAY(vm, GlobalSlot, vm->globalSlots, oldCapacity, vm->globalCapacity);
+    }
+
+    int slot = vm->globalCount++;
+    vm->globalSlots[slot].name = name;
+    vm->globalSlots[slot].value = NIL_VAL;
+    vm->globalSlots[slot].defined = false;
+    tableSet(vm, &vm->globals, OBJ_VAL(name), NUMBER_VAL(slot));
+    pop(vm);
+    return slot;
+}
+
+static void defineNative(VM *vm, const char *name, NativeFn function)
+{
+    push(vm, copyString(vm, name, (int)strlen(name)));
+    push(vm, OBJ_VAL(newNative(vm, function)));
+    int slot = globalSlot(vm, AS_STRING(vm->stack[0]));
+    GlobalSlot *global = &vm->globalSlots[slot];
+    global->value = vm->stack[1];
+    global->defined = true;
+    pop(vm);
+    pop(vm);
+}
+
+static Value clockNative(VM *vm, int argCount, Value *args)
 {
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
-static Value printNative(int argCount, Value *args)
+static Value printNative(VM *vm, int argCount, Value *args)
 {
     printValue(args[0]);
     return NIL_VAL;
 }
 
-void initVM()
+// Which isolate of the pool is running, so the instances of one script can take different parts in a pipeline.
+static Value isolateNative(VM *vm, int argCount, Value *args)
+{
+    return NUMBER_VAL(vm->isolate);
+}
+
+// channel(name) or channel(name, capacity), every isolate opening the same name gets the same channel.
+static Value channelNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount >= 1)
+        flattenText(vm, &args[0]);
+    if (argCount < 1 || argCount > 2 || !IS_STRING(args[0]))
+        return nativeError(vm, "channel() takes a name and optionally a capacity.");
+
+    int capacity = CHANNEL_CAPACITY;
+    if (argCount == 2)
+    {
+        if (!IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 1 || AS_NUMBER(args[1]) > CHANNEL_MAX_CAPACITY)
+            return nativeError(vm, "Channel capacity must be a number between 1 and %d.", CHANNEL_MAX_CAPACITY);
+        capacity = (int)AS_NUMBER(args[1]);
+    }
+
+    ObjString *name = AS_STRING(args[0]);
+    return OBJ_VAL(newChannel(vm, openChannel(vm->channels, name->chars, name->length, capacity)));
+}
+
+static bool checkSend(VM *vm, const char *name, int argCount, Value *args, Message *message)
+{
+    if (argCount != 2 || !IS_CHANNEL(args[0]))
+    {
+        nativeError(vm, "%s() takes a channel and a value.", name);
+        return false;
+    }
+    flattenText(vm, &args[1]);
+    if (!makeMessage(vm, args[1], message))
+    {
+        nativeError(vm, "Only numbers, booleans, nil and strings can be sent.");
+        return false;
+    }
+    return true;
+}
+
+static bool checkReceive(VM *vm, const char *name, int argCount, Value *args)
+{
+    if (argCount != 1 || !IS_CHANNEL(args[0]))
+    {
+        nativeError(vm, "%s() takes a channel.", name);
+        return false;
+    }
+    return true;
+}
+
+// Waits while the channel is full.
+static Value sendNative(VM *vm, int argCount, Value *args)
+{
+    Message message;
+    if (checkSend(vm, "send", argCount, args, &message))
+        channelSend(AS_CHANNEL(args[0]), &message);
+    return NIL_VAL;
+}
+
+// Returns false instead of waiting when the channel is full.
+static Value trySendNative(VM *vm, int argCount, Value *args)
+{
+    Message message;
+    if (!checkSend(vm, "trySend", argCount, args, &message))
+        return NIL_VAL;
+    if (channelTrySend(AS_CHANNEL(args[0]), &message))
+        return BOOL_VAL(true);
+    dropMessage(&message);
+    return BOOL_VAL(false);
+}
+
+// Waits while the channel is empty.
+static Value receiveNative(VM *vm, int argCount, Value *args)
+{
+    if (!checkReceive(vm, "receive", argCount, args))
+        return NIL_VAL;
+    Message message;
+    channelReceive(AS_CHANNEL(args[0]), &message);
+    return openMessage(vm, &message);
+}
+
+// Returns nil instead of waiting when the channel is empty.
+static Value tryReceiveNative(VM *vm, int argCount, Value *args)
+{
+    if (!checkReceive(vm, "tryReceive", argCount, args))
+        return NIL_VAL;
+    Message message;
+    if (!channelTryReceive(AS_CHANNEL(args[0]), &message))
+        return NIL_VAL;
+    return openMessage(vm, &message);
+}
+
+static bool call(VM *vm, ObjClosure *closure, int argCount);
+
+// Saves the running fiber's state into it and makes `to` the running one, in O(1) since only pointers move.
+static void switchFiber(VM *vm, ObjFiber *to)
+{
+    ObjFiber *from = vm->fiber;
+    from->stack = vm->stack;
+    from->stackTop = vm->stackTop;
+    from->stackCapacity = vm->stackCapacity;
+    from->frames = vm->frames;
+    from->frameCount = vm->frameCount;
+    from->frameCapacity = vm->frameCapacity;
+    from->openUpvalues = vm->openUpvalues;
+    if (from->openUpvalues != NULL)
+        vm->parkedUpvalues = true;
+
+    vm->stack = to->stack;
+    vm->stackTop = to->stackTop;
+    vm->stackCapacity = to->stackCapacity;
+    vm->frames = to->frames;
+    vm->frameCount = to->frameCount;
+    vm->frameCapacity = to->frameCapacity;
+    vm->openUpvalues = to->openUpvalues;
+    to->stack = NULL;
+    to->stackTop = NULL;
+    to->stackCapacity = 0;
+    to->frames = NULL;
+    to->frameCount = 0;
+    to->frameCapacity = 0;
+    to->openUpvalues = NULL;
+    vm->fiber = to;
+}
+
+// Hands control back to the fiber that resumed the running one, its resume() call returns `value`.
+static void leaveFiber(VM *vm, FiberState state, Value value)
+{
+    ObjFiber *fiber = vm->fiber;
+    ObjFiber *caller = fiber->caller;
+    fiber->state = state;
+    fiber->caller = NULL;
+    switchFiber(vm, caller);
+    push(vm, value);
+}
+
+static void finishFiber(VM *vm, Value result)
+{
+    leaveFiber(vm, FIBER_DONE, result);
+}
+
+// fiber(fn) makes a fiber that runs fn, which takes at most one parameter: the value of the first resume().
+static Value fiberNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 1 || !IS_CLOSURE(args[0]) || AS_CLOSURE(args[0])->function->arity > 1)
+        return nativeError(vm, "fiber() takes a function with at most one parameter.");
+    return OBJ_VAL(newFiber(vm, AS_CLOSURE(args[0])));
+}
+
+/*
+resume(fiber) or resume(fiber, value) runs the fiber until it suspends or returns, then returns what it passed.
+The value becomes the argument of its function the first time, the result of its suspend() afterwards.
+*/
+static Value resumeNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount < 1 || argCount > 2 || !IS_FIBER(args[0]))
+        return nativeError(vm, "resume() takes a fiber and optionally a value.");
+    ObjFiber *fiber = AS_FIBER(args[0]);
+    if (fiber->state == FIBER_DONE)
+        return nativeError(vm, "Cannot resume a finished fiber.");
+    if (fiber->state == FIBER_RUNNING)
+        return nativeError(vm, "Cannot resume a running fiber.");
+
+    Value value = argCount == 2 ? args[1] : NIL_VAL;
+    if (vm->fiber == NULL)
+        vm->fiber = newFiber(vm, NULL); // The code that was running all along becomes a fiber too.
+
+    // The call is over on this stack, suspend() pushes its result in its place.
+    vm->stackTop = args - 1;
+    fiber->caller = vm->fiber;
+    FiberState state = fiber->state;
+    fiber->state = FIBER_RUNNING;
+    switchFiber(vm, fiber);
+    if (state == FIBER_SUSPENDED)
+    {
+        push(vm, value);
+        return NIL_VAL;
+    }
+
+    ObjClosure *closure = AS_CLOSURE(vm->stack[0]);
+    if (closure->function->arity == 1)
+        push(vm, value);
+    call(vm, closure, closure->function->arity);
+    return NIL_VAL;
+}
+
+// suspend() or suspend(value) pauses the running fiber, the resume() that ran it returns the value.
+static Value suspendNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount > 1)
+        return nativeError(vm, "suspend() takes at most one value.");
+    if (vm->fiber == NULL || vm->fiber->caller == NULL)
+        return nativeError(vm, "Cannot suspend outside a fiber.");
+
+    Value value = argCount == 1 ? args[0] : NIL_VAL;
+    vm->stackTop = args - 1;
+    leaveFiber(vm, FIBER_SUSPENDED, value);
+    return NIL_VAL;
+}
+
+// isDone(fiber) or isDone(generator), whether its function has returned.
+static Value isDoneNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 1 || !(IS_FIBER(args[0]) || IS_GENERATOR(args[0])))
+        return nativeError(vm, "isDone() takes a fiber or a generator.");
+    FiberState state = IS_FIBER(args[0]) ? AS_FIBER(args[0])->state : AS_GENERATOR(args[0])->state;
+    return BOOL_VAL(state == FIBER_DONE);
+}
+
+// append(list, value) adds the value at the end of the list, growing it geometrically.
+static Value appendNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 2 || !IS_LIST(args[0]))
+        return nativeError(vm, "append() takes a list and a value.");
+    writeValueArray(vm, &AS_LIST(args[0])->items, args[1]);
+    return NIL_VAL;
+}
+
+// length(list), length(floats), length(map) or length(string).
+static Value lengthNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount == 1 && IS_MAP(args[0]))
+        return NUMBER_VAL(AS_MAP(args[0])->size);
+    if (argCount == 1 && IS_LIST(args[0]))
+        return NUMBER_VAL(AS_LIST(args[0])->items.count);
+    if (argCount == 1 && IS_FLOAT_ARRAY(args[0]))
+        return NUMBER_VAL(AS_FLOAT_ARRAY(args[0])->count);
+    if (argCount == 1 && IS_STRING(args[0]))
+        return NUMBER_VAL(AS_STRING(args[0])->length);
+    if (argCount == 1 && IS_ROPE(args[0]))
+        return NUMBER_VAL(AS_ROPE(args[0])->length);
+    return nativeError(vm, "length() takes a list, a float array, a map or a string.");
+}
+
+// has(map, key), whether the key is in the map, even with a nil value.
+static Value hasNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 2 || !IS_MAP(args[0]))
+        return nativeError(vm, "has() takes a map and a key.");
+    flattenText(vm, &args[1]);
+    Value value;
+    return BOOL_VAL(tableGet(&AS_MAP(args[0])->table, args[1], &value));
+}
+
+// delete(map, key) removes the key, returns whether it was there.
+static Value deleteNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 2 || !IS_MAP(args[0]))
+        return nativeError(vm, "delete() takes a map and a key.");
+    flattenText(vm, &args[1]);
+    ObjMap *map = AS_MAP(args[0]);
+    if (!tableDelete(&map->table, &args[1]))
+        return BOOL_VAL(false);
+    map->size--;
+    return BOOL_VAL(true);
+}
+
+// keys(map) returns a list of the map's keys, to iterate over while the map changes.
+static Value keysNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 1 || !IS_MAP(args[0]))
+        return nativeError(vm, "keys() takes a map.");
+    ObjList *keys = newList(vm, NULL, 0);
+    push(vm, OBJ_VAL(keys));
+    Table *table = &AS_MAP(args[0])->table;
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (!IS_NIL(table->entries[i].key))
+            writeValueArray(vm, &keys->items, table->entries[i].key);
+    }
+    pop(vm);
+    return OBJ_VAL(keys);
+}
+
+// floats(count) makes a float array of zeros, floats(list) one with the list's numbers.
+static Value floatsNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount == 1 && IS_NUMBER(args[0]))
+    {
+        double count = AS_NUMBER(args[0]);
+        if (!(count >= 0 && count <= INT32_MAX) || count != (int)count)
+            return nativeError(vm, "A float array's length must be a whole number.");
+        return OBJ_VAL(newFloatArray(vm, (int)count));
+    }
+    if (argCount != 1 || !IS_LIST(args[0]))
+        return nativeError(vm, "floats() takes a length or a list of numbers.");
+
+    ValueArray *items = &AS_LIST(args[0])->items;
+    for (int i = 0; i < items->count; i++)
+    {
+        if (!IS_NUMBER(items->values[i]))
+            return nativeError(vm, "floats() takes a length or a list of numbers.");
+    }
+    ObjFloatArray *array = newFloatArray(vm, items->count);
+    for (int i = 0; i < items->count; i++)
+    {
+        array->values[i] = AS_NUMBER(items->values[i]);
+    }
+    return OBJ_VAL(array);
+}
+
+// Whether every one of the `count` arguments is a float array as long as the first.
+static bool sameLengthFloats(Value *args, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (!IS_FLOAT_ARRAY(args[i]) || AS_FLOAT_ARRAY(args[i])->count != AS_FLOAT_ARRAY(args[0])->count)
+            return false;
+    }
+    return true;
+}
+
+static Value sumNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 1 || !IS_FLOAT_ARRAY(args[0]))
+        return nativeError(vm, "sum() takes a float array.");
+    ObjFloatArray *a = AS_FLOAT_ARRAY(args[0]);
+    return NUMBER_VAL(floatKernels()->sum(a->values, a->count));
+}
+
+static Value dotNative(VM *vm, int argCount, Value *args)
 {
-    vm.replMode = false;
-    vm.stackCapacity = STACK_MAX;
-    vm.stackCount = 0;
-    resetStack();
-    vm.objects = NULL;
-    initTable(&vm.globals);
-    initTable(&vm.strings);
+    if (argCount != 2 || !sameLengthFloats(args, 2))
+        return nativeError(vm, "dot() takes two float arrays of the same length.");
+    ObjFloatArray *a = AS_FLOAT_ARRAY(args[0]);
+    return NUMBER_VAL(floatKernels()->dot(a->values, AS_FLOAT_ARRAY(args[1])->values, a->count));
+}
 
-    defineNative("clock", clockNative);
-    defineNative("print", printNative);
+// min() and max() of an array holding a NaN are NaN, the same on every CPU and for any length or position.
+static Value minNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 1 || !IS_FLOAT_ARRAY(args[0]) || AS_FLOAT_ARRAY(args[0])->count == 0)
+        return nativeError(vm, "min() takes a float array that isn't empty.");
+    ObjFloatArray *a = AS_FLOAT_ARRAY(args[0]);
+    return NUMBER_VAL(floatKernels()->min(a->values, a->count));
 }
-void freeVM()
+
+static Value maxNative(VM *vm, int argCount, Value *args)
 {
-    freeTable(&vm.globals);
-    freeTable(&vm.strings);
-    free(vm.stack);
-    freeObjects();
+    if (argCount != 1 || !IS_FLOAT_ARRAY(args[0]) || AS_FLOAT_ARRAY(args[0])->count == 0)
+        return nativeError(vm, "max() takes a float array that isn't empty.");
+    ObjFloatArray *a = AS_FLOAT_ARRAY(args[0]);
+    return NUMBER_VAL(floatKernels()->max(a->values, a->count));
 }
-void push(Value value)
+
+// scale(a, k) multiplies every item of a by k in place and returns a.
+static Value scaleNative(VM *vm, int argCount, Value *args)
 {
-    if (vm.stack == NULL)
+    if (argCount != 2 || !IS_FLOAT_ARRAY(args[0]) || !IS_NUMBER(args[1]))
+        return nativeError(vm, "scale() takes a float array and a number.");
+    ObjFloatArray *a = AS_FLOAT_ARRAY(args[0]);
+    floatKernels()->scale(a->values, AS_NUMBER(args[1]), a->count);
+    return args[0];
+}
+
+// axpy(k, x, y) adds k * x to y in place and returns y.
+static Value axpyNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount != 3 || !IS_NUMBER(args[0]) || !sameLengthFloats(args + 1, 2))
+        return nativeError(vm, "axpy() takes a number and two float arrays of the same length.");
+    ObjFloatArray *y = AS_FLOAT_ARRAY(args[2]);
+    floatKernels()->axpy(AS_NUMBER(args[0]), AS_FLOAT_ARRAY(args[1])->values, y->values, y->count);
+    return args[2];
+}
+
+/*
+add(a, b) and mul(a, b) return a new float array with the items added or multiplied pairwise, add(a, b, out) and
+mul(a, b, out) write them into out instead, which may be a or b.
+*/
+static Value elementwise(VM *vm, int argCount, Value *args, const char *usage,
+                         void (*kernel)(const double *a, const double *b, double *out, int count))
+{
+    if ((argCount != 2 && argCount != 3) || !sameLengthFloats(args, argCount))
+        return nativeError(vm, "%s", usage);
+    ObjFloatArray *a = AS_FLOAT_ARRAY(args[0]);
+    // Arguments are still on the stack, a collection while out is allocated leaves them alone.
+    ObjFloatArray *out = argCount == 3 ? AS_FLOAT_ARRAY(args[2]) : newFloatArray(vm, a->count);
+    kernel(a->values, AS_FLOAT_ARRAY(args[1])->values, out->values, a->count);
+    return OBJ_VAL(out);
+}
+
+static Value addNative(VM *vm, int argCount, Value *args)
+{
+    return elementwise(vm, argCount, args, "add() takes two or three float arrays of the same length.",
+                       floatKernels()->add);
+}
+
+static Value mulNative(VM *vm, int argCount, Value *args)
+{
+    return elementwise(vm, argCount, args, "mul() takes two or three float arrays of the same length.",
+                       floatKernels()->mul);
+}
+
+/*
+Sets up an empty VM, without any globals.
+Every root the collector reads is set to empty before the first allocation, VMs live on the stack and a collection
+may start from any ALLOCATE.
+*/
+static void initState(VM *vm)
+{
+    seedHashes();
+    vm->replMode = false;
+    vm->jitEnabled = true;
+    vm->owner = NULL;
+    vm->isolate = 0;
+    vm->channels = NULL;
+    vm->nativeFailed = false;
+    vm->fiber = NULL;
+    vm->parkedUpvalues = false;
+    vm->parser = NULL;
+    vm->objects = NULL;
+    vm->bytesAllocated = 0;
+    vm->nextGC = 1024 * 1024;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+    vm->stackCapacity = 0;
+    vm->stack = NULL;
+    vm->frameCapacity = 0;
+    vm->maxFrames = FRAMES_MAX;
+    vm->frames = NULL;
+    resetStack(vm);
+    initTable(&vm->globals, TABLE_STRINGS);
+    vm->globalSlots = NULL;
+    vm->globalCount = 0;
+    vm->globalCapacity = 0;
+    initTable(&vm->strings, TABLE_STRINGS);
+    vm->initString = NULL;
+    vm->recorder = NULL;
+    vm->hotLoops = NULL;
+
+    vm->stack = ALLOCATE(vm, Value, STACK_INITIAL);
+    vm->stackCapacity = STACK_INITIAL;
+    resetStack(vm);
+    vm->frames = ALLOCATE(vm, CallFrame, FRAMES_INITIAL);
+    vm->frameCapacity = FRAMES_INITIAL;
+#ifdef JIT_ENABLED
+    initTraces(vm);
+#endif
+}
+
+static void defineNatives(VM *vm)
+{
+    vm->initString = AS_STRING(copyString(vm, "init", 4));
+    defineNative(vm, "clock", clockNative);
+    defineNative(vm, "print", printNative);
+    defineNative(vm, "isolate", isolateNative);
+    defineNative(vm, "channel", channelNative);
+    defineNative(vm, "send", sendNative);
+    defineNative(vm, "trySend", trySendNative);
+    defineNative(vm, "receive", receiveNative);
+    defineNative(vm, "tryReceive", tryReceiveNative);
+    defineNative(vm, "fiber", fiberNative);
+    defineNative(vm, "resume", resumeNative);
+    defineNative(vm, "suspend", suspendNative);
+    defineNative(vm, "isDone", isDoneNative);
+    defineNative(vm, "append", appendNative);
+    defineNative(vm, "length", lengthNative);
+    defineNative(vm, "has", hasNative);
+    defineNative(vm, "delete", deleteNative);
+    defineNative(vm, "keys", keysNative);
+    defineNative(vm, "floats", floatsNative);
+    defineNative(vm, "sum", sumNative);
+    defineNative(vm, "dot", dotNative);
+    defineNative(vm, "min", minNative);
+    defineNative(vm, "max", maxNative);
+    defineNative(vm, "scale", scaleNative);
+    defineNative(vm, "axpy", axpyNative);
+    defineNative(vm, "add", addNative);
+    defineNative(vm, "mul", mulNative);
+}
+
+void initVM(VM *vm)
+{
+    initState(vm);
+    vm->channels = newChannelSet();
+    defineNatives(vm);
+}
+
+void initIsolate(VM *vm, VM *owner)
+{
+    initState(vm);
+    vm->owner = owner;
+    vm->channels = owner->channels;
+    vm->jitEnabled = false;
+    // The owner's objects are all marked for good, this VM's collector never touches them.
+    tableAddAll(vm, &owner->strings, &vm->strings);
+    defineNatives(vm);
+    for (int i = 0; i < owner->globalCount; i++)
+    {
+        globalSlot(vm, owner->globalSlots[i].name);
+    }
+}
+void freeVM(VM *vm)
+{
+    freeTable(vm, &vm->globals);
+    FREE_ARRAY(vm, GlobalSlot, vm->globalSlots, vm->globalCapacity);
+    freeTable(vm, &vm->strings);
+    FREE_ARRAY(vm, Value, vm->stack, vm->stackCapacity);
+    FREE_ARRAY(vm, CallFrame, vm->frames, vm->frameCapacity);
+#ifdef JIT_ENABLED
+    freeTraceState(vm);
+#endif
+    if (vm->owner == NULL)
+        freeChannelSet(vm->channels);
+    freeObjects(vm);
+}
+/*
+Grows the stack so it holds at least `needed` values.
+The buffer may move, so the stack top, every frame's slots and every open upvalue get rebased onto the new one.
+*/
+static void growStack(VM *vm, int needed)
+{
+    int capacity = vm->stackCapacity;
+    while (capacity < needed)
+    {
+        capacity = GROW_CAPACITY(capacity);
+    }
+
+    Value *oldStack = vm->stack;
+    vm->stack = GROW_ARRAY(vm, Value, vm->stack, vm->stackCapacity, capacity);
+    vm->stackCapacity = capacity;
+    if (vm->stack == oldStack)
+        return;
+
+    vm->stackTop = vm->stack + (vm->stackTop - oldStack);
+    for (int i = 0; i < vm->frameCount; i++)
+    {
+        vm->frames[i].slots = vm->stack + (vm->frames[i].slots - oldStack);
+    }
+    for (ObjUpvalue *upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+    {
+        upvalue->location = vm->stack + (upvalue->location - oldStack);
+    }
+}
+
+void push(VM *vm, Value value)
+{
+    if (vm->stack == NULL)
     {
         fprintf(stderr, "Fatal error: stack not initialized.\n");
         exit(1);
     }
-    if (vm.stackCount >= vm.stackCapacity)
+    int stackCount = (int)(vm->stackTop - vm->stack);
+    if (stackCount >= vm->stackCapacity)
     {
-
-        int oldCapacity = vm.stackCapacity;
-        vm.stackCapacity = GROW_CAPACITY(oldCapacity);
-        vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, vm.stackCapacity);
-        vm.stackTop = vm.stack + vm.stackCount;
+        growStack(vm, stackCount + 1);
     }
 
-    *vm.stackTop = value;
-    vm.stackTop++;
-    vm.stackCount++;
+    *vm->stackTop = value;
+    vm->stackTop++;
 }
 
-Value pop()
+Value pop(VM *vm)
 {
-    if (vm.stackTop == vm.stack)
+    if (vm->stackTop == vm->stack)
     {
         fprintf(stderr, "Runtime error: Stack underflow.\n");
         exit(1);
     }
-    vm.stackTop--;
-    return *vm.stackTop;
+    vm->stackTop--;
+    return *vm->stackTop;
 }
 
 // Access the value
-static Value peek(int distance)
+static Value peek(VM *vm, int distance)
+{
+    return vm->stackTop[-1 - distance];
+}
+
+#ifdef DEBUG_CHECK_STACK
+// Validates the compiler's stack depth analysis, a frame never holds more values than its function declared.
+static void checkedPush(VM *vm, CallFrame *frame, Value value)
+{
+    if (vm->stackTop >= frame->slots + frame->closure->function->maxStackDepth)
+    {
+        fprintf(stderr, "Fatal error: frame stack depth exceeded.\n");
+        exit(1);
+    }
+    *vm->stackTop++ = value;
+}
+
+static Value checkedPop(VM *vm, CallFrame *frame)
 {
-    return vm.stackTop[-1 - distance];
+    if (vm->stackTop <= frame->slots)
+    {
+        fprintf(stderr, "Fatal error: frame stack underflow.\n");
+        exit(1);
+    }
+    return *--vm->stackTop;
 }
+#endif
 
 /*
 This function Avoid this.
 var notAFunction = 123;
 notAFunction();
 */
-static bool call(ObjClosure *closure, int argCount)
+// Makes room for another frame once the frame array is full, reports a stack overflow past vm->maxFrames.
+static bool growFrames(VM *vm)
+{
+    if (vm->frameCount >= vm->maxFrames)
+    {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+    int oldCapacity = vm->frameCapacity;
+    vm->frameCapacity = GROW_CAPACITY(oldCapacity);
+    if (vm->frameCapacity > vm->maxFrames)
+        vm->frameCapacity = vm->maxFrames;
+    vm->frames = GROW_ARRAY(vm, CallFrame, vm->frames, oldCapacity, vm->frameCapacity);
+    return true;
+}
+
+static bool call(VM *vm, ObjClosure *closure, int argCount)
 {
 
     if (argCount != closure->function->arity)
     {
-        runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+        runtimeError(vm, "Expected %d arguments but got %d.", closure->function->arity, argCount);
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX)
+    if (vm->frameCount == vm->frameCapacity && !growFrames(vm))
+        return false;
+
+    // The only stack check a call needs, run() pushes and pops without checking.
+    int needed = (int)(vm->stackTop - vm->stack) - argCount - 1 + closure->function->maxStackDepth + STACK_HEADROOM;
+    if (needed > vm->stackCapacity)
+        growStack(vm, needed);
+
+    if (vm->jitEnabled)
+        closure->function->hotness++;
+    CallFrame *frame = &vm->frames[vm->frameCount++];
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    frame->slots = vm->stackTop - argCount - 1;
+    return true;
+}
+
+/*
+Calling a generator runs its frame again from where it yielded. The generator stays in the callee slot, its saved
+slots go back above it and the upvalues of its locals point into the stack again.
+*/
+static bool resumeGenerator(VM *vm, ObjGenerator *generator, int argCount)
+{
+    if (argCount != 0)
     {
-        runtimeError("Stack overflow.");
+        runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
         return false;
     }
+    if (generator->state != FIBER_SUSPENDED)
+    {
+        runtimeError(vm, generator->state == FIBER_DONE ? "Cannot resume a finished generator."
+                                                        : "Cannot resume a running generator.");
+        return false;
+    }
+    if (vm->frameCount == vm->frameCapacity && !growFrames(vm))
+        return false;
 
-    CallFrame *frame = &vm.frames[vm.frameCount++];
-    frame->closure->function = closure->function;
-    frame->ip = closure->function->chunk.code;
-    frame->slots = vm.stackTop - argCount - 1;
+    int base = (int)(vm->stackTop - vm->stack) - 1;
+    int needed = base + generator->closure->function->maxStackDepth + STACK_HEADROOM;
+    if (needed > vm->stackCapacity)
+        growStack(vm, needed);
+
+    Value *slots = vm->stack + base;
+    if (generator->slotCount > 0)
+        memcpy(slots + 1, generator->slots, sizeof(Value) * generator->slotCount);
+    vm->stackTop = slots + 1 + generator->slotCount;
+
+    // The frame is the top one, so its upvalues go in front of every other open one.
+    ObjUpvalue *last = NULL;
+    for (ObjUpvalue *upvalue = generator->openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+    {
+        upvalue->location = slots + 1 + (upvalue->location - generator->slots);
+        last = upvalue;
+    }
+    if (last != NULL)
+    {
+        last->next = vm->openUpvalues;
+        vm->openUpvalues = generator->openUpvalues;
+        generator->openUpvalues = NULL;
+    }
+    generator->slotCount = 0;
+    generator->state = FIBER_RUNNING;
+
+    CallFrame *frame = &vm->frames[vm->frameCount++];
+    frame->closure = generator->closure;
+    frame->ip = generator->ip;
+    frame->slots = slots;
     return true;
 }
 
-static bool callValue(Value callee, int argCount)
+// Saves the top frame, a generator's, into its generator and returns the value on top of the stack to the caller.
+static void yieldGenerator(VM *vm, CallFrame *frame)
+{
+    ObjGenerator *generator = AS_GENERATOR(frame->slots[0]);
+    int count = (int)(vm->stackTop - frame->slots) - 2; // Neither the callee slot nor the yielded value.
+    if (count > generator->slotCapacity)
+    {
+        int oldCapacity = generator->slotCapacity;
+        int capacity = oldCapacity;
+        while (capacity < count)
+            capacity = GROW_CAPACITY(capacity);
+        generator->slots = GROW_ARRAY(vm, Value, generator->slots, oldCapacity, capacity);
+        generator->slotCapacity = capacity;
+    }
+    if (count > 0)
+        memcpy(generator->slots, frame->slots + 1, sizeof(Value) * count);
+    generator->slotCount = count;
+    generator->ip = frame->ip;
+
+    ObjUpvalue **tail = &generator->openUpvalues;
+    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= frame->slots)
+    {
+        ObjUpvalue *upvalue = vm->openUpvalues;
+        vm->openUpvalues = upvalue->next;
+        upvalue->location = generator->slots + (upvalue->location - frame->slots - 1);
+        *tail = upvalue;
+        tail = &upvalue->next;
+    }
+    *tail = NULL;
+    if (generator->openUpvalues != NULL)
+        vm->parkedUpvalues = true;
+    generator->state = FIBER_SUSPENDED;
+
+    Value value = vm->stackTop[-1];
+    vm->frameCount--;
+    vm->stackTop = frame->slots;
+    push(vm, value);
+}
+
+// A call to a generator function only packs its arguments into a new generator, as if the body yielded it at once.
+static void makeGenerator(VM *vm, CallFrame *frame)
+{
+    ObjGenerator *generator = newGenerator(vm, frame->closure);
+    frame->slots[0] = OBJ_VAL(generator);
+    push(vm, OBJ_VAL(generator));
+    yieldGenerator(vm, frame);
+}
+
+static bool callValue(VM *vm, Value callee, int argCount)
 {
     if (IS_OBJ(callee))
     {
@@ -199,25 +908,57 @@ static bool callValue(Value callee, int argCount)
         case OBJ_NATIVE:
         {
             NativeFn native = AS_NATIVE(callee);
-            Value result = native(argCount, vm.stackTop - argCount);
-            vm.stackTop -= argCount + 1;
-            push(result);
+            ObjFiber *fiber = vm->fiber;
+            Value result = native(vm, argCount, vm->stackTop - argCount);
+            if (vm->nativeFailed)
+            {
+                vm->nativeFailed = false;
+                runtimeError(vm, "%s", vm->nativeError);
+                return false;
+            }
+            // resume() and suspend() switch fibers, they leave both stacks the way the switch needs them.
+            if (vm->fiber != fiber)
+                return true;
+            vm->stackTop -= argCount + 1;
+            push(vm, result);
             return true;
         }
         case OBJ_CLOSURE:
-            return call(AS_CLOSURE(callee), argCount);
+            return call(vm, AS_CLOSURE(callee), argCount);
+        case OBJ_GENERATOR:
+            return resumeGenerator(vm, AS_GENERATOR(callee), argCount);
+        case OBJ_BOUND_METHOD:
+        {
+            ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
+            vm->stackTop[-argCount - 1] = bound->receiver; // Slot 0 of a method is `this`.
+            return call(vm, bound->method, argCount);
+        }
+        case OBJ_CLASS:
+        {
+            ObjClass *klass = AS_CLASS(callee);
+            vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
+            Value initializer;
+            if (tableGet(&klass->methods, OBJ_VAL(vm->initString), &initializer))
+                return call(vm, AS_CLOSURE(initializer), argCount);
+            if (argCount != 0)
+            {
+                runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
+                return false;
+            }
+            return true;
+        }
         default:
             break; // Non-Callable object type.
         }
     }
-    runtimeError("Can only call functions and classes.");
+    runtimeError(vm, "Can only call functions and classes.");
     return false;
 }
 
-static ObjUpvalue *captureUpvalue(Value *local)
+static ObjUpvalue *captureUpvalue(VM *vm, Value *local)
 {
     ObjUpvalue *prevUpvalue = NULL;
-    ObjUpvalue *upvalue = vm.openUpvalues;
+    ObjUpvalue *upvalue = vm->openUpvalues;
 
     while (upvalue != NULL && upvalue->location > local)
     {
@@ -230,12 +971,12 @@ static ObjUpvalue *captureUpvalue(Value *local)
         return upvalue;
     }
 
-    ObjUpvalue *createdUpvalue = newUpvalue(local);
+    ObjUpvalue *createdUpvalue = newUpvalue(vm, local);
 
     createdUpvalue->next = upvalue;
     if (prevUpvalue == NULL)
     {
-        vm.openUpvalues = createdUpvalue;
+        vm->openUpvalues = createdUpvalue;
     }
     else
     {
@@ -245,53 +986,343 @@ static ObjUpvalue *captureUpvalue(Value *local)
     return createdUpvalue;
 }
 
-static void closeUpvalues(Value *last)
+static void closeUpvalues(VM *vm, Value *last)
 {
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last)
+    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last)
     {
-        ObjUpvalue *upvalue = vm.openUpvalues;
+        ObjUpvalue *upvalue = vm->openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        vm->openUpvalues = upvalue->next;
     }
 }
 
+/*
+Calls a closure in place of the function running in the top frame.
+Its upvalues are closed, then the callee and arguments slide down over its slots and the frame restarts with the
+new closure, so tail recursion runs in constant frame space.
+*/
+static bool tailCall(VM *vm, ObjClosure *closure, int argCount)
+{
+    if (argCount != closure->function->arity)
+    {
+        runtimeError(vm, "Expected %d arguments but got %d.", closure->function->arity, argCount);
+        return false;
+    }
+
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
+    closeUpvalues(vm, frame->slots);
+    memmove(frame->slots, vm->stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+    vm->stackTop = frame->slots + argCount + 1;
+
+    int needed = (int)(frame->slots - vm->stack) + closure->function->maxStackDepth + STACK_HEADROOM;
+    if (needed > vm->stackCapacity)
+        growStack(vm, needed);
+
+    if (vm->jitEnabled)
+        closure->function->hotness++;
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    return true;
+}
+
 static bool isFalsey(Value value)
 {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// Returns why `index` can't index `target`, a list or a float array, or NULL with the item's position in *item.
+static const char *checkIndex(Value target, Value index, int *item)
+{
+    int count;
+    if (IS_LIST(target))
+        count = AS_LIST(target)->items.count;
+    else if (IS_FLOAT_ARRAY(target))
+        count = AS_FLOAT_ARRAY(target)->count;
+    else
+        return "Only lists and float arrays can be indexed.";
+
+    if (!IS_NUMBER(index))
+        return "Index must be a number.";
+    double position = AS_NUMBER(index);
+    if (!(position >= 0 && position < count))
+        return "Index out of bounds.";
+    if (position != (int)position)
+        return "Index must be an integer.";
+    *item = (int)position;
+    return NULL;
+}
+
+// Reads target[key] into *result, a missing map key reads as nil. `hash` is the key's, it's only used by maps.
+// Returns why it can't be read, or NULL.
+static const char *getItem(Value target, Value key, uint32_t hash, Value *result)
+{
+    if (IS_MAP(target))
+    {
+        if (!tableGetHashed(&AS_MAP(target)->table, key, hash, result))
+            *result = NIL_VAL;
+        return NULL;
+    }
+
+    int item;
+    const char *error = checkIndex(target, key, &item);
+    if (error != NULL)
+        return error;
+    *result = IS_LIST(target) ? AS_LIST(target)->items.values[item] : NUMBER_VAL(AS_FLOAT_ARRAY(target)->values[item]);
+    return NULL;
+}
+
+// Stores target[key] = value, returns why it can't or NULL. Target, key and value must be reachable, a map may grow.
+static const char *setItem(VM *vm, Value target, Value key, uint32_t hash, Value value)
+{
+    if (IS_MAP(target))
+    {
+        if (IS_NIL(key))
+            return "Map keys can't be nil.";
+        if (tableSetHashed(vm, &AS_MAP(target)->table, key, hash, value))
+            AS_MAP(target)->size++;
+        return NULL;
+    }
+
+    int item;
+    const char *error = checkIndex(target, key, &item);
+    if (error != NULL)
+        return error;
+    if (IS_LIST(target))
+        AS_LIST(target)->items.values[item] = value;
+    else if (IS_NUMBER(value))
+        AS_FLOAT_ARRAY(target)->values[item] = AS_NUMBER(value);
+    else
+        return "Float array items must be numbers.";
+    return NULL;
+}
+
+// Replaces the `count` key/value pairs on top of the stack with a map of them, false if a key is nil.
+static bool buildMap(VM *vm, int count)
+{
+    Value *pairs = vm->stackTop - 2 * count;
+    for (int i = 0; i < count; i++)
+    {
+        if (IS_NIL(pairs[2 * i]))
+            return false;
+        flattenText(vm, &pairs[2 * i]);
+    }
+
+    ObjMap *map = newMap(vm);
+    push(vm, OBJ_VAL(map)); // Within the headroom, the stack doesn't move.
+    for (int i = 0; i < count; i++)
+    {
+        setItem(vm, OBJ_VAL(map), pairs[2 * i], hashValue(pairs[2 * i]), pairs[2 * i + 1]);
+    }
+    vm->stackTop = pairs;
+    push(vm, OBJ_VAL(map));
+    return true;
+}
+
 /*
-1. Calculates the length of the result string base on the lengths of the operands.
-2. Allocates a character array for the result and then copy the two halves in.
-3. '\n' finish string.
+A property site remembers the last few shapes it saw and what they resolved to, so an instance whose shape is among
+them skips the lookup. Once every entry is taken the site is megamorphic and every other shape takes the slow path.
+Isolates run the owner's chunks, whose caches they neither read nor fill.
 */
-static void concatenate()
+static CacheEntry *cacheLookup(VM *vm, InlineCache *cache, ObjShape *shape)
 {
-    ObjString *b = AS_STRING(pop());
-    ObjString *a = AS_STRING(pop());
-    int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
-    ObjString *result = takeString(chars, length);
-    push(OBJ_VAL(result));
+    if (vm->owner != NULL)
+        return NULL;
+    for (int i = 0; i < INLINE_CACHE_SIZE && cache->entries[i].shape != NULL; i++)
+    {
+        if (cache->entries[i].shape == shape)
+            return &cache->entries[i];
+    }
+    return NULL;
 }
 
-Value getCurrent()
+// A free entry for the shape, NULL if there's none or this VM doesn't fill caches.
+static CacheEntry *cacheAdd(VM *vm, InlineCache *cache, ObjShape *shape)
 {
-    if (vm.stackTop == vm.stack)
+    if (vm->owner != NULL)
+        return NULL;
+    for (int i = 0; i < INLINE_CACHE_SIZE; i++)
+    {
+        CacheEntry *entry = &cache->entries[i];
+        if (entry->shape == NULL)
+        {
+            entry->shape = shape;
+            entry->target = NULL;
+            entry->slot = -1;
+            entry->method = NULL;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Stores a field the instance doesn't have yet, `shape` being its shape with the field added.
+static void addField(VM *vm, ObjInstance *instance, ObjShape *shape, Value value)
+{
+    int slot = shape->fieldCount - 1;
+    if (slot == instance->fieldCapacity)
+    {
+        // The instance and the value are on the stack, a collection meanwhile still sees the old fields.
+        int capacity = GROW_CAPACITY(instance->fieldCapacity);
+        Value *fields = ALLOCATE(vm, Value, capacity);
+        if (slot > 0)
+            memcpy(fields, instance->fields, sizeof(Value) * slot);
+        if (instance->fields != instance->inlineFields)
+            FREE_ARRAY(vm, Value, instance->fields, instance->fieldCapacity);
+        instance->fields = fields;
+        instance->fieldCapacity = capacity;
+    }
+    instance->fields[slot] = value;
+    instance->shape = shape;
+    if (shape->fieldCount > shape->klass->fieldHint)
+        shape->klass->fieldHint = shape->fieldCount;
+}
+
+// Replaces the instance on top of the stack with the value of its property, false if it has none.
+static bool getProperty(VM *vm, ObjInstance *instance, ObjString *name, InlineCache *cache)
+{
+    ObjShape *shape = instance->shape;
+    int slot = shapeSlot(shape, name);
+    if (slot >= 0)
+    {
+        CacheEntry *entry = cacheAdd(vm, cache, shape);
+        if (entry != NULL)
+            entry->slot = slot;
+        vm->stackTop[-1] = instance->fields[slot];
+        return true;
+    }
+
+    Value method;
+    if (!tableGet(&shape->klass->methods, OBJ_VAL(name), &method))
+        return false;
+    CacheEntry *entry = cacheAdd(vm, cache, shape);
+    if (entry != NULL)
+        entry->method = AS_CLOSURE(method);
+    vm->stackTop[-1] = OBJ_VAL(newBoundMethod(vm, vm->stackTop[-1], AS_CLOSURE(method)));
+    return true;
+}
+
+static void setProperty(VM *vm, ObjInstance *instance, ObjString *name, Value value, InlineCache *cache)
+{
+    ObjShape *shape = instance->shape;
+    int slot = shapeSlot(shape, name);
+    if (slot >= 0)
+    {
+        CacheEntry *entry = cacheAdd(vm, cache, shape);
+        if (entry != NULL)
+            entry->slot = slot;
+        instance->fields[slot] = value;
+        return;
+    }
+
+    ObjShape *target = shapeAddField(vm, shape, name);
+    CacheEntry *entry = cacheAdd(vm, cache, shape);
+    if (entry != NULL)
+    {
+        entry->target = target;
+        entry->slot = target->fieldCount - 1;
+    }
+    addField(vm, instance, target, value);
+}
+
+/*
+Calls the method `name` of the receiver below the arguments. A field holding something callable works as well, it
+takes the receiver's place in the callee slot.
+*/
+static bool invoke(VM *vm, ObjString *name, int argCount, InlineCache *cache)
+{
+    Value receiver = vm->stackTop[-argCount - 1];
+    if (!IS_INSTANCE(receiver))
+    {
+        runtimeError(vm, "Only instances have methods.");
+        return false;
+    }
+    ObjInstance *instance = AS_INSTANCE(receiver);
+    CacheEntry *entry = cacheLookup(vm, cache, instance->shape);
+    if (entry != NULL)
+    {
+        if (entry->method != NULL)
+            return call(vm, entry->method, argCount);
+        vm->stackTop[-argCount - 1] = instance->fields[entry->slot];
+        return callValue(vm, vm->stackTop[-argCount - 1], argCount);
+    }
+
+    ObjShape *shape = instance->shape;
+    int slot = shapeSlot(shape, name);
+    if (slot >= 0)
+    {
+        entry = cacheAdd(vm, cache, shape);
+        if (entry != NULL)
+            entry->slot = slot;
+        vm->stackTop[-argCount - 1] = instance->fields[slot];
+        return callValue(vm, vm->stackTop[-argCount - 1], argCount);
+    }
+
+    Value method;
+    if (!tableGet(&shape->klass->methods, OBJ_VAL(name), &method))
+    {
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
+        return false;
+    }
+    entry = cacheAdd(vm, cache, shape);
+    if (entry != NULL)
+        entry->method = AS_CLOSURE(method);
+    return call(vm, AS_CLOSURE(method), argCount);
+}
+
+// Calls the superclass's method on `this`, the superclass on top of the stack goes first.
+static bool invokeSuper(VM *vm, ObjClass *superclass, ObjString *name, int argCount)
+{
+    Value method;
+    if (!tableGet(&superclass->methods, OBJ_VAL(name), &method))
+    {
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
+        return false;
+    }
+    return call(vm, AS_CLOSURE(method), argCount);
+}
+
+/*
+Replaces the two strings or ropes on top of the stack with their concatenation.
+A short result is a new string right away, the two halves are copied in after its header. It isn't interned, so
+nothing is looked up, and it's only hashed if it ends up a key.
+A longer one is a rope over the two operands, nothing is copied or hashed until something needs it flat.
+*/
+static void concatenate(VM *vm)
+{
+    // The operands stay on the stack until the result exists, allocating may collect them otherwise.
+    Value b = peek(vm, 0);
+    Value a = peek(vm, 1);
+    Obj *result;
+    if (IS_STRING(a) && IS_STRING(b) && AS_STRING(a)->length + AS_STRING(b)->length < ROPE_MIN_LENGTH)
+    {
+        ObjString *string = newString(vm, AS_STRING(a)->length + AS_STRING(b)->length);
+        memcpy(string->chars, AS_CSTRING(a), AS_STRING(a)->length);
+        memcpy(string->chars + AS_STRING(a)->length, AS_CSTRING(b), AS_STRING(b)->length);
+        result = (Obj *)string;
+    }
+    else
+    {
+        result = (Obj *)newRope(vm, AS_OBJ(a), AS_OBJ(b));
+    }
+    pop(vm);
+    pop(vm);
+    push(vm, OBJ_VAL(result));
+}
+
+Value getCurrent(VM *vm)
+{
+    if (vm->stackTop == vm->stack)
     {
         fprintf(stderr, "Runtime error: Stack underflow.\n");
         exit(1);
     }
-    return *(vm.stackTop - 1);
+    return *(vm->stackTop - 1);
 }
 
-void modifyCurrent(Value value)
+void modifyCurrent(VM *vm, Value value)
 {
-    Value *current = vm.stackTop - 1;
+    Value *current = vm->stackTop - 1;
     *current = value;
 }
 
@@ -299,257 +1330,740 @@ void modifyCurrent(Value value)
 // The most performance cost stuff occurs here.
 // If you want to learn some of these techniques, look up “direct threaded code”, “jump table”, and “computed goto”.
 
-static InterpretResult run()
+/*
+The current frame's ip, slots and constant pool live in locals so the C compiler can keep them in registers.
+They are written back to the frame (SAVE_IP) before anything that may inspect the frame: calls, errors and warnings.
+After a call or a return the new top frame is reloaded with LOAD_FRAME.
+*/
+static InterpretResult run(VM *vm)
 {
-    CallFrame *frame = &vm.frames[vm.frameCount - 1];
-#define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT() \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()]) // Next byte from bytecode
+    CallFrame *frame;
+    uint8_t *ip;
+    Value *slots;
+    Value *constants;
+    uint8_t instruction;
+#ifdef JIT_ENABLED
+    // Set while traceRecord() sees every instruction before it runs.
+    bool recording = false;
+#endif
+
+#define READ_BYTE() (*ip++)
 #define READ_SHORT() \
-    (frame->ip += 2, \
-     (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()]) // Next byte from bytecode
 #define READ_CONSTANT_LONG() \
-    (frame->closure->function->chunk.constants.values[(uint32_t)((READ_BYTE() << 16) | (READ_BYTE() << 8) | READ_BYTE())])
+    (ip += 3, constants[(uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1])])
+#define READ_HASH() \
+    (ip += 4, (uint32_t)ip[-4] << 24 | (uint32_t)ip[-3] << 16 | (uint32_t)ip[-2] << 8 | (uint32_t)ip[-1])
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
 #define READ_STRING() AS_STRING(READ_CONSTANT()) // It reads a one-byte operand from the bytecode chunk. It treats that as an index into the chunk’s constant table and returns the string at that index.
-    for (;;)
-    {
+#define SAVE_IP() (frame->ip = ip)
+// call() already made room for the whole frame, so run() skips the checks push() and pop() do.
+#ifdef DEBUG_CHECK_STACK
+#define PUSH(value) checkedPush(vm, frame, value)
+#define POP() checkedPop(vm, frame)
+#define DROP() ((void)checkedPop(vm, frame))
+#else
+#define PUSH(value) (*vm->stackTop++ = (value))
+#define POP() (*--vm->stackTop)
+#define DROP() (vm->stackTop--) // A POP() whose value isn't needed.
+#endif
+#define LOAD_FRAME()                                                   \
+    do                                                                 \
+    {                                                                  \
+        frame = &vm->frames[vm->frameCount - 1];                       \
+        ip = frame->ip;                                                \
+        slots = frame->slots;                                          \
+        constants = frame->closure->function->chunk.constants.values;  \
+    } while (false)
+/*
+Hands the top frame to its function's machine code, translating the function first once it's hot enough.
+Used where a frame starts or resumes and at loop back-edges, the native code comes back at the first instruction it
+can't run, with the interpreter picking up from there.
+*/
+#ifdef JIT_ENABLED
+#define JIT_TIER_UP()                                                                      \
+    do                                                                                     \
+    {                                                                                      \
+        ObjFunction *function = frame->closure->function;                                  \
+        if (function->jit == NULL && vm->jitEnabled && function->hotness >= JIT_THRESHOLD) \
+            jitCompile(vm, function);                                                      \
+        if (function->jit != NULL && !recording)                                           \
+        {                                                                                  \
+            SAVE_IP();                                                                     \
+            jitRun(function->jit, frame);                                                  \
+            LOAD_FRAME();                                                                  \
+        }                                                                                  \
+    } while (false)
+/*
+Counts a back-edge to the loop whose OP_LOOP is at `loop`, the top frame already jumped back to its header.
+A hot loop gets its next iteration recorded.
+*/
+#define RECORD_HOT_LOOP(loop)                                                   \
+    do                                                                          \
+    {                                                                           \
+        uint16_t *counter = HOT_LOOP_COUNTER(vm, loop);                         \
+        if (*counter > 1)                                                       \
+            (*counter)--;                                                       \
+        else                                                                    \
+        {                                                                       \
+            *counter = HOTLOOP_THRESHOLD;                                       \
+            SAVE_IP();                                                          \
+            if (!recording && vm->jitEnabled && traceStart(vm, frame, loop))    \
+                START_RECORDING();                                              \
+        }                                                                       \
+    } while (false)
+#else
+#define JIT_TIER_UP() \
+    do                \
+    {                 \
+    } while (false)
+#define RECORD_HOT_LOOP(loop) \
+    do                        \
+    {                         \
+    } while (false)
+#endif
+// Ropes are compared as their flat strings, the operands on top of the stack are flattened first.
+#define FLATTEN_OPERANDS()                                                \
+    do                                                                    \
+    {                                                                     \
+        if (IS_ROPE(vm->stackTop[-1]) || IS_ROPE(vm->stackTop[-2]))       \
+        {                                                                 \
+            flattenText(vm, &vm->stackTop[-1]);                           \
+            flattenText(vm, &vm->stackTop[-2]);                           \
+        }                                                                 \
+    } while (false)
+#define RUNTIME_ERROR(...)                  \
+    do                                      \
+    {                                       \
+        SAVE_IP();                          \
+        runtimeError(vm, __VA_ARGS__);      \
+        return INTERPRET_RUNTIME_ERROR;     \
+    } while (false)
+
 #define BINARY_OP(valueType, op)                        \
     do                                                  \
     {                                                   \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) \
+        {                                               \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        }                                               \
+        double b = AS_NUMBER(POP());                    \
+        double a = AS_NUMBER(POP());                    \
+        PUSH(valueType(a op b));                        \
+    } while (false)
+
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+
+// Rewrites the instruction being run into another form, the next time it runs it takes that one.
+// Shared code is read-only, it keeps running the generic forms.
+#define QUICKEN(instruction) (vm->owner != NULL || (ip[-1] = (instruction)))
+
+// A quickened instruction whose guard failed turns back into the generic one and runs it again.
+#define DEOPTIMIZE(instruction) \
+    do                          \
+    {                           \
+        QUICKEN(instruction);   \
+        ip--;                   \
+        DISPATCH();             \
+    } while (false)
+
+// Pops two numbers and jumps when `a op b` doesn't hold.
+#define COMPARE_JUMP(op)                                \
+    do                                                  \
+    {                                                   \
+        uint16_t offset = READ_SHORT();                 \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) \
         {                                               \
-            runtimeError("Operands must be numbers.");  \
-            return INTERPRET_RUNTIME_ERROR;             \
+            RUNTIME_ERROR("Operands must be numbers."); \
         }                                               \
-        double b = AS_NUMBER(pop());                    \
-        double a = AS_NUMBER(pop());                    \
-        push(valueType(a op b));                        \
+        double b = AS_NUMBER(POP());                    \
+        double a = AS_NUMBER(POP());                    \
+        if (!(a op b))                                  \
+            ip += offset;                               \
     } while (false)
 
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("                                          ");
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
-        {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(&frame->closure->function->chunk,
-                               (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION()                                         \
+    do                                                              \
+    {                                                               \
+        printf("                                          ");       \
+        for (Value *slot = vm->stack; slot < vm->stackTop; slot++)  \
+        {                                                           \
+            printf("[ ");                                           \
+            printValue(*slot);                                      \
+            printf(" ]");                                           \
+        }                                                           \
+        printf("\n");                                               \
+        disassembleInstruction(vm, &frame->closure->function->chunk, \
+                               (int)(ip - frame->closure->function->chunk.code)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() \
+    do                      \
+    {                       \
+    } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    // Every handler jumps straight to the next one through this table, so each opcode gets its own indirect branch.
+    static void *dispatchTable[] = {
+        [OP_CLOSE_UPVALUE] = &&L_OP_CLOSE_UPVALUE,
+        [OP_LOOP] = &&L_OP_LOOP,
+        [OP_CALL] = &&L_OP_CALL,
+        [OP_CLOSURE] = &&L_OP_CLOSURE,
+        [OP_JUMP] = &&L_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&L_OP_JUMP_IF_FALSE,
+        [OP_NIL] = &&L_OP_NIL,
+        [OP_TRUE] = &&L_OP_TRUE,
+        [OP_FALSE] = &&L_OP_FALSE,
+        [OP_POP] = &&L_OP_POP,
+        [OP_GET_LOCAL] = &&L_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&L_OP_SET_LOCAL,
+        [OP_GET_GLOBAL] = &&L_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&L_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL] = &&L_OP_SET_GLOBAL,
+        [OP_SET_UPVALUE] = &&L_OP_SET_UPVALUE,
+        [OP_GET_UPVALUE] = &&L_OP_GET_UPVALUE,
+        [OP_EQUAL] = &&L_OP_EQUAL,
+        [OP_GREATER] = &&L_OP_GREATER,
+        [OP_LESS] = &&L_OP_LESS,
+        [OP_CONSTANT] = &&L_OP_CONSTANT,
+        [OP_CONSTANT_LONG] = &&L_OP_CONSTANT_LONG,
+        [OP_ADD] = &&L_OP_ADD,
+        [OP_SUBTRACT] = &&L_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&L_OP_MULTIPLY,
+        [OP_DIVIDE] = &&L_OP_DIVIDE,
+        [OP_NEGATE] = &&L_OP_NEGATE,
+        [OP_NOT] = &&L_OP_NOT,
+        [OP_PRINT] = &&L_OP_PRINT,
+        [OP_RETURN] = &&L_OP_RETURN,
+        [OP_GENERATOR] = &&L_OP_GENERATOR,
+        [OP_YIELD] = &&L_OP_YIELD,
+        [OP_GENERATOR_RETURN] = &&L_OP_GENERATOR_RETURN,
+        [OP_BUILD_LIST] = &&L_OP_BUILD_LIST,
+        [OP_INDEX_GET] = &&L_OP_INDEX_GET,
+        [OP_INDEX_SET] = &&L_OP_INDEX_SET,
+        [OP_BUILD_MAP] = &&L_OP_BUILD_MAP,
+        [OP_GET_KEY] = &&L_OP_GET_KEY,
+        [OP_SET_KEY] = &&L_OP_SET_KEY,
+        [OP_CLASS] = &&L_OP_CLASS,
+        [OP_METHOD] = &&L_OP_METHOD,
+        [OP_INHERIT] = &&L_OP_INHERIT,
+        [OP_GET_PROPERTY] = &&L_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&L_OP_SET_PROPERTY,
+        [OP_INVOKE] = &&L_OP_INVOKE,
+        [OP_GET_SUPER] = &&L_OP_GET_SUPER,
+        [OP_SUPER_INVOKE] = &&L_OP_SUPER_INVOKE,
+        [OP_GREATER_EQUAL] = &&L_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL] = &&L_OP_LESS_EQUAL,
+        [OP_NOT_EQUAL] = &&L_OP_NOT_EQUAL,
+        [OP_POP_JUMP_IF_FALSE] = &&L_OP_POP_JUMP_IF_FALSE,
+        [OP_LESS_JUMP_IF_FALSE] = &&L_OP_LESS_JUMP_IF_FALSE,
+        [OP_GREATER_JUMP_IF_FALSE] = &&L_OP_GREATER_JUMP_IF_FALSE,
+        [OP_EQUAL_JUMP_IF_FALSE] = &&L_OP_EQUAL_JUMP_IF_FALSE,
+        [OP_GET_LOCAL_GET_LOCAL_ADD] = &&L_OP_GET_LOCAL_GET_LOCAL_ADD,
+        [OP_TAIL_CALL] = &&L_OP_TAIL_CALL,
+        [OP_ADD_NUM] = &&L_OP_ADD_NUM,
+        [OP_ADD_STR] = &&L_OP_ADD_STR,
+        [OP_EQUAL_NUM] = &&L_OP_EQUAL_NUM,
+        [OP_LOOP_TRACE] = &&L_OP_LOOP_TRACE,
+    };
+    void **table = dispatchTable;
+#ifdef JIT_ENABLED
+    // Sends every opcode to L_RECORD, dispatching through it records the instructions as they run.
+    static void *recordTable[sizeof(dispatchTable) / sizeof(dispatchTable[0])] = {
+        [0 ... sizeof(dispatchTable) / sizeof(dispatchTable[0]) - 1] = &&L_RECORD,
+    };
+#define START_RECORDING() (recording = true, table = recordTable)
+#define STOP_RECORDING() (recording = false, table = dispatchTable)
+#endif
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(op) L_##op
+#define DISPATCH()                                   \
+    do                                               \
+    {                                                \
+        TRACE_INSTRUCTION();                         \
+        goto *table[instruction = READ_BYTE()];      \
+    } while (false)
+#else
+#ifdef JIT_ENABLED
+#define START_RECORDING() (recording = true)
+#define STOP_RECORDING() (recording = false)
+#define INTERPRET_LOOP                                    \
+    loop:                                                 \
+    TRACE_INSTRUCTION();                                  \
+    if (recording && (SAVE_IP(), !traceRecord(vm, frame))) \
+        STOP_RECORDING();                                 \
+    switch (instruction = READ_BYTE())
+#else
+#define INTERPRET_LOOP \
+    loop:              \
+    TRACE_INSTRUCTION(); \
+    switch (instruction = READ_BYTE())
+#endif
+#define CASE(op) case op
+#define DISPATCH() goto loop
 #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE())
-        {
-        case OP_RETURN:
-        {
 
-            Value result = pop();
-            closeUpvalues(frame->slots);
-            vm.frameCount--;
-            if (vm.frameCount == 0)
+    LOAD_FRAME();
+    INTERPRET_LOOP
+    {
+#if defined(JIT_ENABLED) && defined(COMPUTED_GOTO)
+    L_RECORD:
+        frame->ip = ip - 1;
+        if (!traceRecord(vm, frame))
+            STOP_RECORDING();
+        goto *dispatchTable[instruction];
+#endif
+        CASE(OP_RETURN):
+        {
+            Value result = POP();
+            closeUpvalues(vm, slots);
+            vm->frameCount--;
+            if (vm->frameCount == 0)
             {
-                pop();
-                return INTERPRET_OK;
+                DROP();
+                if (vm->fiber == NULL || vm->fiber->caller == NULL)
+                    return INTERPRET_OK;
+                // A fiber's function returned, its caller's resume() gets the result.
+                finishFiber(vm, result);
+                LOAD_FRAME();
+                DISPATCH();
             }
 
-            vm.stackTop = frame->slots;
-            push(result);
-            frame = &vm.frames[vm.frameCount - 1];
-            break;
-        case OP_CONSTANT:
+            vm->stackTop = slots;
+            PUSH(result);
+            LOAD_FRAME();
+            JIT_TIER_UP();
+            DISPATCH();
+        }
+        CASE(OP_GENERATOR):
+            SAVE_IP();
+            makeGenerator(vm, frame);
+            LOAD_FRAME();
+            DISPATCH();
+        CASE(OP_YIELD):
+            SAVE_IP();
+            yieldGenerator(vm, frame);
+            LOAD_FRAME();
+            DISPATCH();
+        CASE(OP_GENERATOR_RETURN):
+        {
+            AS_GENERATOR(slots[0])->state = FIBER_DONE;
+            Value result = POP();
+            closeUpvalues(vm, slots);
+            vm->frameCount--;
+            vm->stackTop = slots;
+            PUSH(result);
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_BUILD_LIST):
+        {
+            int count = READ_BYTE();
+            // The items stay on the stack until the list has its copy, a collection meanwhile keeps them.
+            ObjList *list = newList(vm, vm->stackTop - count, count);
+            vm->stackTop -= count;
+            PUSH(OBJ_VAL(list));
+            DISPATCH();
+        }
+        CASE(OP_INDEX_GET):
+        {
+            flattenText(vm, &vm->stackTop[-1]);
+            Value target = vm->stackTop[-2];
+            Value key = vm->stackTop[-1];
+            const char *error = getItem(target, key, IS_MAP(target) ? hashValue(key) : 0, &vm->stackTop[-2]);
+            if (error != NULL)
+                RUNTIME_ERROR("%s", error);
+            vm->stackTop--;
+            DISPATCH();
+        }
+        CASE(OP_INDEX_SET):
+        {
+            flattenText(vm, &vm->stackTop[-2]);
+            Value target = vm->stackTop[-3];
+            Value key = vm->stackTop[-2];
+            const char *error = setItem(vm, target, key, IS_MAP(target) ? hashValue(key) : 0, vm->stackTop[-1]);
+            if (error != NULL)
+                RUNTIME_ERROR("%s", error);
+            vm->stackTop[-3] = vm->stackTop[-1];
+            vm->stackTop -= 2;
+            DISPATCH();
+        }
+        CASE(OP_BUILD_MAP):
+            if (!buildMap(vm, READ_BYTE()))
+                RUNTIME_ERROR("Map keys can't be nil.");
+            slots = frame->slots;
+            DISPATCH();
+        CASE(OP_GET_KEY):
+        {
+            Value key = READ_CONSTANT();
+            uint32_t hash = READ_HASH();
+            const char *error = getItem(vm->stackTop[-1], key, hash, &vm->stackTop[-1]);
+            if (error != NULL)
+                RUNTIME_ERROR("%s", error);
+            DISPATCH();
+        }
+        CASE(OP_SET_KEY):
+        {
+            Value key = READ_CONSTANT();
+            uint32_t hash = READ_HASH();
+            const char *error = setItem(vm, vm->stackTop[-2], key, hash, vm->stackTop[-1]);
+            if (error != NULL)
+                RUNTIME_ERROR("%s", error);
+            vm->stackTop[-2] = vm->stackTop[-1];
+            vm->stackTop--;
+            DISPATCH();
+        }
+        CASE(OP_CLASS):
+            PUSH(OBJ_VAL(newClass(vm, READ_STRING())));
+            DISPATCH();
+        CASE(OP_METHOD):
+        {
+            ObjString *name = READ_STRING();
+            ObjClass *klass = AS_CLASS(vm->stackTop[-2]);
+            tableSet(vm, &klass->methods, OBJ_VAL(name), vm->stackTop[-1]);
+            vm->stackTop--;
+            DISPATCH();
+        }
+        CASE(OP_INHERIT):
+        {
+            Value superclass = vm->stackTop[-2];
+            if (!IS_CLASS(superclass))
+                RUNTIME_ERROR("Superclass must be a class.");
+            // Methods are copied down once, the subclass's own ones are added after and override them.
+            tableAddAll(vm, &AS_CLASS(superclass)->methods, &AS_CLASS(vm->stackTop[-1])->methods);
+            vm->stackTop--;
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY):
+        {
+            ObjString *name = READ_STRING();
+            InlineCache *cache = READ_CACHE();
+            Value receiver = vm->stackTop[-1];
+            if (!IS_INSTANCE(receiver))
+                RUNTIME_ERROR("Only instances have properties.");
+            ObjInstance *instance = AS_INSTANCE(receiver);
+            CacheEntry *entry = cacheLookup(vm, cache, instance->shape);
+            if (entry != NULL && entry->method == NULL)
+                vm->stackTop[-1] = instance->fields[entry->slot];
+            else if (entry != NULL)
+                vm->stackTop[-1] = OBJ_VAL(newBoundMethod(vm, receiver, entry->method));
+            else if (!getProperty(vm, instance, name, cache))
+                RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY):
+        {
+            ObjString *name = READ_STRING();
+            InlineCache *cache = READ_CACHE();
+            Value target = vm->stackTop[-2];
+            if (!IS_INSTANCE(target))
+                RUNTIME_ERROR("Only instances have fields.");
+            ObjInstance *instance = AS_INSTANCE(target);
+            CacheEntry *entry = cacheLookup(vm, cache, instance->shape);
+            if (entry != NULL && entry->target == NULL)
+                instance->fields[entry->slot] = vm->stackTop[-1];
+            else if (entry != NULL)
+                addField(vm, instance, entry->target, vm->stackTop[-1]);
+            else
+                setProperty(vm, instance, name, vm->stackTop[-1], cache);
+            vm->stackTop[-2] = vm->stackTop[-1];
+            vm->stackTop--;
+            DISPATCH();
+        }
+        CASE(OP_INVOKE):
+        {
+            ObjString *name = READ_STRING();
+            int argCount = READ_BYTE();
+            InlineCache *cache = READ_CACHE();
+            SAVE_IP();
+            if (!invoke(vm, name, argCount, cache))
+                return INTERPRET_RUNTIME_ERROR;
+            LOAD_FRAME();
+            JIT_TIER_UP();
+            DISPATCH();
+        }
+        CASE(OP_GET_SUPER):
+        {
+            ObjString *name = READ_STRING();
+            ObjClass *superclass = AS_CLASS(POP());
+            Value method;
+            if (!tableGet(&superclass->methods, OBJ_VAL(name), &method))
+                RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+            vm->stackTop[-1] = OBJ_VAL(newBoundMethod(vm, vm->stackTop[-1], AS_CLOSURE(method)));
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE):
+        {
+            ObjString *name = READ_STRING();
+            int argCount = READ_BYTE();
+            ObjClass *superclass = AS_CLASS(POP());
+            SAVE_IP();
+            if (!invokeSuper(vm, superclass, name, argCount))
+                return INTERPRET_RUNTIME_ERROR;
+            LOAD_FRAME();
+            JIT_TIER_UP();
+            DISPATCH();
+        }
+        CASE(OP_CONSTANT):
         {
             Value constant = READ_CONSTANT();
-            push(constant);
-            break;
+            PUSH(constant);
+            DISPATCH();
         }
 
-        case OP_CONSTANT_LONG:
+        CASE(OP_CONSTANT_LONG):
         {
             Value constant = READ_CONSTANT_LONG();
-            push(constant);
-            break;
+            PUSH(constant);
+            DISPATCH();
         }
 
-        case OP_NEGATE:
-            if (!IS_NUMBER(peek(0)))
+        CASE(OP_NEGATE):
+            if (!IS_NUMBER(peek(vm, 0)))
             {
-                runtimeError("Operand must be a number.");
-                return INTERPRET_RUNTIME_ERROR;
+                RUNTIME_ERROR("Operand must be a number.");
             }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
-            break;
-        case OP_ADD:
+            vm->stackTop[-1] = NUMBER_VAL(-AS_NUMBER(peek(vm, 0)));
+            DISPATCH();
+        CASE(OP_ADD):
         {
 
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+            if (IS_TEXT(peek(vm, 0)) && IS_TEXT(peek(vm, 1)))
             {
-                concatenate();
+                QUICKEN(OP_ADD_STR);
+                concatenate(vm);
+                slots = frame->slots; // The push inside may have moved the stack.
             }
-            else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+            else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))
             {
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a + b));
+                QUICKEN(OP_ADD_NUM);
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(NUMBER_VAL(a + b));
             }
             else
             {
-                runtimeError("Operands must be two numbers or two strings.");
-                return INTERPRET_RUNTIME_ERROR;
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
             }
-            break;
+            DISPATCH();
         }
-        case OP_SUBTRACT:
+        CASE(OP_SUBTRACT):
             BINARY_OP(NUMBER_VAL, -);
-            break;
-        case OP_MULTIPLY:
+            DISPATCH();
+        CASE(OP_MULTIPLY):
             BINARY_OP(NUMBER_VAL, *);
-            break;
-        case OP_DIVIDE:
+            DISPATCH();
+        CASE(OP_DIVIDE):
             BINARY_OP(NUMBER_VAL, /);
-            break;
+            DISPATCH();
 
-        case OP_NOT:
-            push(BOOL_VAL(isFalsey(pop())));
-            break;
+        CASE(OP_NOT):
+            vm->stackTop[-1] = BOOL_VAL(isFalsey(peek(vm, 0)));
+            DISPATCH();
 
-        case OP_TRUE:
-            push(BOOL_VAL(true));
+        CASE(OP_TRUE):
+            PUSH(BOOL_VAL(true));
+            DISPATCH();
 
-            break;
+        CASE(OP_NIL):
+            PUSH(NIL_VAL);
+            DISPATCH();
 
-        case OP_NIL:
-            push(NIL_VAL);
+        CASE(OP_FALSE):
+            PUSH(BOOL_VAL(false));
+            DISPATCH();
 
-            break;
-        case OP_FALSE:
-            push(BOOL_VAL(false));
-            break;
-
-        case OP_EQUAL:
+        CASE(OP_EQUAL):
         {
-            Value b = pop();
-            Value a = pop();
-            push(BOOL_VAL(valuesEqual(a, b)));
-            break;
+            FLATTEN_OPERANDS();
+            Value b = POP();
+            Value a = POP();
+            if (IS_NUMBER(a) && IS_NUMBER(b))
+                QUICKEN(OP_EQUAL_NUM);
+            PUSH(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
         }
 
-        case OP_GREATER:
+        CASE(OP_GREATER):
             BINARY_OP(BOOL_VAL, >);
-            break;
-        case OP_LESS:
+            DISPATCH();
+        CASE(OP_LESS):
             BINARY_OP(BOOL_VAL, <);
-            break;
+            DISPATCH();
 
-        case OP_PRINT:
+        CASE(OP_PRINT):
         {
-            printValue(pop());
+            printValue(POP());
             printf("\n");
-            break;
+            DISPATCH();
         }
 
-        case OP_POP:
-            pop();
-            break;
+        CASE(OP_POP):
+            DROP();
+            DISPATCH();
 
-        case OP_DEFINE_GLOBAL:
+        CASE(OP_DEFINE_GLOBAL):
         {
-            /*
-                Note that we don’t pop the value until after we add it to the hash table.
-                That ensures the VM can still find the value if a garbage collection is triggered right in the middle of adding it to the hash table.
-                That’s a distinct possibility since the hash table requires dynamic allocation when it resizes.
-            */
-            Value val = READ_CONSTANT();
-            tableSet(&vm.globals, val, peek(0));
-            pop();
-            break;
+            GlobalSlot *global = &vm->globalSlots[READ_SHORT()];
+            global->value = peek(vm, 0);
+            global->defined = true;
+            DROP();
+            DISPATCH();
         }
 
-        case OP_GET_GLOBAL:
+        CASE(OP_GET_GLOBAL):
         {
-            Value kval = READ_CONSTANT();
-            Value value = NIL_VAL;
-            if (!tableGet(&vm.globals, kval, &value))
+            GlobalSlot *global = &vm->globalSlots[READ_SHORT()];
+            if (!global->defined)
             {
-                if (vm.replMode)
+                // The REPL only warns and reads the variable as nil.
+                if (vm->replMode)
                 {
-                    runtimeWarning("Undefined variable.");
-                    push(value);
+                    SAVE_IP();
+                    runtimeWarning(vm, "Undefined variable.");
                 }
                 else
                 {
-                    runtimeError("Undefined variable.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Undefined variable.");
                 }
             }
-            push(value);
-            break;
+            PUSH(global->value);
+            DISPATCH();
         }
 
-        case OP_SET_GLOBAL:
+        CASE(OP_SET_GLOBAL):
         {
-            Value kval = READ_CONSTANT();
-            if (tableSet(&vm.globals, kval, peek(0)))
+            // Assigning never defines a global, the slot stays undefined.
+            GlobalSlot *global = &vm->globalSlots[READ_SHORT()];
+            if (!global->defined)
             {
-                tableDelete(&vm.globals, &kval);
-                runtimeError("Undefined variable.");
-                return INTERPRET_RUNTIME_ERROR;
+                RUNTIME_ERROR("Undefined variable.");
             }
-            break;
+            global->value = peek(vm, 0);
+            DISPATCH();
         }
-        case OP_GET_LOCAL:
+        CASE(OP_GET_LOCAL):
         {
             uint8_t slot = READ_BYTE();
-            push(frame->slots[slot]);
-            break;
+            PUSH(slots[slot]);
+            DISPATCH();
         }
-        case OP_SET_LOCAL:
+        CASE(OP_SET_LOCAL):
         {
             uint8_t slot = READ_BYTE();
-            frame->slots[slot] = peek(0);
-            break;
+            slots[slot] = peek(vm, 0);
+            DISPATCH();
+        }
+        CASE(OP_JUMP):
+        {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
         }
-        case OP_JUMP:
+        CASE(OP_JUMP_IF_FALSE):
         {
             uint16_t offset = READ_SHORT();
-            frame->ip += offset;
-            break;
+            if (isFalsey(peek(vm, 0)))
+                ip += offset;
+            DISPATCH();
         }
-        case OP_JUMP_IF_FALSE:
+        CASE(OP_LOOP):
         {
             uint16_t offset = READ_SHORT();
-            if (isFalsey(peek(0)))
-                frame->ip += offset;
-            break;
+            ip -= offset;
+            if (vm->jitEnabled)
+                frame->closure->function->hotness++;
+            RECORD_HOT_LOOP(ip + offset - 3);
+            JIT_TIER_UP();
+            DISPATCH();
         }
-        case OP_LOOP:
+        CASE(OP_LOOP_TRACE):
         {
             uint16_t offset = READ_SHORT();
-            frame->ip -= offset;
-            break;
+            ip -= offset;
+            if (vm->jitEnabled)
+                frame->closure->function->hotness++;
+#ifdef JIT_ENABLED
+            if (!recording)
+            {
+                SAVE_IP();
+                traceRun(vm, frame);
+                LOAD_FRAME();
+            }
+#endif
+            JIT_TIER_UP();
+            DISPATCH();
         }
-        case OP_CALL:
+        CASE(OP_CALL):
         {
             int argCount = READ_BYTE();
-            if (!callValue(peek(argCount), argCount))
+            SAVE_IP();
+            if (!callValue(vm, peek(vm, argCount), argCount))
             {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm.frames[vm.frameCount - 1];
-            break;
+            LOAD_FRAME();
+            JIT_TIER_UP();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_CALL):
+        {
+            int argCount = READ_BYTE();
+            Value callee = peek(vm, argCount);
+            SAVE_IP();
+            // Anything but a closure takes the normal call path, the OP_RETURN after this then returns its result.
+            if (!(IS_CLOSURE(callee) ? tailCall(vm, AS_CLOSURE(callee), argCount) : callValue(vm, callee, argCount)))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            JIT_TIER_UP();
+            DISPATCH();
+        }
+        CASE(OP_ADD_NUM):
+        {
+            Value b = peek(vm, 0);
+            Value a = peek(vm, 1);
+            if (!IS_NUMBER(a) || !IS_NUMBER(b))
+                DEOPTIMIZE(OP_ADD);
+            vm->stackTop[-2] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+            vm->stackTop--;
+            DISPATCH();
+        }
+        CASE(OP_ADD_STR):
+        {
+            if (!IS_TEXT(peek(vm, 0)) || !IS_TEXT(peek(vm, 1)))
+                DEOPTIMIZE(OP_ADD);
+            concatenate(vm);
+            slots = frame->slots; // The push inside may have moved the stack.
+            DISPATCH();
+        }
+        CASE(OP_EQUAL_NUM):
+        {
+            Value b = peek(vm, 0);
+            Value a = peek(vm, 1);
+            if (!IS_NUMBER(a) || !IS_NUMBER(b))
+                DEOPTIMIZE(OP_EQUAL);
+            vm->stackTop[-2] = BOOL_VAL(AS_NUMBER(a) == AS_NUMBER(b));
+            vm->stackTop--;
+            DISPATCH();
         }
-        case OP_CLOSURE:
+        CASE(OP_CLOSURE):
         {
             ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-            ObjClosure *closure = newClosure(function);
-            push(OBJ_VAL(closure));
+            ObjClosure *closure = newClosure(vm, function);
+            PUSH(OBJ_VAL(closure));
             for (int i = 0; i < closure->upvalueCount; i++)
             {
                 uint8_t isLocal = READ_BYTE();
                 uint8_t index = READ_BYTE();
                 if (isLocal)
                 {
-                    closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                    closure->upvalues[i] = captureUpvalue(vm, slots + index);
                 }
                 else
                 {
@@ -557,49 +2071,139 @@ static InterpretResult run()
                 }
             }
 
-            break;
+            DISPATCH();
         }
-        case OP_GET_UPVALUE:
+        CASE(OP_GET_UPVALUE):
         {
             uint8_t slot = READ_BYTE();
-            push(*frame->closure->upvalues[slot]->location);
-            break;
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
         }
-        case OP_SET_UPVALUE:
+        CASE(OP_SET_UPVALUE):
         {
             uint8_t slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
-            break;
+            *frame->closure->upvalues[slot]->location = peek(vm, 0);
+            DISPATCH();
         }
-        case OP_CLOSE_UPVALUE:
+        CASE(OP_CLOSE_UPVALUE):
         {
-            closeUpvalues(vm.stackTop - 1);
-            pop();
+            closeUpvalues(vm, vm->stackTop - 1);
+            DROP();
 
-            break;
+            DISPATCH();
         }
 
+        // Written as the negated comparison they replace, so NaN compares the same as before fusing.
+        CASE(OP_GREATER_EQUAL):
+            BINARY_OP(NOT_BOOL_VAL, <);
+            DISPATCH();
+        CASE(OP_LESS_EQUAL):
+            BINARY_OP(NOT_BOOL_VAL, >);
+            DISPATCH();
+        CASE(OP_NOT_EQUAL):
+        {
+            FLATTEN_OPERANDS();
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VAL(!valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_POP_JUMP_IF_FALSE):
+        {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(POP()))
+                ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LESS_JUMP_IF_FALSE):
+            COMPARE_JUMP(<);
+            DISPATCH();
+        CASE(OP_GREATER_JUMP_IF_FALSE):
+            COMPARE_JUMP(>);
+            DISPATCH();
+        CASE(OP_EQUAL_JUMP_IF_FALSE):
+        {
+            uint16_t offset = READ_SHORT();
+            FLATTEN_OPERANDS();
+            Value b = POP();
+            Value a = POP();
+            if (!valuesEqual(a, b))
+                ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_GET_LOCAL_ADD):
+        {
+            Value a = slots[READ_BYTE()];
+            Value b = slots[READ_BYTE()];
+            if (IS_NUMBER(a) && IS_NUMBER(b))
+            {
+                PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                DISPATCH();
+            }
+            // Anything else takes the same path as the unfused OP_ADD.
+            PUSH(a);
+            PUSH(b);
+            if (IS_TEXT(a) && IS_TEXT(b))
+            {
+                concatenate(vm);
+                slots = frame->slots; // The push inside may have moved the stack.
+            }
+            else
+            {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            DISPATCH();
+        }
+    }
+
+    // Only reached when the switch dispatch sees a byte that isn't an opcode.
+    RUNTIME_ERROR("Unknown opcode %d.", instruction);
+
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_CONSTANT_LONG
 #undef READ_STRING
+#undef READ_HASH
+#undef READ_CACHE
+#undef SAVE_IP
+#undef PUSH
+#undef POP
+#undef DROP
+#undef LOAD_FRAME
+#undef JIT_TIER_UP
+#undef RECORD_HOT_LOOP
+#undef START_RECORDING
+#undef STOP_RECORDING
+#undef RUNTIME_ERROR
+#undef FLATTEN_OPERANDS
 #undef BINARY_OP
-        }
-        }
-    }
+#undef COMPARE_JUMP
+#undef NOT_BOOL_VAL
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef TRACE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
 
-    InterpretResult interpret(const char *source)
-    {
-        ObjFunction *function = compile(source);
-        if (function == NULL)
-            return INTERPRET_COMPILE_ERROR;
-        push(OBJ_VAL(function));
-        ObjClosure *closure = newClosure(function);
-        pop();
-        push(OBJ_VAL(closure));
-        // CallFrame *frame = &vm.frames[vm.frameCount++];
-        call(closure, 0);
-        return run();
-    }
+InterpretResult runFunction(VM *vm, ObjFunction *function)
+{
+    push(vm, OBJ_VAL(function));
+    ObjClosure *closure = newClosure(vm, function);
+    pop(vm);
+    push(vm, OBJ_VAL(closure));
+    // CallFrame *frame = &vm->frames[vm->frameCount++];
+    if (!call(vm, closure, 0))
+        return INTERPRET_RUNTIME_ERROR;
+    return run(vm);
+}
+
+InterpretResult interpret(VM *vm, const char *source)
+{
+    ObjFunction *function = compile(vm, source);
+    if (function == NULL)
+        return INTERPRET_COMPILE_ERROR;
+    return runFunction(vm, function);
+}
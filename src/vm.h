@@ -1,35 +1,76 @@
 #ifndef clox_vm_h
 #define clox_vm_h
-#define STACK_MAX 256
+#define STACK_INITIAL 256
 
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
+#define FRAMES_INITIAL 64
+// Default call depth limit, vm->maxFrames (--max-frames) can be changed before running code.
+#define FRAMES_MAX 100000
+// Free slots every frame keeps above its computed depth for the temporary pushes natives and the runtime make.
+#define STACK_HEADROOM 8
 
-// A CallFrame represents a single ongoing function call
+// A global variable, the compiler resolves every global name to one of these slots.
 typedef struct
+{
+    ObjString *name;
+    Value value;
+    bool defined; // False until OP_DEFINE_GLOBAL runs, reading or assigning before that is an error.
+} GlobalSlot;
+
+// A CallFrame represents a single ongoing function call
+typedef struct CallFrame
 {
     ObjClosure* closure;
     uint8_t* ip;
     Value* slots;
 } CallFrame;
 
-typedef struct
+typedef struct Parser Parser;
+typedef struct Recorder Recorder;
+typedef struct ChannelSet ChannelSet;
+
+/*
+One interpreter: its heap, stacks, globals and interned strings. Nothing is shared between VMs, so separate ones
+can run on separate threads as long as each is only used by one thread at a time.
+*/
+struct VM
 {
     bool replMode;
-    CallFrame frames[FRAMES_MAX];
+    bool jitEnabled; // Hot functions are translated to machine code, see jit.h.
+    VM *owner;       // The VM whose frozen code this isolate runs, see pool.h. Shared bytecode is never rewritten.
+    int isolate;     // Which isolate of its pool this is, 0 outside pools.
+    ChannelSet *channels; // Shared by the owner with all its isolates.
+    CallFrame *frames; // Grows on demand up to maxFrames.
     int frameCount;
-    int stackCount;
+    int frameCapacity;
+    int maxFrames;
     int stackCapacity;
-    Value *stack;    // LIFO PILE
+    Value *stack;    // LIFO PILE, grows on demand and every pointer into it is moved along.
     Value *stackTop; // Points just past the last item
-    Table globals;
+    Table globals; // Global name -> index of its slot in globalSlots.
+    GlobalSlot *globalSlots;
+    int globalCount;
+    int globalCapacity;
     Table strings;
+    ObjString *initString; // "init", looked up whenever a class is called.
     ObjUpvalue* openUpvalues;
+    ObjFiber *fiber; // The fiber running on the stack and frames above, NULL until the first resume().
+    bool parkedUpvalues; // Some fiber or generator has had open upvalues off the stack, see sweep().
+    size_t bytesAllocated; // Bytes handed out by reallocate() and not freed yet.
+    size_t nextGC;         // Threshold that triggers the next collection.
     Obj *objects;    // Objects list
-} VM;
+    int grayCount;
+    int grayCapacity;
+    Obj **grayStack; // Marked objects whose references aren't traced yet.
+    Parser *parser;  // The compilation in progress, the functions it's building are roots too.
+    uint16_t *hotLoops; // Loop back-edge counters, see trace.h.
+    Recorder *recorder; // The trace being recorded, allocated when the first loop gets hot.
+    bool nativeFailed;  // Set by nativeError(), the native's call then fails with the message.
+    char nativeError[256];
+};
 
 typedef enum
 {
@@ -38,21 +79,30 @@ typedef enum
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
-
-void initVM();
-void freeVM();
+void initVM(VM *vm);
+void freeVM(VM *vm);
 /*
 Given source code, it compiles it into a chunk. If compilation succeeds, it runs the code; otherwise, it frees the chunk and reports a compilation error.
 */
-InterpretResult interpret(const char *source);
+InterpretResult interpret(VM *vm, const char *source);
+// Runs a compiled script, the top level function `compile()` returned.
+InterpretResult runFunction(VM *vm, ObjFunction *function);
+/*
+Initializes vm to run code `owner` compiled, instead of initVM(). It gets the same global slots and the strings it
+creates are interned to the owner's ones. The owner must have frozen its objects and must outlive vm.
+*/
+void initIsolate(VM *vm, VM *owner);
+// Fails the native function being run with a runtime error, its return value is ignored.
+Value nativeError(VM *vm, const char *format, ...);
+// Returns the slot index of the global with the given name, adding an undefined slot the first time.
+int globalSlot(VM *vm, ObjString *name);
 // Push a value into the stack and increase the stackTop
-void push(Value value);
+void push(VM *vm, Value value);
 // Push back the stackTop and returns the "deleted" value.
-Value pop();
+Value pop(VM *vm);
 // Gets the current value from the slot.
-Value getCurrent();
+Value getCurrent(VM *vm);
 // Modifies the current slot with the given value.
-void modifyCurrent(Value value);
+void modifyCurrent(VM *vm, Value value);
 
 #endif
\ No newline at end of file